@@ -0,0 +1,45 @@
+# Compares ZOOM::Record's native ISO2709 parser with parsing Record#raw
+# using ruby-marc, on the Library of Congress record that the test suite
+# stores in test/record.dat.
+#
+#   ruby -I ext bench/marc_bench.rb [iterations]
+#
+# Needs the marc gem, and network access to z3950.loc.gov.
+
+require 'benchmark'
+require 'marc'
+require 'zoom'
+
+ITERATIONS = (ARGV[0] || 20_000).to_i
+
+record = nil
+ZOOM::Connection.open('z3950.loc.gov', 7090) do |conn|
+  conn.database_name = 'Voyager'
+  conn.preferred_record_syntax = 'USMARC'
+  record = conn.search('@attr 1=7 0253333490')[0]
+end
+raw = record.raw
+unless raw == File.binread('test/record.dat')
+  warn 'warning: the record differs from test/record.dat'
+end
+
+Benchmark.bmbm do |x|
+  x.report('ruby-marc: raw + decode') do
+    ITERATIONS.times do
+      marc = MARC::Reader.decode(record.raw)
+      marc.fields(['245', '100'])
+    end
+  end
+
+  x.report('native: marc_fields') do
+    ITERATIONS.times { record.marc_fields('245', '100') }
+  end
+
+  x.report('ruby-marc: 245$a') do
+    ITERATIONS.times { MARC::Reader.decode(record.raw)['245']['a'] }
+  end
+
+  x.report('native: subfields') do
+    ITERATIONS.times { record.subfields('245', 'a') }
+  end
+end
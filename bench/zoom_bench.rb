@@ -0,0 +1,267 @@
+# Measures Ruby/ZOOM against a Z39.50 server started on this machine, so
+# that runs can be compared between releases without depending on a remote
+# target.  The results are printed as JSON.
+#
+#   ruby -I ext bench/zoom_bench.rb [options]
+#   rake bench BENCH_OPTS='--records 5000 --output bench.json'
+#
+# By default zebrasrv serves a copy of the test/zebra configuration, loaded
+# with synthetic MARCXML records made from test/zebra/records.  With
+# --server ztest, yaz-ztest is used instead: it needs no loading, and makes
+# up USMARC records for any number of hits.
+#
+# The each_record memory high-water mark is read from /proc, and is only
+# reported on Linux.
+
+require 'fileutils'
+require 'json'
+require 'optparse'
+require 'tmpdir'
+require 'zoom'
+
+options = {
+  :server => 'zebra',
+  :port => 9998,
+  :records => 1000,
+  :iterations => 50,
+  :chunks => [1, 10, 50, 100],
+  :threads => [1, 2, 4, 8],
+  :output => nil
+}
+
+OptionParser.new do |opts|
+  opts.banner = 'Usage: zoom_bench.rb [options]'
+  opts.on('--server NAME', %w(zebra ztest),
+          'zebra (default) or ztest') { |v| options[:server] = v }
+  opts.on('--port N', Integer, 'port to listen on') { |v| options[:port] = v }
+  opts.on('--records N', Integer,
+          'number of records in the database') { |v| options[:records] = v }
+  opts.on('--iterations N', Integer,
+          'samples per latency measure') { |v| options[:iterations] = v }
+  opts.on('--chunks LIST', Array,
+          'presentChunk sizes to compare') { |v| options[:chunks] = v.map { |c| c.to_i } }
+  opts.on('--threads LIST', Array,
+          'thread counts to compare') { |v| options[:threads] = v.map { |t| t.to_i } }
+  opts.on('--output FILE', 'write the JSON report to FILE') { |v| options[:output] = v }
+end.parse!
+
+class ZoomBench
+
+  RECORD_TEMPLATE = File.join(File.dirname(__FILE__), '..', 'test', 'zebra',
+                              'records', 'programming_ruby.xml')
+
+  def initialize(options)
+    @options = options
+    @target = "localhost:#{options[:port]}/" +
+      (options[:server] == 'zebra' ? 'test' : 'Default')
+  end
+
+  def run
+    report = {
+      'ruby' => RUBY_DESCRIPTION,
+      'started_at' => Time.now.utc.strftime('%Y-%m-%dT%H:%M:%SZ'),
+      'server' => @options[:server],
+      'records' => @options[:records],
+      'iterations' => @options[:iterations]
+    }
+    with_server do
+      report['load_seconds'] = measure { load_records } if zebra?
+      report['connect'] = latencies { ZOOM::Connection.open(@target) { } }
+      report['options'] = option_rates
+      open_connection do |conn|
+        report['search'] = latencies { conn.search(query) }
+      end
+      report['fetch'] = fetch_rates
+      report['each_record'] = each_record_memory
+      report['threads'] = thread_scaling
+    end
+    report
+  end
+
+  private
+
+  def zebra?
+    @options[:server] == 'zebra'
+  end
+
+  # Searches the whole database: every synthetic zebra record has
+  # "benchmark" in its title, and yaz-ztest returns as many hits as the
+  # number in the query.
+  def query
+    zebra? ? '@attr 1=4 benchmark' : "@attr 1=4 #{@options[:records]}"
+  end
+
+  # Returns the value of the block.
+  def open_connection(&block)
+    result = nil
+    ZOOM::Connection.open(@target) do |conn|
+      conn.preferred_record_syntax = zebra? ? 'XML' : 'USMARC'
+      result = block.call(conn)
+    end
+    result
+  end
+
+  def with_server
+    Dir.mktmpdir('zoom-bench') do |dir|
+      listen = "tcp:@:#{@options[:port]}"
+      if zebra?
+        FileUtils.cp_r(File.join(File.dirname(__FILE__), '..', 'test',
+                                 'zebra', '.'), dir)
+        command = ['zebrasrv', '-l', File.join(dir, 'zebrasrv.log'), listen]
+      else
+        command = ['yaz-ztest', listen]
+      end
+      pid = fork do
+        Dir.chdir(dir)
+        STDERR.reopen(File::NULL)
+        exec(*command)
+      end
+      begin
+        wait_for_server
+        yield
+      ensure
+        Process.kill('TERM', pid)
+        Process.wait(pid)
+      end
+    end
+  end
+
+  def wait_for_server
+    deadline = Time.now + 10
+    begin
+      ZOOM::Connection.open(@target) { }
+    rescue RuntimeError
+      raise if Time.now > deadline
+      sleep 0.1
+      retry
+    end
+  end
+
+  def load_records
+    template = File.read(RECORD_TEMPLATE)
+    ZOOM::Connection.open(@target) do |conn|
+      package = conn.package
+      package.wait_action = 'waitIfPossible'
+      package.action = 'specialUpdate'
+      @options[:records].times do |i|
+        package.record = template.
+          sub(%r{(<controlfield tag="001">)[^<]*}) { "#{$1}bench#{i}" }.
+          sub(%r{(<subfield code="a">)Programming Ruby :}) { "#{$1}Benchmark record #{i} :" }
+        package.send('update')
+      end
+      package.send('commit')
+    end
+  end
+
+  def measure
+    started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    yield
+    Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+  end
+
+  # Returns summary statistics, in milliseconds, for the given block.
+  def latencies(&block)
+    samples = (1..@options[:iterations]).map { measure(&block) * 1000 }.sort
+    {
+      'mean_ms' => samples.inject(0) { |sum, s| sum + s } / samples.size,
+      'p50_ms' => samples[samples.size / 2],
+      'p95_ms' => samples[(samples.size * 0.95).ceil - 1],
+      'max_ms' => samples.last
+    }
+  end
+
+  # Applies the options of a typical request to a connection, one accessor
+  # at a time and with a single set_options call.
+  def option_rates
+    options = { :database_name => 'Default', :preferred_record_syntax => 'USMARC',
+                :element_set_name => 'F', :present_chunk => 20, :count => 10 }
+    conn = ZOOM::Connection.new
+    count = @options[:iterations] * 1000
+    accessors = measure do
+      count.times { options.each { |name, value| conn.send("#{name}=", value) } }
+    end
+    bulk = measure { count.times { conn.set_options(options) } }
+    { 'requests' => count,
+      'accessors_per_second' => count / accessors,
+      'set_options_per_second' => count / bulk }
+  end
+
+  # Fetches every record in windows of chunk records, through
+  # ResultSet#[begin, count]: each window is one present request, since
+  # ResultSet#[] with a single index always presents one record.
+  def fetch_rates
+    @options[:chunks].map do |chunk|
+      open_connection do |conn|
+        rset = conn.search(query)
+        rset.present_chunk = chunk
+        size = rset.size
+        seconds = measure do
+          0.step(size - 1, chunk) { |i| rset[i, [chunk, size - i].min] }
+        end
+        { 'chunk' => chunk, 'records' => size,
+          'seconds' => seconds, 'records_per_second' => size / seconds }
+      end
+    end
+  end
+
+  # Walks the whole result set with each_record in a child process, so the
+  # high-water mark only covers the iteration.
+  def each_record_memory
+    return nil unless File.readable?('/proc/self/status')
+    reader, writer = IO.pipe
+    pid = fork do
+      reader.close
+      open_connection do |conn|
+        rset = conn.search(query)
+        GC.start
+        before = proc_status('VmRSS')
+        count = 0
+        seconds = measure { rset.each_record { |record| record.raw; count += 1 } }
+        writer.write(JSON.generate('records' => count, 'seconds' => seconds,
+                                   'rss_before_kb' => before,
+                                   'hwm_kb' => proc_status('VmHWM')))
+      end
+      writer.close
+      exit!(0)
+    end
+    writer.close
+    result = reader.read
+    Process.wait(pid)
+    result.empty? ? nil : JSON.parse(result)
+  end
+
+  def proc_status(field)
+    File.read('/proc/self/status')[/^#{field}:\s+(\d+)/, 1].to_i
+  end
+
+  # Every thread opens its own connection, then searches and fetches the
+  # first ten records for a fixed amount of work per thread.
+  def thread_scaling
+    @options[:threads].map do |count|
+      searches = 0
+      mutex = Mutex.new
+      seconds = measure do
+        (1..count).map do
+          Thread.new do
+            open_connection do |conn|
+              @options[:iterations].times do
+                conn.search(query)[0, 10]
+                mutex.synchronize { searches += 1 }
+              end
+            end
+          end
+        end.each { |thread| thread.join }
+      end
+      { 'threads' => count, 'searches' => searches, 'seconds' => seconds,
+        'searches_per_second' => searches / seconds }
+    end
+  end
+
+end
+
+report = JSON.pretty_generate(ZoomBench.new(options).run)
+if options[:output]
+  File.write(options[:output], report + "\n")
+else
+  puts report
+end
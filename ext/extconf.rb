@@ -10,6 +10,12 @@ unless have_header('yaz/zoom.h')
   exit
 end
 
+have_header('ruby/thread.h')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('rb_gc_adjust_memory_usage')
+have_header('ruby/fiber/scheduler.h')
+have_func('rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h')
+
 $CFLAGS << " #{`yaz-config --cflags`} "
 $LDFLAGS << " #{`yaz-config --libs`} "
 
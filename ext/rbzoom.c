@@ -26,9 +26,17 @@ Init_zoom (void)
 
     mZoom = rb_define_module ("ZOOM");
 
+    Init_zoom_instrument (mZoom);
+    Init_zoom_metrics (mZoom);
     Init_zoom_connection (mZoom);
+    Init_zoom_tuning (mZoom);
     Init_zoom_query (mZoom);
     Init_zoom_resultset (mZoom);
+    Init_zoom_scanset (mZoom);
+    Init_zoom_result_cache (mZoom);
+    Init_zoom_record_store (mZoom);
     Init_zoom_record (mZoom);
     Init_zoom_package (mZoom);
+    Init_zoom_multiplexer (mZoom);
+    Init_zoom_connection_pool (mZoom);
 }
@@ -21,6 +21,12 @@
 
 #include <yaz/zoom.h>
 #include <ruby.h>
+#ifdef HAVE_RUBY_THREAD_H
+# include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_FIBER_SCHEDULER_H
+# include <ruby/fiber/scheduler.h>
+#endif
 #include <assert.h>
 
 /* initialization */
@@ -30,27 +36,177 @@ void Init_zoom_query (VALUE mZoom);
 void Init_zoom_resultset (VALUE mZoom);
 void Init_zoom_record (VALUE mZoom);
 void Init_zoom_package (VALUE mZoom);
+void Init_zoom_multiplexer (VALUE mZoom);
+void Init_zoom_connection_pool (VALUE mZoom);
+void Init_zoom_instrument (VALUE mZoom);
+void Init_zoom_metrics (VALUE mZoom);
+void Init_zoom_result_cache (VALUE mZoom);
+void Init_zoom_record_store (VALUE mZoom);
+void Init_zoom_scanset (VALUE mZoom);
+void Init_zoom_tuning (VALUE mZoom);
 
 /* rbzoomoptions.c */
 ZOOM_options ruby_hash_to_zoom_options (VALUE hash);
 VALUE zoom_option_value_to_ruby_value (const char *value);
 void define_zoom_option (VALUE klass, const char *option);
+struct rbz_option_ops {
+    const char *(*get) (VALUE obj, const char *key);
+    void (*set) (VALUE obj, const char *key, const char *value);
+};
+void rbz_define_options (VALUE klass, const struct rbz_option_ops *ops);
+const char *rbz_option_value (VALUE value, VALUE *str);
+const char *rbz_option_key (VALUE key, VALUE *str);
+void rbz_option_set (VALUE obj, VALUE key, VALUE value);
 
 /* rbzoomparse.c */
 ZOOM_query rbz_query_get (VALUE obj);
+VALUE rbz_query_key (VALUE obj);
+VALUE rbz_query_prefix (VALUE prefix);
+void rbz_query_quote (VALUE notation, VALUE term);
 
 /* rbzoomresultset.c */
-VALUE rbz_resultset_make (ZOOM_resultset resultset);
+VALUE rbz_resultset_make (ZOOM_resultset resultset, VALUE connection,
+                          VALUE criterion);
+VALUE rbz_resultset_make_cached (VALUE connection, VALUE criterion,
+                                 size_t size, VALUE page);
+void rbz_resultset_set_cache (VALUE obj, VALUE cache, VALUE key);
+VALUE rbz_resultset_destroy (VALUE obj);
+
+/* rbzoomresultcache.c */
+VALUE rbz_cache_key (ZOOM_connection connection, VALUE criterion);
+VALUE rbz_cache_resultset_key (ZOOM_connection connection,
+                               ZOOM_resultset resultset, VALUE criterion);
+int rbz_cache_lookup (VALUE cache, VALUE key, size_t *size, VALUE *page);
+void rbz_cache_store (VALUE cache, VALUE key, size_t size);
+void rbz_cache_store_records (VALUE cache, VALUE key, ZOOM_record *records,
+                              size_t begin, size_t count);
+
+/* rbzoomrecordstore.c */
+int rbz_store_read (VALUE obj, const char *key, VALUE *data, VALUE *meta);
+void rbz_store_write (VALUE obj, const char *key, const char *meta,
+                      size_t meta_len, const char *data, size_t data_len);
 
 /* rbzoomrecord.c */
+struct rbz_record;
 VALUE rbz_record_make (ZOOM_record record);
+VALUE rbz_record_borrow (ZOOM_record record, VALUE resultset,
+                         struct rbz_record **borrowed);
+void rbz_record_release_all (struct rbz_record **borrowed, int detach);
+VALUE rbz_record_make_stored (VALUE raw, VALUE syntax, VALUE database);
+VALUE rbz_record_string (VALUE obj, const char *type);
+const char *rbz_record_raw_data (VALUE obj, int *len);
+
+/* rbzoomconvert.c */
+struct rbz_converter;
+int rbz_iso2709_p (const char *buf, size_t len);
+int rbz_marc_mode (const char *form, size_t len);
+struct rbz_converter *rbz_converter_acquire (const char *from, const char *to);
+void rbz_converter_release (struct rbz_converter *conv);
+int rbz_converter_run (struct rbz_converter *conv, int mode, const char *buf,
+                       size_t len, const char **result, size_t *rsize);
+VALUE rbz_convert_records (VALUE records, VALUE form, VALUE from, VALUE to);
+
+/* rbzoomscanset.c */
+VALUE rbz_scanset_make (VALUE connection, VALUE criterion, VALUE options);
+
+/* rbzoomtuning.c */
+int rbz_tuning_p (VALUE connection);
+void rbz_tuning_record (VALUE connection, double started, size_t records,
+                        size_t bytes);
 
 /* rbzoompackage.c */
-VALUE rbz_package_make (ZOOM_connection connection, ZOOM_options options);
+VALUE rbz_package_make (VALUE connection, ZOOM_options options);
 
 /* rbconnection.c */
 void rbz_connection_check(VALUE obj); 
+ZOOM_connection rbz_connection_get (VALUE obj);
+ZOOM_resultset rbz_connection_search_resultset (VALUE obj, VALUE criterion);
+VALUE rbz_connection_error (ZOOM_connection connection);
+void rbz_connection_unblock (void *connection);
+void rbz_connection_wait (VALUE obj);
+void rbz_connection_busy (VALUE obj, long delta);
+void rbz_connection_without_gvl (VALUE obj, void *(*func) (void *),
+                                 void *data);
+void rbz_connection_queue_connect (VALUE obj, VALUE host, VALUE port);
+int rbz_connection_async_connected_p (VALUE obj);
+VALUE rbz_connection_close (VALUE obj);
+VALUE rbz_connection_closed_p (VALUE obj);
+VALUE rbz_connection_count_options_set (ZOOM_connection connection);
+void rbz_connection_restore_options (ZOOM_connection connection, VALUE saved);
+
+/* rbzoominstrument.c */
+enum rbz_operation {
+    RBZ_OP_CONNECT,
+    RBZ_OP_SEARCH,
+    RBZ_OP_PRESENT,
+    RBZ_OP_PACKAGE,
+    RBZ_OP_SCAN,
+    RBZ_OP_SORT,
+    RBZ_OP_LAST
+};
+extern const char *rbz_operation_names [RBZ_OP_LAST];
+#define RBZ_INSTRUMENT_SUBSCRIBERS  1
+#define RBZ_INSTRUMENT_METRICS      2
+extern int rbz_instrumenting;
+double rbz_instrument_clock (void);
+void rbz_instrument (enum rbz_operation operation, ZOOM_connection connection,
+                     double started, size_t records, size_t bytes);
+
+/* rbzoommetrics.c */
+void rbz_metrics_record (enum rbz_operation operation, const char *target,
+                         double duration, size_t records, size_t bytes,
+                         int error);
+
+/*
+ * Brackets an operation reported to ZOOM.subscribe subscribers and to the
+ * metrics registry.  The start time is 0 when neither is in use, in which
+ * case nothing is measured.
+ */
+#define RBZ_INSTRUMENT_START() \
+    (rbz_instrumenting ? rbz_instrument_clock () : 0.0)
+#define RBZ_INSTRUMENT_FINISH(operation, connection, started, records, bytes) \
+    do {                                                                \
+        if ((started) != 0.0)                                           \
+            rbz_instrument ((operation), (connection), (started),       \
+                            (records), (bytes));                        \
+    }                                                                   \
+    while (0)
+
+/* 
+ * Runs a blocking YAZ call without holding the GVL, so that other Ruby 
+ * threads keep running while we wait on the network.  If the calling thread
+ * is interrupted, the socket of the given connection is shut down, which 
+ * makes YAZ give up and return with a connection error.
+ */
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+# define RBZ_CALL_WITHOUT_GVL(func, data, ubf, ubf_data) \
+    rb_thread_call_without_gvl ((func), (data), (ubf), (ubf_data))
+#else
+# define RBZ_CALL_WITHOUT_GVL(func, data, ubf, ubf_data) ((func) (data))
+#endif
+#define RBZ_WITHOUT_GVL(func, data, connection) \
+    RBZ_CALL_WITHOUT_GVL ((func), (data), rbz_connection_unblock, (connection))
+
+/*
+ * Whether the current fiber is non-blocking, in which case network waits
+ * go through the fiber scheduler, see rbz_connection_wait.
+ */
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+# define RBZ_FIBER_SCHEDULED()  (!NIL_P (rb_fiber_scheduler_current ()))
+#else
+# define RBZ_FIBER_SCHEDULED()  0
+#endif
         
+/*
+ * Tells the GC about memory allocated by YAZ for an object, which it would
+ * not see otherwise, so that it runs as often as the memory held requires.
+ */
+#ifdef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+# define RBZ_ADJUST_MEMORY(diff)    rb_gc_adjust_memory_usage (diff)
+#else
+# define RBZ_ADJUST_MEMORY(diff)    ((void) 0)
+#endif
+
 /* useful macros */
 #if !defined (RVAL2CSTR)
 # define RVAL2CSTR(x)       (NIL_P (x) ? NULL : RSTRING_PTR(x))
@@ -64,5 +220,11 @@ void rbz_connection_check(VALUE obj);
 #if !defined (CBOOL2RVAL)
 # define CBOOL2RVAL(x)      (x ? Qtrue : Qfalse)
 #endif
+#if !defined (MIN)
+# define MIN(a, b)          ((a) < (b) ? (a) : (b))
+#endif
+#if !defined (MAX)
+# define MAX(a, b)          ((a) > (b) ? (a) : (b))
+#endif
 
 #endif /* __RBZOOM_H_ */
@@ -16,7 +16,10 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <sys/socket.h>
+#include <fcntl.h>
 #include "rbzoom.h"
+#include <ruby/io.h>
 
 #ifdef MAKING_RDOC_HAPPY
 mZoom = rb_define_module("ZOOM");
@@ -25,28 +28,48 @@ mZoom = rb_define_module("ZOOM");
 
 /* Document-class: ZOOM::Connection
  * The Connection object is a session with a target.
+ *
+ * Network waits are done without holding the GVL, so that other threads
+ * keep running.  In a non-blocking fiber, with a fiber scheduler set 
+ * (Fiber.set_scheduler), they go through the io_wait hook of the scheduler
+ * instead, so that the fibers of a single thread can use many connections
+ * concurrently.  A connection must still be used by one thread or fiber at
+ * a time.
  */
 static VALUE cZoomConnection;
 
 
+/*
+ * The connection holds no Ruby object: its result sets, scan sets and
+ * packages mark it instead.  The size of ZOOM connections is not known.
+ */
+static const rb_data_type_t rbz_connection_data_type = {
+    .wrap_struct_name = "ZOOM::Connection",
+    .function = {
+        .dfree = (RUBY_DATA_FUNC) ZOOM_connection_destroy,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
 static VALUE
 rbz_connection_make (ZOOM_connection connection)
 {
     return connection != NULL
-        ? Data_Wrap_Struct (cZoomConnection,
-                            NULL,
-                            ZOOM_connection_destroy,
-                            connection)
+        ? TypedData_Wrap_Struct (cZoomConnection,
+                                 &rbz_connection_data_type,
+                                 connection)
         : Qnil;
 }
 
-static ZOOM_connection
+ZOOM_connection
 rbz_connection_get (VALUE obj)
 {
     ZOOM_connection connection;
         
-    Data_Get_Struct (obj, struct ZOOM_connection_p, connection);
-    assert (connection != NULL);
+    TypedData_Get_Struct (obj, struct ZOOM_connection_p,
+                          &rbz_connection_data_type, connection);
+    if (connection == NULL)
+        rb_raise (rb_eIOError, "closed connection");
 
     return connection;
 }
@@ -66,6 +89,25 @@ rbz_connection_get (VALUE obj)
     }                                                   \
     while (0)
 
+/*
+ * Returns the error of the last operation on the connection as a 
+ * RuntimeError, in the same form RAISE_IF_FAILED would raise it, or nil.
+ */
+VALUE
+rbz_connection_error (ZOOM_connection connection)
+{
+    int error;
+    const char *errmsg;
+    const char *addinfo;
+
+    error = ZOOM_connection_error (connection, &errmsg, &addinfo);
+    if (error == 0)
+        return Qnil;
+
+    return rb_exc_new_str (rb_eRuntimeError,
+                           rb_sprintf ("%s (%d) %s", errmsg, error, addinfo));
+}
+
 void rbz_connection_check(VALUE obj)
 {
 	ZOOM_connection connection;
@@ -74,6 +116,403 @@ void rbz_connection_check(VALUE obj)
   	RAISE_IF_FAILED (connection);
 }
 
+/*
+ * Unblocking function for RBZ_WITHOUT_GVL: called from another thread when
+ * a thread blocked in YAZ must be interrupted.  Shutting the socket down 
+ * wakes up the pending poll() and aborts the current operation.
+ */
+void
+rbz_connection_unblock (void *data)
+{
+    ZOOM_connection connection;
+    int fd;
+
+    connection = (ZOOM_connection) data;
+    fd = ZOOM_connection_get_socket (connection);
+    if (fd >= 0)
+        shutdown (fd, SHUT_RDWR);
+}
+
+/* 
+ * Whether the user put the connection in asynchronous mode, in which case 
+ * the requests are left for the user to complete, with ZOOM::Multiplexer.
+ */
+static int
+rbz_connection_async_p (ZOOM_connection connection)
+{
+    const char *value;
+
+    value = ZOOM_connection_option_get (connection, "async");
+    return value != NULL && (strcmp (value, "1") == 0 
+                             || strcmp (value, "T") == 0);
+}
+
+static void *
+rbz_connection_wait_blocking (void *data)
+{
+    ZOOM_connection connection;
+
+    connection = (ZOOM_connection) data;
+    while (ZOOM_event (1, &connection))
+        ;
+
+    return NULL;
+}
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+struct rbz_fiber_wait {
+    VALUE scheduler;
+    ZOOM_connection connection;
+};
+
+/* 
+ * Same as ZOOM_event in a loop, but the socket is waited on with the 
+ * io_wait hook of the fiber scheduler instead of poll().
+ */
+static VALUE
+rbz_connection_wait_fiber (VALUE data)
+{
+    struct rbz_fiber_wait *wait;
+    ZOOM_connection connection;
+    VALUE io;
+    VALUE ready;
+    int fd;
+    int mask;
+    int events;
+    int timeout;
+
+    wait = (struct rbz_fiber_wait *) data;
+    connection = wait->connection;
+    io = Qnil;
+    fd = -1;
+
+    for (;;) {
+        if (ZOOM_event_nonblock (1, &connection))
+            continue;
+
+        mask = ZOOM_connection_get_mask (connection);
+        if (mask == 0 || ZOOM_connection_get_socket (connection) < 0)
+            break;
+
+        /* YAZ may reconnect, and get another socket */
+        if (fd != ZOOM_connection_get_socket (connection)) {
+            fd = ZOOM_connection_get_socket (connection);
+            io = rb_io_fdopen (fd, O_RDWR, NULL);
+            rb_funcall (io, rb_intern ("autoclose="), 1, Qfalse);
+        }
+
+        events = 0;
+        if (mask & ZOOM_SELECT_READ)
+            events |= RUBY_IO_READABLE;
+        if (mask & ZOOM_SELECT_WRITE)
+            events |= RUBY_IO_WRITABLE;
+        if (mask & ZOOM_SELECT_EXCEPT)
+            events |= RUBY_IO_PRIORITY;
+        timeout = ZOOM_connection_get_timeout (connection);
+
+        ready = rb_fiber_scheduler_io_wait (wait->scheduler, io, 
+                                            INT2NUM (events),
+                                            timeout > 0 
+                                                ? INT2NUM (timeout) : Qnil);
+        if (!RTEST (ready)) {
+            ZOOM_connection_fire_event_timeout (connection);
+            continue;
+        }
+        if (FIXNUM_P (ready))
+            events = FIX2INT (ready);
+
+        mask = 0;
+        if (events & RUBY_IO_READABLE)
+            mask |= ZOOM_SELECT_READ;
+        if (events & RUBY_IO_WRITABLE)
+            mask |= ZOOM_SELECT_WRITE;
+        if (events & RUBY_IO_PRIORITY)
+            mask |= ZOOM_SELECT_EXCEPT;
+        ZOOM_connection_fire_event_socket (connection, mask);
+    }
+    RB_GC_GUARD (io);
+
+    return Qnil;
+}
+#endif
+
+/* Number of calls using the connection without the GVL, as a Fixnum. */
+static ID id_busy;
+
+/*
+ * Counts a thread or fiber starting (delta 1) or ending (delta -1) to use
+ * the connection without the GVL.  ZOOM::Connection#close raises while the
+ * connection is busy, instead of destroying it under YAZ.
+ */
+void
+rbz_connection_busy (VALUE obj, long delta)
+{
+    VALUE busy;
+
+    busy = rb_attr_get (obj, id_busy);
+    rb_ivar_set (obj, id_busy,
+                 LONG2FIX ((NIL_P (busy) ? 0 : FIX2LONG (busy)) + delta));
+}
+
+static int
+rbz_connection_busy_p (VALUE obj)
+{
+    VALUE busy;
+
+    busy = rb_attr_get (obj, id_busy);
+    return !NIL_P (busy) && FIX2LONG (busy) > 0;
+}
+
+struct rbz_connection_call {
+    void *(*func) (void *);
+    void *data;
+    ZOOM_connection connection;
+};
+
+static VALUE
+rbz_connection_call_blocking (VALUE data)
+{
+    struct rbz_connection_call *call;
+
+    call = (struct rbz_connection_call *) data;
+    RBZ_WITHOUT_GVL (call->func, call->data, call->connection);
+
+    return Qnil;
+}
+
+static VALUE
+rbz_connection_call_done (VALUE obj)
+{
+    rbz_connection_busy (obj, -1);
+    return Qnil;
+}
+
+/*
+ * Runs func (data) without the GVL, as RBZ_WITHOUT_GVL does, with the
+ * connection marked busy until it returns or raises.
+ */
+void
+rbz_connection_without_gvl (VALUE obj, void *(*func) (void *), void *data)
+{
+    struct rbz_connection_call call;
+
+    call.func = func;
+    call.data = data;
+    call.connection = rbz_connection_get (obj);
+    rbz_connection_busy (obj, 1);
+    rb_ensure (rbz_connection_call_blocking, (VALUE) &call,
+               rbz_connection_call_done, obj);
+}
+
+/*
+ * Waits until YAZ is done with the requests queued on the connection.
+ * Connections are always connected in asynchronous mode, so YAZ only 
+ * queues requests, and the network is waited on here: without holding the
+ * GVL, or, in a non-blocking fiber, through the fiber scheduler, so that
+ * the other fibers of the thread keep running.
+ */
+void
+rbz_connection_wait (VALUE obj)
+{
+    ZOOM_connection connection;
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+    struct rbz_fiber_wait wait;
+    int state;
+#endif
+
+    connection = rbz_connection_get (obj);
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+    wait.scheduler = rb_fiber_scheduler_current ();
+    if (!NIL_P (wait.scheduler)) {
+        wait.connection = connection;
+        rbz_connection_busy (obj, 1);
+        rb_protect (rbz_connection_wait_fiber, (VALUE) &wait, &state);
+        rbz_connection_busy (obj, -1);
+        if (state != 0) {
+            /* The fiber was interrupted: give up, as a thread would */
+            rbz_connection_unblock (connection);
+            rb_jump_tag (state);
+        }
+        return;
+    }
+#endif
+
+    rbz_connection_without_gvl (obj, rbz_connection_wait_blocking, connection);
+}
+
+/* Set on the connections that YAZ drives in asynchronous mode. */
+static ID id_async_connected;
+
+/*
+ * Whether YAZ only queues the requests of the connection, which is the
+ * case once it was connected by rbz_connection_queue_connect.
+ */
+int
+rbz_connection_async_connected_p (VALUE obj)
+{
+    return RTEST (rb_attr_get (obj, id_async_connected));
+}
+
+/*
+ * Queues a connection in asynchronous mode, since YAZ only reads the async
+ * option here, and gives the user's async option back.
+ */
+void
+rbz_connection_queue_connect (VALUE obj, VALUE host, VALUE port)
+{
+    ZOOM_connection connection;
+    VALUE async;
+
+    connection = rbz_connection_get (obj);
+    async = CSTR2RVAL (ZOOM_connection_option_get (connection, "async"));
+
+    ZOOM_connection_option_set (connection, "async", "1");
+    ZOOM_connection_connect (connection, RVAL2CSTR (host), 
+                             NIL_P (port) ? 0 : FIX2INT (port));
+    ZOOM_connection_option_set (connection, "async", 
+                                NIL_P (async) ? "0" : RVAL2CSTR (async));
+    rb_ivar_set (obj, id_async_connected, Qtrue);
+    RB_GC_GUARD (host);
+}
+
+/*
+ * Connects, and waits for the connection unless the user asked for the 
+ * asynchronous mode.
+ */
+static void
+rbz_connection_do_connect (VALUE obj, VALUE host, VALUE port)
+{
+    ZOOM_connection connection;
+    double started;
+
+    connection = rbz_connection_get (obj);
+    started = RBZ_INSTRUMENT_START ();
+    rbz_connection_queue_connect (obj, host, port);
+    if (!rbz_connection_async_p (connection))
+        rbz_connection_wait (obj);
+    RBZ_INSTRUMENT_FINISH (RBZ_OP_CONNECT, connection, started, 0, 0);
+}
+
+struct rbz_connection_search {
+    VALUE self;
+    ZOOM_connection connection;
+    ZOOM_resultset resultset;
+    double started;
+};
+
+static VALUE
+rbz_connection_search_finish (VALUE data)
+{
+    struct rbz_connection_search *search;
+
+    search = (struct rbz_connection_search *) data;
+    if (!rbz_connection_async_p (search->connection))
+        rbz_connection_wait (search->self);
+    RBZ_INSTRUMENT_FINISH (RBZ_OP_SEARCH, search->connection, search->started,
+                           ZOOM_resultset_size (search->resultset), 0);
+
+    return Qnil;
+}
+
+/*
+ * Sends a search to the target, without holding the GVL, and returns the
+ * new result set, even if the search failed.  Strings are searched as PQF.
+ * The result set is destroyed if the wait is interrupted or a subscriber
+ * raises, since the caller has not wrapped it yet.
+ */
+ZOOM_resultset
+rbz_connection_search_resultset (VALUE self, VALUE criterion)
+{
+    struct rbz_connection_search search;
+    VALUE query;
+    int state;
+
+    search.self = self;
+    search.connection = rbz_connection_get (self);
+    query = TYPE (criterion) == T_STRING
+        ? rbz_query_prefix (criterion)
+        : criterion;
+
+    /*
+     * The query may be shared with other threads through the query cache,
+     * and YAZ takes a reference on it without locking: the search is only
+     * queued while we hold the GVL, the connection being in asynchronous
+     * mode, and the response is waited for without it.
+     */
+    search.started = RBZ_INSTRUMENT_START ();
+    search.resultset = ZOOM_connection_search (search.connection,
+                                               rbz_query_get (query));
+    RB_GC_GUARD (query);
+    assert (search.resultset != NULL);
+
+    rb_protect (rbz_connection_search_finish, (VALUE) &search, &state);
+    if (state != 0) {
+        ZOOM_resultset_destroy (search.resultset);
+        rb_jump_tag (state);
+    }
+
+    return search.resultset;
+}
+
+/*
+ * Search options that make the target answer with the number of hits only,
+ * whatever the piggyback options of the connection are.
+ */
+static const char *rbz_connection_count_options [][2] = {
+    { "count", "0" },
+    { "piggyback", "0" },
+    { "smallSetUpperBound", "0" },
+    { "largeSetLowerBound", "1" },
+    { "mediumSetPresentNumber", "0" },
+};
+
+#define RBZ_COUNT_OPTIONS \
+    (sizeof (rbz_connection_count_options) \
+     / sizeof (rbz_connection_count_options [0]))
+
+/*
+ * Sets the options of a count-only search on the connection, which YAZ
+ * reads when the search is sent, and returns the previous values, to give
+ * to rbz_connection_restore_options once the search is done.
+ */
+VALUE
+rbz_connection_count_options_set (ZOOM_connection connection)
+{
+    VALUE saved;
+    const char *key;
+    size_t i;
+
+    saved = rb_ary_new ();
+    for (i = 0; i < RBZ_COUNT_OPTIONS; i++) {
+        key = rbz_connection_count_options [i][0];
+        rb_ary_push (saved,
+                     rb_assoc_new (rb_str_new2 (key),
+                                   CSTR2RVAL (ZOOM_connection_option_get (
+                                       connection, key))));
+        ZOOM_connection_option_set (connection, key,
+                                    rbz_connection_count_options [i][1]);
+    }
+
+    return saved;
+}
+
+/* Sets back options saved as an Array of [key, value] pairs. */
+void
+rbz_connection_restore_options (ZOOM_connection connection, VALUE saved)
+{
+    VALUE pair;
+    VALUE value;
+    long i;
+
+    for (i = 0; i < RARRAY_LEN (saved); i++) {
+        pair = RARRAY_PTR (saved) [i];
+        value = RARRAY_PTR (pair) [1];
+        ZOOM_connection_option_set (connection,
+                                    RVAL2CSTR (RARRAY_PTR (pair) [0]),
+                                    NIL_P (value) ? NULL : RVAL2CSTR (value));
+    }
+}
 
 /*
  * call-seq: 
@@ -89,10 +528,12 @@ void rbz_connection_check(VALUE obj)
  *  
  * If a block is given, then it will be called once the connection is 
  * established, passing a reference to the connection object as a parameter, 
- * and destroying the connection automatically at the end of the block.
- * With no block, this method just returns the connection object.
+ * and closing the connection automatically at the end of the block (see
+ * ZOOM::Connection#close).  With no block, this method just returns the 
+ * connection object.
  *
- * Returns: a newly created ZOOM::Connection object.
+ * Returns: a newly created ZOOM::Connection object, or the value of the
+ * block.
  */
 static VALUE
 rbz_connection_open (int argc, VALUE *argv, VALUE self)
@@ -104,15 +545,15 @@ rbz_connection_open (int argc, VALUE *argv, VALUE self)
     
     rb_scan_args (argc, argv, "11", &host, &port);
 
-    connection = ZOOM_connection_new (RVAL2CSTR (host),
-                                      NIL_P (port) ? 0 : FIX2INT (port));
+    /* Same as ZOOM_connection_new, but connects without the GVL. */
+    connection = ZOOM_connection_create (NULL);
+    rb_connection = rbz_connection_make (connection);
+    rbz_connection_do_connect (rb_connection, host, port);
     RAISE_IF_FAILED (connection);
     
-    rb_connection = rbz_connection_make (connection);
-    if (rb_block_given_p ()) {
-        rb_yield(rb_connection);
-        return Qnil;
-    }
+    if (rb_block_given_p ())
+        return rb_ensure (rb_yield, rb_connection,
+                          rbz_connection_close, rb_connection);
     return rb_connection;
 }
 
@@ -178,15 +619,30 @@ rbz_connection_connect (int argc, VALUE *argv, VALUE self)
     
     rb_scan_args (argc, argv, "11", &host, &port);
   
+    rbz_connection_do_connect (self, host, port);
     connection = rbz_connection_get (self);
-    ZOOM_connection_connect (connection, 
-                             RVAL2CSTR (host), 
-                             NIL_P (port) ? 0 : FIX2INT (port));
     RAISE_IF_FAILED (connection); 
 
     return self;
 }
 
+static const char *
+rbz_connection_option_get (VALUE obj, const char *key)
+{
+    return ZOOM_connection_option_get (rbz_connection_get (obj), key);
+}
+
+static void
+rbz_connection_option_set (VALUE obj, const char *key, const char *value)
+{
+    ZOOM_connection_option_set (rbz_connection_get (obj), key, value);
+}
+
+static const struct rbz_option_ops rbz_connection_options = {
+    rbz_connection_option_get,
+    rbz_connection_option_set
+};
+
 /*
  * call-seq:
  * 	set_option(key, value)
@@ -202,13 +658,8 @@ rbz_connection_connect (int argc, VALUE *argv, VALUE self)
 static VALUE
 rbz_connection_set_option (VALUE self, VALUE key, VALUE val)
 {
-    ZOOM_connection connection;
-    
-    connection = rbz_connection_get (self);
-    ZOOM_connection_option_set (connection,
-                                RVAL2CSTR (key),
-                                RVAL2CSTR (rb_obj_as_string (val)));
-    RAISE_IF_FAILED (connection); 
+    rbz_option_set (self, key, val);
+    RAISE_IF_FAILED (rbz_connection_get (self)); 
     
     return self;
 }
@@ -225,20 +676,53 @@ rbz_connection_set_option (VALUE self, VALUE key, VALUE val)
  */
 static VALUE
 rbz_connection_get_option (VALUE self, VALUE key)
+{
+    return zoom_option_value_to_ruby_value (
+        rbz_connection_option_get (self, RVAL2CSTR (key)));
+}
+
+/*
+ * Searches the connection, or its result cache, and returns the result set.
+ */
+static VALUE
+rbz_connection_find (VALUE self, VALUE criterion)
 {
     ZOOM_connection connection;
-    const char *value;
- 
+    ZOOM_resultset resultset;
+    VALUE rb_resultset;
+    VALUE cache;
+    VALUE key;
+    VALUE page;
+    size_t size;
+
     connection = rbz_connection_get (self);
-    value = ZOOM_connection_option_get (connection,
-                                        RVAL2CSTR (key));
+    cache = rb_ivar_get (self, rb_intern ("@result_cache"));
+    key = Qnil;
+    if (!NIL_P (cache)) {
+        key = rbz_cache_key (connection, criterion);
+        if (!NIL_P (key) && rbz_cache_lookup (cache, key, &size, &page))
+            return rbz_resultset_make_cached (self, criterion, size, page);
+    }
+
+    resultset = rbz_connection_search_resultset (self, criterion);
+
+    /* Wrap first, so that the result set is released if we raise. */
+    rb_resultset = rbz_resultset_make (resultset, self, criterion);
+    RAISE_IF_FAILED (connection); 
 
-    return zoom_option_value_to_ruby_value (value);
+    /* An asynchronous search is still running, its size is not known yet */
+    if (!NIL_P (key) && !rbz_connection_async_p (connection)) {
+        rbz_cache_store (cache, key, ZOOM_resultset_size (resultset));
+        rbz_resultset_set_cache (rb_resultset, cache, key);
+    }
+  
+    return rb_resultset;
 }
 
 /*
  * call-seq: 
  * 	search(criterion)
+ * 	search(criterion) { |resultset| ... }
  *
  * criterion: the search criterion, either as a ZOOM::Query object or as a string,
  * representing a PQF query.
@@ -247,30 +731,241 @@ rbz_connection_get_option (VALUE self, VALUE key)
  * pass a reference to a ZOOM::Query object, or you can simply pass a string
  * that represents a PQF query.
  *
+ * If the connection has a ZOOM::Connection#result_cache, a search that is
+ * already in the cache is not sent to the target.  Searches sent in
+ * asynchronous mode are not cached, since they are not done yet.
+ *
+ * If a block is given, the result set is passed to it, and destroyed at the
+ * end of the block (see ZOOM::ResultSet#destroy), which releases it on the
+ * target as well.
+ *
  * This method raises an exception on error.
  * 
  * Returns: a result set from the search, as a ZOOM::ResultSet object,
- * empty if no results were found.
+ * empty if no results were found, or the value of the block.
  */
 static VALUE
 rbz_connection_search (VALUE self, VALUE criterion)
 {
-    ZOOM_connection connection;
+    VALUE rb_resultset;
+
+    rb_resultset = rbz_connection_find (self, criterion);
+    if (rb_block_given_p ())
+        return rb_ensure (rb_yield, rb_resultset,
+                          rbz_resultset_destroy, rb_resultset);
+
+    return rb_resultset;
+}
+
+struct rbz_connection_count {
+    VALUE self;
+    VALUE saved;
     ZOOM_resultset resultset;
+    size_t size;
+};
+
+static VALUE
+rbz_connection_count_wait (VALUE data)
+{
+    rbz_connection_wait (((struct rbz_connection_count *) data)->self);
+
+    return Qnil;
+}
+
+static VALUE
+rbz_connection_count_release (VALUE data)
+{
+    struct rbz_connection_count *count;
+
+    count = (struct rbz_connection_count *) data;
+    if (!RTEST (rbz_connection_closed_p (count->self)))
+        rbz_connection_restore_options (rbz_connection_get (count->self),
+                                        count->saved);
+    count->size = ZOOM_resultset_size (count->resultset);
+    ZOOM_resultset_destroy (count->resultset);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ * 	count(criterion)
+ * 	count
+ *
+ * criterion: the search criterion, either as a ZOOM::Query object or as a
+ * string, representing a PQF query.
+ *
+ * Without a criterion, returns the count option, like the other option
+ * readers.
+ *
+ * Searches the connection for the number of hits only.  Whatever the
+ * piggyback options of the connection are, the target is asked not to
+ * send any record with its response, and no ZOOM::ResultSet object is
+ * created: the result set is released as soon as its size is known.  The
+ * search is waited for even if the connection is in asynchronous mode; use
+ * ZOOM::Multiplexer#count to count on many targets at the same time.
+ *
+ * If the connection has a ZOOM::Connection#result_cache, a search that is
+ * already in the cache is not sent to the target, and the number of hits is
+ * added to the cache otherwise.
+ *
+ * This method raises an exception on error.
+ *
+ * Returns: the number of hits, as an integer.
+ */
+static VALUE
+rbz_connection_count (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_connection_count count;
+    ZOOM_connection connection;
+    VALUE criterion;
+    VALUE cache;
+    VALUE key;
+    VALUE query;
+    size_t size;
+    double started;
+
+    if (rb_scan_args (argc, argv, "01", &criterion) == 0)
+        return zoom_option_value_to_ruby_value (
+            rbz_connection_option_get (self, "count"));
 
     connection = rbz_connection_get (self);
-    if (TYPE (criterion) == T_STRING)
-        resultset = ZOOM_connection_search_pqf (connection,
-                                                RVAL2CSTR (criterion));
-    else
-        resultset = ZOOM_connection_search (connection,
-                                            rbz_query_get (criterion));
-    RAISE_IF_FAILED (connection); 
-    assert (resultset != NULL);
-  
-    return rbz_resultset_make (resultset);
+    cache = rb_ivar_get (self, rb_intern ("@result_cache"));
+    key = Qnil;
+    if (!NIL_P (cache)) {
+        key = rbz_cache_key (connection, criterion);
+        if (!NIL_P (key) && rbz_cache_lookup (cache, key, &size, NULL))
+            return SIZET2NUM (size);
+    }
+
+    query = TYPE (criterion) == T_STRING
+        ? rbz_query_prefix (criterion)
+        : criterion;
+
+    started = RBZ_INSTRUMENT_START ();
+    count.self = self;
+    count.saved = rbz_connection_count_options_set (connection);
+    count.resultset = ZOOM_connection_search (connection,
+                                              rbz_query_get (query));
+    assert (count.resultset != NULL);
+    rb_ensure (rbz_connection_count_wait, (VALUE) &count,
+               rbz_connection_count_release, (VALUE) &count);
+    RB_GC_GUARD (query);
+    RBZ_INSTRUMENT_FINISH (RBZ_OP_SEARCH, connection, started, count.size, 0);
+    RAISE_IF_FAILED (connection);
+
+    if (!NIL_P (key))
+        rbz_cache_store (cache, key, count.size);
+
+    return SIZET2NUM (count.size);
 }
 
+/*
+ * call-seq:
+ * 	close
+ *
+ * Closes the connection: its socket is closed and the memory held by YAZ is
+ * freed now, rather than when the object is garbage collected.  Result sets
+ * of the connection keep the records they already retrieved, but any other
+ * use of the connection, or of its result sets, raises an IOError.
+ *
+ * Closing a connection that is closed already does nothing.  Closing a
+ * connection while another thread or fiber waits on it raises an IOError.
+ *
+ * Returns: nil.
+ */
+VALUE
+rbz_connection_close (VALUE self)
+{
+    ZOOM_connection connection;
+
+    TypedData_Get_Struct (self, struct ZOOM_connection_p,
+                          &rbz_connection_data_type, connection);
+    if (connection != NULL) {
+        if (rbz_connection_busy_p (self))
+            rb_raise (rb_eIOError, "connection in use");
+        RTYPEDDATA_DATA (self) = NULL;
+        ZOOM_connection_destroy (connection);
+    }
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ * 	closed?
+ *
+ * Returns: whether the connection is closed.
+ */
+VALUE
+rbz_connection_closed_p (VALUE self)
+{
+    return CBOOL2RVAL (rb_check_typeddata (self, 
+                                           &rbz_connection_data_type) == NULL);
+}
+
+/*
+ * call-seq:
+ * 	scan(term, options=nil)
+ *
+ * term: the term to scan from, as a PQF string with its attributes (for
+ * example '@attr 1=4 dinosaur'), or a ZOOM::Query object.
+ *
+ * options: a Hash of options for this scan only (optional), such as
+ * :number, the number of terms to return (20 by default), :position, the
+ * preferred position of the given term in them (1 by default, the first),
+ * and :step_size, the number of terms to skip between two returned terms.
+ *
+ * Scans (browses) an index of the target from the given term, in one 
+ * round-trip.  The network wait is done without holding the GVL.
+ *
+ * This method raises an ArgumentError if the PQF term cannot be parsed, and
+ * an exception on other errors.
+ *
+ * Returns: the terms found, as a ZOOM::ScanSet object.
+ */
+static VALUE
+rbz_connection_scan (int argc, VALUE *argv, VALUE self)
+{
+    VALUE term;
+    VALUE options;
+
+    rb_scan_args (argc, argv, "11", &term, &options);
+
+    return rbz_scanset_make (self, term, options);
+}
+
+/*
+ * call-seq:
+ * 	result_cache = cache
+ *
+ * cache: a ZOOM::ResultCache object, or nil.
+ *
+ * Makes the connection answer repeated searches from the given cache,
+ * which may be shared with other connections.
+ *
+ * Returns: cache.
+ */
+static VALUE
+rbz_connection_set_result_cache (VALUE self, VALUE cache)
+{
+    if (!NIL_P (cache) && !rb_obj_is_kind_of (cache, 
+                                              rb_path2class ("ZOOM::ResultCache")))
+        rb_raise (rb_eArgError, "Invalid argument of type %s (not ZOOM::ResultCache)",
+                  rb_class2name (CLASS_OF (cache)));
+    rb_ivar_set (self, rb_intern ("@result_cache"), cache);
+
+    return cache;
+}
+
+/*
+ * Returns: the ZOOM::ResultCache of the connection, or nil.
+ */
+static VALUE
+rbz_connection_result_cache (VALUE self)
+{
+    return rb_ivar_get (self, rb_intern ("@result_cache"));
+}
 
 /*
  * Constructs a new extended services ZOOM::Package using this connections host information.
@@ -283,13 +978,11 @@ rbz_connection_search (VALUE self, VALUE criterion)
 static VALUE
 rbz_connection_package(VALUE self)
 {
-  ZOOM_connection connection;
   ZOOM_options options;
   VALUE package;
 
-  connection = rbz_connection_get (self);
   options = ZOOM_options_create ();
-  package = rbz_package_make(connection, options);
+  package = rbz_package_make(self, options);
   return package;
 }
 
@@ -299,7 +992,11 @@ Init_zoom_connection (VALUE mZoom)
 {
     VALUE c;
 
+    id_async_connected = rb_intern ("__async_connected__");
+    id_busy = rb_intern ("__busy__");
+
     c = rb_define_class_under (mZoom, "Connection", rb_cObject); 
+    rb_undef_alloc_func (c);
     rb_define_singleton_method (c, "open", rbz_connection_open, -1);
     rb_define_singleton_method (c, "new", rbz_connection_new, -1);
     rb_define_method (c, "connect", rbz_connection_connect, -1);
@@ -307,6 +1004,7 @@ Init_zoom_connection (VALUE mZoom)
     rb_define_method (c, "get_option", rbz_connection_get_option, 1);
     rb_define_method (c, "package", rbz_connection_package, 0);
 
+    rbz_define_options (c, &rbz_connection_options);
     define_zoom_option (c, "implementationName");
     define_zoom_option (c, "user");
     define_zoom_option (c, "group");
@@ -339,6 +1037,12 @@ Init_zoom_connection (VALUE mZoom)
     define_zoom_option (c, "setname");
     
     rb_define_method (c, "search", rbz_connection_search, 1);
+    rb_define_method (c, "count", rbz_connection_count, -1);
+    rb_define_method (c, "close", rbz_connection_close, 0);
+    rb_define_method (c, "closed?", rbz_connection_closed_p, 0);
+    rb_define_method (c, "scan", rbz_connection_scan, -1);
+    rb_define_method (c, "result_cache=", rbz_connection_set_result_cache, 1);
+    rb_define_method (c, "result_cache", rbz_connection_result_cache, 0);
     
     cZoomConnection = c;
 }
@@ -0,0 +1,737 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <poll.h>
+#include <time.h>
+#include "rbzoom.h"
+
+#ifdef MAKING_RDOC_HAPPY
+mZoom = rb_define_module("ZOOM");
+#endif
+
+/* Document-class: ZOOM::ConnectionPool
+ *
+ * A pool of established connections, shared between threads, so that each
+ * request does not have to pay for a TCP connection and a Z39.50 Init.
+ * Connections are kept per target, that is per host, port, database and
+ * credentials.
+ *
+ * 	POOL = ZOOM::ConnectionPool.new(:max_per_target => 8)
+ *
+ * 	POOL.with('z3950.loc.gov:7090/Voyager',
+ * 	          'preferredRecordSyntax' => 'USMARC') do |conn|
+ * 	  conn.search('@attr 1=7 0253333490')[0]
+ * 	end
+ *
+ * The options a request changes do not leak to the next one: on checkin,
+ * automatic tuning (ZOOM::Connection#auto_tune) is disabled, and the
+ * options listed below are set back to their values on a new connection.
+ *
+ * preferredRecordSyntax, elementSetName, schema, async, presentChunk,
+ * timeout, count, start, piggyback, smallSetUpperBound, largeSetLowerBound,
+ * mediumSetPresentNumber, preferredMessageSize and maximumRecordSize.
+ */
+static VALUE cZoomConnectionPool;
+static VALUE cZoomConnection;
+
+/* Options set back on checkin, see the documentation of the class. */
+static const char *rbz_pool_reset_options [] = {
+    "preferredRecordSyntax", "elementSetName", "schema", "async",
+    "presentChunk", "timeout", "count", "start", "piggyback",
+    "smallSetUpperBound", "largeSetLowerBound", "mediumSetPresentNumber",
+    "preferredMessageSize", "maximumRecordSize", NULL
+};
+
+/* [[key, value], ...] of the reset options, kept on each connection. */
+static ID id_pool_defaults;
+
+struct rbz_pool {
+    VALUE mutex;
+    VALUE available;        /* ConditionVariable, signaled on checkin */
+    VALUE targets;          /* Hash: key => [idle connections, busy count] */
+    VALUE checked_out;      /* Hash: connection => key */
+    VALUE result_cache;     /* given to every new connection */
+
+    long max_per_target;
+    double idle_timeout;
+    double checkout_timeout;
+
+    size_t checkouts;
+    size_t waits;
+    size_t creates;
+    size_t evictions;
+};
+
+static void
+rbz_pool_mark (struct rbz_pool *pool)
+{
+    rb_gc_mark (pool->mutex);
+    rb_gc_mark (pool->available);
+    rb_gc_mark (pool->targets);
+    rb_gc_mark (pool->checked_out);
+    rb_gc_mark (pool->result_cache);
+}
+
+static size_t
+rbz_pool_memsize (const void *data)
+{
+    return sizeof (struct rbz_pool);
+}
+
+static const rb_data_type_t rbz_pool_data_type = {
+    .wrap_struct_name = "ZOOM::ConnectionPool",
+    .function = {
+        .dmark = (RUBY_DATA_FUNC) rbz_pool_mark,
+        .dfree = RUBY_TYPED_DEFAULT_FREE,
+        .dsize = rbz_pool_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+rbz_pool_alloc (VALUE klass)
+{
+    struct rbz_pool *pool;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct (klass,
+                                 struct rbz_pool,
+                                 &rbz_pool_data_type,
+                                 pool);
+    pool->mutex = Qnil;
+    pool->available = Qnil;
+    pool->targets = Qnil;
+    pool->checked_out = Qnil;
+    pool->result_cache = Qnil;
+
+    return obj;
+}
+
+static struct rbz_pool *
+rbz_pool_get (VALUE obj)
+{
+    struct rbz_pool *pool;
+
+    TypedData_Get_Struct (obj, struct rbz_pool, &rbz_pool_data_type, pool);
+    assert (pool != NULL);
+    if (NIL_P (pool->mutex))
+        rb_raise (rb_eRuntimeError, "uninitialized connection pool");
+
+    return pool;
+}
+
+static double
+rbz_pool_now (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static VALUE
+rbz_pool_option (VALUE options, const char *name, VALUE defval)
+{
+    VALUE value;
+
+    value = rb_hash_aref (options, ID2SYM (rb_intern (name)));
+    return NIL_P (value) ? defval : value;
+}
+
+/*
+ * call-seq:
+ * 	new(options={})
+ *
+ * options: a Hash, with the following keys (all optional):
+ * :max_per_target, the maximum number of connections open to one target at
+ * a time, 4 by default; :idle_timeout, the number of seconds after which an
+ * unused connection is dropped, 60 by default; :checkout_timeout, the maximum
+ * number of seconds to wait for a connection when all connections to the
+ * target are in use, 5 by default; :result_cache, a ZOOM::ResultCache given
+ * to every connection of the pool.
+ *
+ * Creates a new, empty, connection pool.
+ *
+ * Returns: a newly created ZOOM::ConnectionPool object.
+ */
+static VALUE
+rbz_pool_initialize (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_pool *pool;
+    VALUE options;
+    VALUE cv;
+
+    rb_scan_args (argc, argv, "01", &options);
+    if (NIL_P (options))
+        options = rb_hash_new ();
+
+    TypedData_Get_Struct (self, struct rbz_pool, &rbz_pool_data_type, pool);
+    pool->max_per_target =
+        NUM2LONG (rbz_pool_option (options, "max_per_target", INT2FIX (4)));
+    pool->idle_timeout =
+        NUM2DBL (rbz_pool_option (options, "idle_timeout", INT2FIX (60)));
+    pool->checkout_timeout =
+        NUM2DBL (rbz_pool_option (options, "checkout_timeout", INT2FIX (5)));
+    pool->result_cache = rbz_pool_option (options, "result_cache", Qnil);
+    if (pool->max_per_target <= 0)
+        rb_raise (rb_eArgError, "max_per_target must be positive");
+
+    cv = rb_path2class ("Thread::ConditionVariable");
+    pool->available = rb_class_new_instance (0, NULL, cv);
+    pool->targets = rb_hash_new ();
+    pool->checked_out = rb_hash_new ();
+    rb_funcall (pool->checked_out, rb_intern ("compare_by_identity"), 0);
+    pool->mutex = rb_mutex_new ();
+
+    return self;
+}
+
+static int
+rbz_pool_key_option (VALUE key, VALUE value, VALUE named)
+{
+    VALUE str;
+
+    rb_hash_aset (named, rb_str_new2 (rbz_option_key (key, &str)), value);
+    return ST_CONTINUE;
+}
+
+/*
+ * Connections are shared between requests for the same host, database and
+ * credentials.  Other options are applied again on every checkout.  The
+ * options are looked up by the name of the ZOOM option they set, so that
+ * 'user' and :user are the same.
+ */
+static VALUE
+rbz_pool_key (VALUE host, VALUE options)
+{
+    static const char *keys [] = { "databaseName", "user", "group",
+                                   "password", "proxy", NULL };
+    VALUE key;
+    VALUE named;
+    VALUE value;
+    int i;
+
+    named = rb_hash_new ();
+    rb_hash_foreach (options, rbz_pool_key_option, named);
+
+    key = rb_str_dup (rb_obj_as_string (host));
+    for (i = 0; keys [i] != NULL; i++) {
+        value = rb_hash_aref (named, rb_str_new2 (keys [i]));
+        rb_str_cat (key, "\n", 1);
+        if (!NIL_P (value))
+            rb_str_append (key, rb_obj_as_string (value));
+    }
+
+    return rb_obj_freeze (key);
+}
+
+static int
+rbz_pool_apply_option (VALUE key, VALUE value, VALUE rb_connection)
+{
+    rbz_option_set (rb_connection, key, value);
+    return ST_CONTINUE;
+}
+
+/*
+ * A cheap liveness check: an idle connection should have an open socket
+ * with nothing to read.  If it is readable, the target either closed it or
+ * sent something we did not ask for.
+ */
+static int
+rbz_pool_alive (VALUE rb_connection)
+{
+    struct pollfd pfd;
+
+    if (RTEST (rbz_connection_closed_p (rb_connection)))
+        return 0;
+    pfd.fd = ZOOM_connection_get_socket (rbz_connection_get (rb_connection));
+    if (pfd.fd < 0)
+        return 0;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll (&pfd, 1, 0) == 0;
+}
+
+/*
+ * Drops a connection from the pool, closing it now rather than leaving its
+ * socket open until the GC runs.
+ */
+static void
+rbz_pool_discard (struct rbz_pool *pool, VALUE rb_connection)
+{
+    rbz_connection_close (rb_connection);
+    pool->evictions++;
+}
+
+/* Drops idle connections unused for longer than idle_timeout. */
+static size_t
+rbz_pool_evict (struct rbz_pool *pool, double now)
+{
+    VALUE targets;
+    VALUE idle;
+    VALUE entry;
+    size_t evicted;
+    long i;
+    long j;
+
+    evicted = 0;
+    targets = rb_funcall (pool->targets, rb_intern ("values"), 0);
+    for (i = 0; i < RARRAY_LEN (targets); i++) {
+        idle = RARRAY_PTR (RARRAY_PTR (targets) [i]) [0];
+        for (j = RARRAY_LEN (idle) - 1; j >= 0; j--) {
+            entry = RARRAY_PTR (idle) [j];
+            if (now - NUM2DBL (RARRAY_PTR (entry) [1]) > pool->idle_timeout) {
+                rb_ary_delete_at (idle, j);
+                rbz_pool_discard (pool, RARRAY_PTR (entry) [0]);
+                evicted++;
+            }
+        }
+    }
+
+    return evicted;
+}
+
+struct rbz_pool_checkout_args {
+    struct rbz_pool *pool;
+    VALUE key;
+    VALUE connection;   /* the connection found idle, if any */
+    int create;         /* set if a new connection has to be made */
+    int waited;
+    double deadline;
+};
+
+static VALUE
+rbz_pool_checkout_locked (VALUE data)
+{
+    struct rbz_pool_checkout_args *args;
+    struct rbz_pool *pool;
+    VALUE target;
+    VALUE idle;
+    VALUE entry;
+    double now;
+
+    args = (struct rbz_pool_checkout_args *) data;
+    pool = args->pool;
+
+    for (;;) {
+        now = rbz_pool_now ();
+        rbz_pool_evict (pool, now);
+
+        target = rb_hash_aref (pool->targets, args->key);
+        if (NIL_P (target)) {
+            target = rb_ary_new3 (2, rb_ary_new (), INT2FIX (0));
+            rb_hash_aset (pool->targets, args->key, target);
+        }
+        idle = RARRAY_PTR (target) [0];
+
+        /* Reuse the most recently used connection that is still alive */
+        while (RARRAY_LEN (idle) > 0) {
+            entry = rb_ary_pop (idle);
+            if (rbz_pool_alive (RARRAY_PTR (entry) [0])) {
+                args->connection = RARRAY_PTR (entry) [0];
+                break;
+            }
+            rbz_pool_discard (pool, RARRAY_PTR (entry) [0]);
+        }
+
+        if (!NIL_P (args->connection)
+            || FIX2LONG (RARRAY_PTR (target) [1]) < pool->max_per_target) {
+            rb_ary_store (target, 1,
+                          LONG2FIX (FIX2LONG (RARRAY_PTR (target) [1]) + 1));
+            args->create = NIL_P (args->connection);
+            pool->checkouts++;
+            if (!NIL_P (args->connection))
+                rb_hash_aset (pool->checked_out, args->connection, args->key);
+            return Qnil;
+        }
+
+        /* All connections to the target are in use, wait for one */
+        if (!args->waited) {
+            args->waited = 1;
+            pool->waits++;
+        }
+        if (now >= args->deadline)
+            rb_raise (rb_eRuntimeError,
+                      "timed out waiting for a connection to %s",
+                      RVAL2CSTR (args->key));
+        rb_funcall (pool->available, rb_intern ("wait"), 2,
+                    pool->mutex, rb_float_new (args->deadline - now));
+    }
+}
+
+static VALUE
+rbz_pool_release_slot (VALUE data)
+{
+    struct rbz_pool_checkout_args *args;
+    VALUE target;
+
+    args = (struct rbz_pool_checkout_args *) data;
+    target = rb_hash_aref (args->pool->targets, args->key);
+    rb_ary_store (target, 1,
+                  LONG2FIX (FIX2LONG (RARRAY_PTR (target) [1]) - 1));
+    rb_funcall (args->pool->available, rb_intern ("broadcast"), 0);
+
+    return Qnil;
+}
+
+static VALUE
+rbz_pool_register (VALUE data)
+{
+    struct rbz_pool_checkout_args *args;
+
+    args = (struct rbz_pool_checkout_args *) data;
+    args->pool->creates++;
+    rb_hash_aset (args->pool->checked_out, args->connection, args->key);
+
+    return Qnil;
+}
+
+struct rbz_pool_connect_args {
+    VALUE host;
+    VALUE options;
+    VALUE result_cache;
+};
+
+/*
+ * Saves the values of the reset options of a new connection, before the
+ * options of the request are applied.
+ */
+static void
+rbz_pool_save_defaults (VALUE rb_connection)
+{
+    ZOOM_connection connection;
+    VALUE defaults;
+    int i;
+
+    connection = rbz_connection_get (rb_connection);
+    defaults = rb_ary_new ();
+    for (i = 0; rbz_pool_reset_options [i] != NULL; i++)
+        rb_ary_push (defaults,
+                     rb_assoc_new (rb_str_new2 (rbz_pool_reset_options [i]),
+                                   CSTR2RVAL (ZOOM_connection_option_get (
+                                       connection,
+                                       rbz_pool_reset_options [i]))));
+    rb_ivar_set (rb_connection, id_pool_defaults, defaults);
+}
+
+/* Gives a connection checked in the options it had when it was created. */
+static void
+rbz_pool_reset (VALUE rb_connection)
+{
+    rb_funcall (rb_connection, rb_intern ("auto_tune="), 1, Qfalse);
+    rbz_connection_restore_options (rbz_connection_get (rb_connection),
+                                    rb_attr_get (rb_connection,
+                                                 id_pool_defaults));
+}
+
+static VALUE
+rbz_pool_connect (VALUE data)
+{
+    struct rbz_pool_connect_args *args;
+    VALUE rb_connection;
+
+    args = (struct rbz_pool_connect_args *) data;
+    rb_connection = rb_funcall (cZoomConnection, rb_intern ("new"), 0);
+    rbz_pool_save_defaults (rb_connection);
+    rb_hash_foreach (args->options, rbz_pool_apply_option, rb_connection);
+    rb_funcall (rb_connection, rb_intern ("connect"), 1, args->host);
+    if (!NIL_P (args->result_cache))
+        rb_funcall (rb_connection, rb_intern ("result_cache="), 1,
+                    args->result_cache);
+
+    return rb_connection;
+}
+
+static VALUE
+rbz_pool_connect_failed (VALUE data, VALUE error)
+{
+    struct rbz_pool_checkout_args *args;
+
+    args = (struct rbz_pool_checkout_args *) data;
+    rb_mutex_synchronize (args->pool->mutex, rbz_pool_release_slot, data);
+    rb_exc_raise (error);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ * 	checkout(host, options={})
+ *
+ * host: the target, as given to ZOOM::Connection#connect.
+ *
+ * options: options for the connection, as a Hash object.
+ *
+ * Takes a connection to the given target out of the pool.  An idle
+ * connection is reused if there is one that is still alive, otherwise a new
+ * connection is established, unless max_per_target connections to the
+ * target are already in use, in which case this method waits for one to be
+ * checked in, up to checkout_timeout seconds.
+ *
+ * The connection must be given back with ZOOM::ConnectionPool#checkin.
+ *
+ * This method raises an exception on error, or if no connection became
+ * available in time.
+ *
+ * Returns: a ZOOM::Connection object.
+ */
+static VALUE
+rbz_pool_checkout (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_pool_checkout_args args;
+    struct rbz_pool_connect_args connect;
+    VALUE host;
+    VALUE options;
+
+    rb_scan_args (argc, argv, "11", &host, &options);
+    if (NIL_P (options))
+        options = rb_hash_new ();
+
+    args.pool = rbz_pool_get (self);
+    args.key = rbz_pool_key (host, options);
+    args.connection = Qnil;
+    args.create = 0;
+    args.waited = 0;
+    args.deadline = rbz_pool_now () + args.pool->checkout_timeout;
+
+    rb_mutex_synchronize (args.pool->mutex, rbz_pool_checkout_locked,
+                          (VALUE) &args);
+
+    if (args.create) {
+        /* Connect outside of the lock, other threads may use the pool */
+        connect.host = host;
+        connect.options = options;
+        connect.result_cache = args.pool->result_cache;
+        args.connection = rb_rescue2 (rbz_pool_connect, (VALUE) &connect,
+                                      rbz_pool_connect_failed, (VALUE) &args,
+                                      rb_eException, (VALUE) 0);
+        rb_mutex_synchronize (args.pool->mutex, rbz_pool_register,
+                              (VALUE) &args);
+    }
+    else
+        rb_hash_foreach (options, rbz_pool_apply_option, args.connection);
+
+    return args.connection;
+}
+
+struct rbz_pool_checkin_args {
+    struct rbz_pool *pool;
+    VALUE connection;
+};
+
+static VALUE
+rbz_pool_checkin_locked (VALUE data)
+{
+    struct rbz_pool_checkin_args *args;
+    VALUE key;
+    VALUE target;
+    int error;
+
+    args = (struct rbz_pool_checkin_args *) data;
+    key = rb_hash_delete (args->pool->checked_out, args->connection);
+    if (NIL_P (key))
+        rb_raise (rb_eArgError, "connection was not checked out of this pool");
+
+    target = rb_hash_aref (args->pool->targets, key);
+    rb_ary_store (target, 1,
+                  LONG2FIX (FIX2LONG (RARRAY_PTR (target) [1]) - 1));
+
+    /* Connections that lost their target are not worth keeping */
+    error = RTEST (rbz_connection_closed_p (args->connection))
+        ? ZOOM_ERROR_CONNECTION_LOST
+        : ZOOM_connection_errcode (rbz_connection_get (args->connection));
+    if (error == ZOOM_ERROR_CONNECT || error == ZOOM_ERROR_CONNECTION_LOST
+        || error == ZOOM_ERROR_TIMEOUT)
+        rbz_pool_discard (args->pool, args->connection);
+    else {
+        rbz_pool_reset (args->connection);
+        rb_ary_push (RARRAY_PTR (target) [0],
+                     rb_ary_new3 (2, args->connection,
+                                  rb_float_new (rbz_pool_now ())));
+    }
+
+    rb_funcall (args->pool->available, rb_intern ("broadcast"), 0);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ * 	checkin(connection)
+ *
+ * connection: a connection returned by ZOOM::ConnectionPool#checkout.
+ *
+ * Gives a connection back to the pool, making it available to other
+ * threads, with its options reset (see ZOOM::ConnectionPool).  A
+ * connection that lost its target, or that was closed, is dropped instead.  Connections dropped by the pool are closed (see
+ * ZOOM::Connection#close), so result sets must not be used once their 
+ * connection is checked in.
+ *
+ * Returns: self.
+ */
+static VALUE
+rbz_pool_checkin (VALUE self, VALUE connection)
+{
+    struct rbz_pool_checkin_args args;
+
+    args.pool = rbz_pool_get (self);
+    args.connection = connection;
+    rb_mutex_synchronize (args.pool->mutex, rbz_pool_checkin_locked,
+                          (VALUE) &args);
+
+    return self;
+}
+
+static VALUE
+rbz_pool_with_yield (VALUE connection)
+{
+    return rb_yield (connection);
+}
+
+static VALUE
+rbz_pool_with_checkin (VALUE data)
+{
+    VALUE *argv;
+
+    argv = (VALUE *) data;
+    return rbz_pool_checkin (argv [0], argv [1]);
+}
+
+/*
+ * call-seq:
+ * 	with(host, options={}) { |conn| ... }
+ *
+ * host: the target, as given to ZOOM::Connection#connect.
+ *
+ * options: options for the connection, as a Hash object.
+ *
+ * Checks out a connection to the given target, calls the given block with
+ * it, and checks it back in when the block ends, even if it raises.
+ *
+ * Returns: the value of the block.
+ */
+static VALUE
+rbz_pool_with (int argc, VALUE *argv, VALUE self)
+{
+    VALUE args [2];
+
+    args [0] = self;
+    args [1] = rbz_pool_checkout (argc, argv, self);
+
+    return rb_ensure (rbz_pool_with_yield, args [1],
+                      rbz_pool_with_checkin, (VALUE) args);
+}
+
+static VALUE
+rbz_pool_evict_idle_locked (VALUE data)
+{
+    struct rbz_pool *pool;
+
+    pool = (struct rbz_pool *) data;
+    return SIZET2NUM (rbz_pool_evict (pool, rbz_pool_now ()));
+}
+
+/*
+ * Drops and closes the idle connections that have not been used for 
+ * idle_timeout seconds.  This also happens on every checkout.
+ *
+ * Returns: the number of connections dropped.
+ */
+static VALUE
+rbz_pool_evict_idle (VALUE self)
+{
+    struct rbz_pool *pool;
+
+    pool = rbz_pool_get (self);
+    return rb_mutex_synchronize (pool->mutex, rbz_pool_evict_idle_locked,
+                                 (VALUE) pool);
+}
+
+static int
+rbz_pool_count (VALUE key, VALUE target, VALUE counts)
+{
+    long *n;
+
+    n = (long *) counts;
+    n [0] += RARRAY_LEN (RARRAY_PTR (target) [0]);
+    n [1] += FIX2LONG (RARRAY_PTR (target) [1]);
+
+    return ST_CONTINUE;
+}
+
+static VALUE
+rbz_pool_stats_locked (VALUE data)
+{
+    struct rbz_pool *pool;
+    VALUE stats;
+    long counts [2] = { 0, 0 };
+
+    pool = (struct rbz_pool *) data;
+    rb_hash_foreach (pool->targets, rbz_pool_count, (VALUE) counts);
+
+    stats = rb_hash_new ();
+    rb_hash_aset (stats, ID2SYM (rb_intern ("checkouts")),
+                  SIZET2NUM (pool->checkouts));
+    rb_hash_aset (stats, ID2SYM (rb_intern ("waits")),
+                  SIZET2NUM (pool->waits));
+    rb_hash_aset (stats, ID2SYM (rb_intern ("creates")),
+                  SIZET2NUM (pool->creates));
+    rb_hash_aset (stats, ID2SYM (rb_intern ("evictions")),
+                  SIZET2NUM (pool->evictions));
+    rb_hash_aset (stats, ID2SYM (rb_intern ("idle")), LONG2NUM (counts [0]));
+    rb_hash_aset (stats, ID2SYM (rb_intern ("busy")), LONG2NUM (counts [1]));
+
+    return stats;
+}
+
+/*
+ * Reports how the pool is used: :checkouts, the number of connections
+ * handed out; :waits, how many checkouts had to wait for a connection;
+ * :creates, how many connections were established; :evictions, how many
+ * were dropped because they were idle for too long or found dead; and :idle
+ * and :busy, the number of connections currently in and out of the pool.
+ *
+ * Returns: a Hash of counters.
+ */
+static VALUE
+rbz_pool_stats (VALUE self)
+{
+    struct rbz_pool *pool;
+
+    pool = rbz_pool_get (self);
+    return rb_mutex_synchronize (pool->mutex, rbz_pool_stats_locked,
+                                 (VALUE) pool);
+}
+
+void
+Init_zoom_connection_pool (VALUE mZoom)
+{
+    VALUE c;
+
+    c = rb_define_class_under (mZoom, "ConnectionPool", rb_cObject);
+    rb_define_alloc_func (c, rbz_pool_alloc);
+    rb_define_method (c, "initialize", rbz_pool_initialize, -1);
+    rb_define_method (c, "checkout", rbz_pool_checkout, -1);
+    rb_define_method (c, "checkin", rbz_pool_checkin, 1);
+    rb_define_method (c, "with", rbz_pool_with, -1);
+    rb_define_method (c, "evict_idle", rbz_pool_evict_idle, 0);
+    rb_define_method (c, "stats", rbz_pool_stats, 0);
+
+    cZoomConnectionPool = c;
+    cZoomConnection = rb_const_get (mZoom, rb_intern ("Connection"));
+    id_pool_defaults = rb_intern ("__pool_defaults__");
+}
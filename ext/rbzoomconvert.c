@@ -0,0 +1,351 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Record conversion with YAZ: MARC records are rendered with yaz_marc,
+ * and charsets converted with yaz_iconv, by converters that are kept
+ * between uses instead of being set up for every record as ZOOM_record_get
+ * does.  Converters are taken from and given back to the cache while
+ * holding the GVL, and used without it.
+ */
+
+#include "rbzoom.h"
+#include <yaz/marcdisp.h>
+#include <ruby/util.h>
+
+struct rbz_converter {
+    yaz_marc_t mt;
+    yaz_iconv_t cd;             /* NULL without charset conversion */
+    WRBUF wrbuf;                /* output of yaz_iconv */
+    const char *key;            /* in rbz_converters */
+    struct rbz_converter *next;
+};
+
+/* "from,to" => idle converters, at most RBZ_CONVERTERS_IDLE of them */
+static st_table *rbz_converters;
+
+#define RBZ_CONVERTERS_IDLE 8
+
+/* Returns whether buf looks like an ISO2709 record. */
+int
+rbz_iso2709_p (const char *buf, size_t len)
+{
+    size_t i;
+
+    if (len < 24 || buf [len - 1] != '\035')
+        return 0;
+    for (i = 0; i < 5; i++)
+        if (buf [i] < '0' || buf [i] > '9')
+            return 0;
+
+    return 1;
+}
+
+/*
+ * Returns the YAZ_MARC_* mode that renders MARC records in the given form
+ * of ZOOM_record_get, or -1.
+ */
+int
+rbz_marc_mode (const char *form, size_t len)
+{
+    static const struct {
+        const char *form;
+        int mode;
+    } modes [] = {
+        { "raw", YAZ_MARC_ISO2709 },
+        { "xml", YAZ_MARC_MARCXML },
+        { "render", YAZ_MARC_LINE },
+        { "txml", YAZ_MARC_TURBOMARC },
+        { "json", YAZ_MARC_JSON },
+        { NULL, 0 }
+    };
+    int i;
+
+    for (i = 0; modes [i].form != NULL; i++)
+        if (strlen (modes [i].form) == len
+            && strncmp (modes [i].form, form, len) == 0)
+            return modes [i].mode;
+
+    return -1;
+}
+
+/*
+ * Returns a converter from the cache, or a new one, for the conversion
+ * from charset from to charset to (UTF-8 if NULL).  If from is NULL, the
+ * converter does not convert charsets.
+ */
+struct rbz_converter *
+rbz_converter_acquire (const char *from, const char *to)
+{
+    struct rbz_converter *conv;
+    st_data_t idle;
+    const char *name;
+    VALUE key;
+
+    if (from != NULL && to == NULL)
+        to = "UTF-8";
+    key = rb_sprintf ("%s,%s", from != NULL ? from : "",
+                      to != NULL ? to : "");
+    name = StringValueCStr (key);
+
+    if (rbz_converters == NULL)
+        rbz_converters = st_init_strtable ();
+    if (st_lookup (rbz_converters, (st_data_t) name, &idle)
+        && idle != 0) {
+        conv = (struct rbz_converter *) idle;
+        st_insert (rbz_converters, (st_data_t) conv->key,
+                   (st_data_t) conv->next);
+        conv->next = NULL;
+        return conv;
+    }
+
+    conv = ALLOC (struct rbz_converter);
+    conv->cd = NULL;
+    if (from != NULL) {
+        conv->cd = yaz_iconv_open (to, from);
+        if (conv->cd == NULL) {
+            xfree (conv);
+            rb_raise (rb_eArgError, "unsupported conversion from %s to %s",
+                      from, to);
+        }
+    }
+    conv->mt = yaz_marc_create ();
+    if (conv->cd != NULL)
+        yaz_marc_iconv (conv->mt, conv->cd);
+    conv->wrbuf = wrbuf_alloc ();
+    conv->next = NULL;
+
+    if (!st_get_key (rbz_converters, (st_data_t) name,
+                     (st_data_t *) &conv->key)) {
+        conv->key = ruby_strdup (name);
+        st_insert (rbz_converters, (st_data_t) conv->key, 0);
+    }
+    RB_GC_GUARD (key);
+
+    return conv;
+}
+
+/* Gives a converter back to the cache, or destroys it if enough are idle. */
+void
+rbz_converter_release (struct rbz_converter *conv)
+{
+    struct rbz_converter *idle;
+    st_data_t head;
+    int count;
+
+    st_lookup (rbz_converters, (st_data_t) conv->key, &head);
+    for (idle = (struct rbz_converter *) head, count = 0;
+         idle != NULL;
+         idle = idle->next)
+        count++;
+
+    if (count >= RBZ_CONVERTERS_IDLE) {
+        yaz_marc_destroy (conv->mt);
+        if (conv->cd != NULL)
+            yaz_iconv_close (conv->cd);
+        wrbuf_destroy (conv->wrbuf);
+        xfree (conv);
+        return;
+    }
+
+    conv->next = (struct rbz_converter *) head;
+    st_insert (rbz_converters, (st_data_t) conv->key, (st_data_t) conv);
+}
+
+/*
+ * Converts a record, rendering it in the given YAZ_MARC_* mode if it is an
+ * ISO2709 one.  Other records are only converted to the target charset in
+ * the raw and xml forms, which return them as they are.  The result
+ * remains valid until the next use of the converter.  This function does
+ * not need the GVL.
+ *
+ * Returns: 1 on success, 0 if the record cannot be converted that way.
+ */
+int
+rbz_converter_run (struct rbz_converter *conv, int mode, const char *buf,
+                   size_t len, const char **result, size_t *rsize)
+{
+    if (mode >= 0 && rbz_iso2709_p (buf, len)
+        && (mode != YAZ_MARC_ISO2709 || conv->cd != NULL)) {
+        yaz_marc_xml (conv->mt, mode);
+        return yaz_marc_decode_buf (conv->mt, buf, len, result, rsize) > 0;
+    }
+
+    if (mode != YAZ_MARC_ISO2709 && mode != YAZ_MARC_MARCXML)
+        return 0;
+
+    if (conv->cd == NULL) {
+        /* Nothing to convert */
+        *result = buf;
+        *rsize = len;
+        return 1;
+    }
+
+    wrbuf_rewind (conv->wrbuf);
+    if (wrbuf_iconv_write (conv->wrbuf, conv->cd, buf, len) != 0) {
+        /* Do not leave a shift state behind for the next record */
+        wrbuf_iconv_reset (conv->wrbuf, conv->cd);
+        return 0;
+    }
+    wrbuf_iconv_reset (conv->wrbuf, conv->cd);
+    *result = wrbuf_buf (conv->wrbuf);
+    *rsize = wrbuf_len (conv->wrbuf);
+
+    return 1;
+}
+
+struct rbz_convert_item {
+    const char *raw;
+    size_t len;
+    char *out;                  /* converted record, NULL if not converted */
+    size_t out_len;
+};
+
+struct rbz_convert_args {
+    struct rbz_converter *conv;
+    int mode;
+    struct rbz_convert_item *items;
+    long count;
+
+    /* to build the result, with the GVL */
+    VALUE records;
+    VALUE form;
+    VALUE from;
+    VALUE to;
+};
+
+static void *
+rbz_convert_blocking (void *data)
+{
+    struct rbz_convert_args *args;
+    struct rbz_convert_item *item;
+    const char *result;
+    size_t rsize;
+    long i;
+
+    args = (struct rbz_convert_args *) data;
+    for (i = 0; i < args->count; i++) {
+        item = args->items + i;
+        if (item->raw == NULL
+            || !rbz_converter_run (args->conv, args->mode, item->raw,
+                                   item->len, &result, &rsize))
+            continue;
+
+        /* Not xmalloc: Ruby's allocator needs the GVL */
+        item->out = malloc (rsize > 0 ? rsize : 1);
+        if (item->out == NULL)
+            continue;
+        memcpy (item->out, result, rsize);
+        item->out_len = rsize;
+    }
+
+    return NULL;
+}
+
+/* Builds the array of strings from the converted records. */
+static VALUE
+rbz_convert_collect (VALUE data)
+{
+    struct rbz_convert_args *args;
+    struct rbz_convert_item *items;
+    VALUE ary;
+    VALUE type;
+    long i;
+
+    args = (struct rbz_convert_args *) data;
+    items = args->items;
+    type = Qnil;
+    ary = rb_ary_new2 (args->count);
+    for (i = 0; i < args->count; i++) {
+        if (items [i].out != NULL) {
+            rb_ary_push (ary, rb_str_new (items [i].out, items [i].out_len));
+            free (items [i].out);
+            items [i].out = NULL;
+            continue;
+        }
+
+        /* Left to YAZ */
+        if (NIL_P (type)) {
+            type = rb_str_dup (args->form);
+            if (!NIL_P (args->from))
+                rb_str_catf (type, "; charset=%s", RVAL2CSTR (args->from));
+            if (!NIL_P (args->from) && !NIL_P (args->to))
+                rb_str_catf (type, ",%s", RVAL2CSTR (args->to));
+        }
+        rb_ary_push (ary, rbz_record_string (RARRAY_PTR (args->records) [i],
+                                             RVAL2CSTR (type)));
+    }
+
+    return ary;
+}
+
+/* Frees the converted records left if rbz_convert_collect raised. */
+static VALUE
+rbz_convert_cleanup (VALUE data)
+{
+    struct rbz_convert_args *args;
+    long i;
+
+    args = (struct rbz_convert_args *) data;
+    for (i = 0; i < args->count; i++)
+        free (args->items [i].out);
+
+    return Qnil;
+}
+
+/*
+ * Returns the given ZOOM::Record objects in the given form of
+ * ZOOM_record_get, converted from charset from to charset to, as an array
+ * of strings.  The rendering and the conversion are done without the GVL,
+ * except for the records that YAZ only knows how to convert itself.
+ */
+VALUE
+rbz_convert_records (VALUE records, VALUE form, VALUE from, VALUE to)
+{
+    struct rbz_convert_args args;
+    struct rbz_convert_item *items;
+    VALUE ary;
+    VALUE buf;
+    long i;
+    int len;
+
+    StringValue (form);
+    args.records = records;
+    args.form = form;
+    args.from = from;
+    args.to = to;
+    args.mode = rbz_marc_mode (RSTRING_PTR (form), RSTRING_LEN (form));
+    args.count = RARRAY_LEN (records);
+    items = args.items = ALLOCV_N (struct rbz_convert_item, buf, args.count);
+    for (i = 0; i < args.count; i++) {
+        items [i].raw = rbz_record_raw_data (RARRAY_PTR (records) [i], &len);
+        items [i].len = items [i].raw != NULL ? (size_t) len : 0;
+        items [i].out = NULL;
+    }
+
+    if (args.mode != -1) {
+        args.conv = rbz_converter_acquire (NIL_P (from) ? NULL : RVAL2CSTR (from),
+                                           NIL_P (to) ? NULL : RVAL2CSTR (to));
+        RBZ_CALL_WITHOUT_GVL (rbz_convert_blocking, &args, NULL, NULL);
+        rbz_converter_release (args.conv);
+    }
+
+    ary = rb_ensure (rbz_convert_collect, (VALUE) &args,
+                     rbz_convert_cleanup, (VALUE) &args);
+    ALLOCV_END (buf);
+
+    return ary;
+}
@@ -0,0 +1,180 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <time.h>
+#include "rbzoom.h"
+
+#ifdef MAKING_RDOC_HAPPY
+mZoom = rb_define_module("ZOOM");
+#endif
+
+/* Document-class: ZOOM::Event
+ *
+ * Describes one operation on a target, as reported to the subscribers
+ * registered with ZOOM.subscribe:
+ *
+ * name:: :connect, :search, :present, :package, :scan or :sort.
+ * target:: the host the connection talks to, as a string.
+ * duration:: the time spent, in seconds, from a monotonic clock.
+ * records:: the number of hits for :search, the number of records
+ *           retrieved for :present, the number of terms for :scan, 0
+ *           otherwise.
+ * bytes:: the size of the record data retrieved by :present, 0 otherwise.
+ * error:: the ZOOM error code of the operation, 0 on success.
+ */
+static VALUE cZoomEvent;
+
+const char *rbz_operation_names [RBZ_OP_LAST] = {
+    "connect", "search", "present", "package", "scan", "sort"
+};
+
+/* Callables registered with ZOOM.subscribe. */
+static VALUE rbz_subscribers;
+
+/* 
+ * RBZ_INSTRUMENT_SUBSCRIBERS when there is at least one subscriber, ored 
+ * with RBZ_INSTRUMENT_METRICS when ZOOM.metrics_enabled is set.
+ */
+int rbz_instrumenting;
+
+double
+rbz_instrument_clock (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Reports an operation that started at the given clock time to the metrics
+ * registry and to every subscriber.  Called through RBZ_INSTRUMENT_FINISH,
+ * with the GVL held.
+ */
+void
+rbz_instrument (enum rbz_operation operation, ZOOM_connection connection,
+                double started, size_t records, size_t bytes)
+{
+    VALUE event;
+    const char *target;
+    const char *errmsg;
+    const char *addinfo;
+    double duration;
+    int error;
+    long i;
+
+    duration = rbz_instrument_clock () - started;
+    target = ZOOM_connection_option_get (connection, "host");
+    error = ZOOM_connection_error (connection, &errmsg, &addinfo);
+
+    if (rbz_instrumenting & RBZ_INSTRUMENT_METRICS)
+        rbz_metrics_record (operation, target, duration, records, bytes, 
+                            error);
+    if (!(rbz_instrumenting & RBZ_INSTRUMENT_SUBSCRIBERS))
+        return;
+
+    event = rb_struct_new (cZoomEvent,
+                           ID2SYM (rb_intern (rbz_operation_names [operation])),
+                           CSTR2RVAL (target),
+                           rb_float_new (duration),
+                           SIZET2NUM (records),
+                           SIZET2NUM (bytes),
+                           INT2FIX (error));
+
+    for (i = 0; i < RARRAY_LEN (rbz_subscribers); i++)
+        rb_funcall (RARRAY_AREF (rbz_subscribers, i), rb_intern ("call"), 1,
+                    event);
+}
+
+/*
+ * call-seq:
+ * 	subscribe(callable=nil) { |event| ... }
+ *
+ * callable: an object responding to call, used instead of the block.
+ *
+ * Registers a subscriber, which will be called with a ZOOM::Event after
+ * every connect, search, present and extended services operation, from the
+ * thread that ran it.  Exceptions raised by the subscriber are raised by the
+ * operation.
+ *
+ * When there are no subscribers and ZOOM.metrics_enabled is not set, 
+ * operations do not even read the clock.
+ * To forward events to ActiveSupport::Notifications:
+ *
+ * 	ZOOM.subscribe do |event|
+ * 	  ActiveSupport::Notifications.instrument("#{event.name}.zoom",
+ * 	                                          event.to_h)
+ * 	end
+ *
+ * Returns: the subscriber, to be given to ZOOM.unsubscribe.
+ */
+static VALUE
+rbz_instrument_subscribe (int argc, VALUE *argv, VALUE self)
+{
+    VALUE subscriber;
+    VALUE block;
+
+    rb_scan_args (argc, argv, "01&", &subscriber, &block);
+    if (NIL_P (subscriber))
+        subscriber = block;
+    if (NIL_P (subscriber))
+        rb_raise (rb_eArgError, "a callable or a block is required");
+    if (!rb_respond_to (subscriber, rb_intern ("call")))
+        rb_raise (rb_eArgError, "subscriber does not respond to call");
+
+    rb_ary_push (rbz_subscribers, subscriber);
+    rbz_instrumenting |= RBZ_INSTRUMENT_SUBSCRIBERS;
+
+    return subscriber;
+}
+
+/*
+ * call-seq:
+ * 	unsubscribe(subscriber)
+ *
+ * subscriber: a value returned by ZOOM.subscribe.
+ *
+ * Removes a subscriber.
+ *
+ * Returns: the subscriber, or nil if it was not registered.
+ */
+static VALUE
+rbz_instrument_unsubscribe (VALUE self, VALUE subscriber)
+{
+    VALUE removed;
+
+    removed = rb_ary_delete (rbz_subscribers, subscriber);
+    if (RARRAY_LEN (rbz_subscribers) == 0)
+        rbz_instrumenting &= ~RBZ_INSTRUMENT_SUBSCRIBERS;
+
+    return removed;
+}
+
+void
+Init_zoom_instrument (VALUE mZoom)
+{
+    cZoomEvent = rb_struct_define_under (mZoom, "Event", "name", "target",
+                                         "duration", "records", "bytes",
+                                         "error", NULL);
+
+    rbz_subscribers = rb_ary_new ();
+    rb_gc_register_address (&rbz_subscribers);
+
+    rb_define_module_function (mZoom, "subscribe",
+                               rbz_instrument_subscribe, -1);
+    rb_define_module_function (mZoom, "unsubscribe",
+                               rbz_instrument_unsubscribe, 1);
+}
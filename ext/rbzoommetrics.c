@@ -0,0 +1,426 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <math.h>
+#include "rbzoom.h"
+#include <ruby/util.h>
+
+#ifdef MAKING_RDOC_HAPPY
+mZoom = rb_define_module("ZOOM");
+#endif
+
+/*
+ * Cumulative counters and latency histograms, per target, fed by the same
+ * entry points as ZOOM.subscribe.  They are only updated with the GVL held,
+ * so they need no lock of their own.
+ */
+
+/* Upper bounds of the latency histogram buckets, in seconds. */
+static const double rbz_metrics_bounds [] = {
+    0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+#define RBZ_METRICS_BOUNDS \
+    (sizeof (rbz_metrics_bounds) / sizeof (rbz_metrics_bounds [0]))
+
+struct rbz_histogram {
+    unsigned long buckets [RBZ_METRICS_BOUNDS + 1];  /* last one is +Inf */
+    unsigned long count;
+    double sum;
+};
+
+struct rbz_target_metrics {
+    unsigned long operations [RBZ_OP_LAST];
+    unsigned long records;
+    unsigned long bytes;
+    st_table *errors;   /* error code => count */
+    struct rbz_histogram latency [RBZ_OP_LAST];
+};
+
+/* target name => struct rbz_target_metrics */
+static st_table *rbz_metrics_targets;
+
+static struct rbz_target_metrics *
+rbz_metrics_target (const char *target)
+{
+    struct rbz_target_metrics *metrics;
+    st_data_t value;
+
+    if (st_lookup (rbz_metrics_targets, (st_data_t) target, &value))
+        return (struct rbz_target_metrics *) value;
+
+    metrics = ALLOC (struct rbz_target_metrics);
+    MEMZERO (metrics, struct rbz_target_metrics, 1);
+    metrics->errors = st_init_numtable ();
+    st_insert (rbz_metrics_targets, (st_data_t) ruby_strdup (target),
+               (st_data_t) metrics);
+
+    return metrics;
+}
+
+void
+rbz_metrics_record (enum rbz_operation operation, const char *target,
+                    double duration, size_t records, size_t bytes, int error)
+{
+    struct rbz_target_metrics *metrics;
+    struct rbz_histogram *histogram;
+    st_data_t count;
+    size_t i;
+
+    metrics = rbz_metrics_target (target != NULL ? target : "");
+    metrics->operations [operation]++;
+    if (operation == RBZ_OP_PRESENT)
+        metrics->records += records;
+    metrics->bytes += bytes;
+
+    if (error != 0) {
+        if (!st_lookup (metrics->errors, (st_data_t) error, &count))
+            count = 0;
+        st_insert (metrics->errors, (st_data_t) error, count + 1);
+    }
+
+    histogram = &metrics->latency [operation];
+    for (i = 0; i < RBZ_METRICS_BOUNDS; i++)
+        if (duration <= rbz_metrics_bounds [i])
+            break;
+    histogram->buckets [i]++;
+    histogram->count++;
+    histogram->sum += duration;
+}
+
+static int
+rbz_metrics_free_target (st_data_t key, st_data_t value, st_data_t arg)
+{
+    struct rbz_target_metrics *metrics;
+
+    metrics = (struct rbz_target_metrics *) value;
+    st_free_table (metrics->errors);
+    xfree (metrics);
+    xfree ((char *) key);
+
+    return ST_DELETE;
+}
+
+static int
+rbz_metrics_error_to_hash (st_data_t key, st_data_t value, st_data_t arg)
+{
+    rb_hash_aset ((VALUE) arg, INT2FIX ((int) key), ULONG2NUM (value));
+    return ST_CONTINUE;
+}
+
+static int
+rbz_metrics_target_to_hash (st_data_t key, st_data_t value, st_data_t arg)
+{
+    struct rbz_target_metrics *metrics;
+    struct rbz_histogram *histogram;
+    VALUE hash;
+    VALUE errors;
+    VALUE latency;
+    VALUE buckets;
+    unsigned long cumulative;
+    size_t i;
+    int op;
+
+    metrics = (struct rbz_target_metrics *) value;
+    hash = rb_hash_new ();
+    for (op = 0; op < RBZ_OP_LAST; op++)
+        rb_hash_aset (hash,
+                      ID2SYM (rb_intern (rbz_operation_names [op])),
+                      ULONG2NUM (metrics->operations [op]));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("records")),
+                  ULONG2NUM (metrics->records));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("bytes")),
+                  ULONG2NUM (metrics->bytes));
+
+    errors = rb_hash_new ();
+    st_foreach (metrics->errors, rbz_metrics_error_to_hash, (st_data_t) errors);
+    rb_hash_aset (hash, ID2SYM (rb_intern ("errors")), errors);
+
+    latency = rb_hash_new ();
+    for (op = 0; op < RBZ_OP_LAST; op++) {
+        VALUE h;
+
+        histogram = &metrics->latency [op];
+        h = rb_hash_new ();
+        rb_hash_aset (h, ID2SYM (rb_intern ("count")),
+                      ULONG2NUM (histogram->count));
+        rb_hash_aset (h, ID2SYM (rb_intern ("sum")),
+                      rb_float_new (histogram->sum));
+        buckets = rb_hash_new ();
+        cumulative = 0;
+        for (i = 0; i <= RBZ_METRICS_BOUNDS; i++) {
+            cumulative += histogram->buckets [i];
+            rb_hash_aset (buckets,
+                          rb_float_new (i < RBZ_METRICS_BOUNDS
+                                        ? rbz_metrics_bounds [i]
+                                        : HUGE_VAL),
+                          ULONG2NUM (cumulative));
+        }
+        rb_hash_aset (h, ID2SYM (rb_intern ("buckets")), buckets);
+        rb_hash_aset (latency, ID2SYM (rb_intern (rbz_operation_names [op])),
+                      h);
+    }
+    rb_hash_aset (hash, ID2SYM (rb_intern ("latency")), latency);
+
+    rb_hash_aset ((VALUE) arg, rb_str_new2 ((const char *) key), hash);
+    return ST_CONTINUE;
+}
+
+/*
+ * Returns: the metrics collected since ZOOM.metrics_enabled was set, as a
+ * Hash of target (the host option of the connection) to a Hash with:
+ *
+ * :connect, :search, :present, :package, :scan, :sort:: the number of
+ *                                                       operations.
+ * :records:: the number of records retrieved.
+ * :bytes:: the size of the record data retrieved.
+ * :errors:: a Hash of ZOOM error code to number of failed operations.
+ * :latency:: a Hash of operation name to a latency histogram, with the
+ *            :count and :sum (in seconds) of the operations, and the
+ *            :buckets Hash of upper bound (in seconds) to the cumulative
+ *            number of operations that took at most that long.
+ */
+static VALUE
+rbz_metrics_get (VALUE self)
+{
+    VALUE hash;
+
+    hash = rb_hash_new ();
+    st_foreach (rbz_metrics_targets, rbz_metrics_target_to_hash,
+                (st_data_t) hash);
+
+    return hash;
+}
+
+/* Appends a target="..." label, escaped as the text format requires. */
+static void
+rbz_metrics_cat_target (VALUE str, const char *target)
+{
+    const char *p;
+
+    rb_str_cat2 (str, "target=\"");
+    for (p = target; *p != '\0'; p++)
+        switch (*p) {
+            case '\\':
+                rb_str_cat2 (str, "\\\\");
+                break;
+            case '"':
+                rb_str_cat2 (str, "\\\"");
+                break;
+            case '\n':
+                rb_str_cat2 (str, "\\n");
+                break;
+            default:
+                rb_str_cat (str, p, 1);
+        }
+    rb_str_cat2 (str, "\"");
+}
+
+struct rbz_metrics_text {
+    VALUE str;
+    const char *target;
+    int section;
+};
+
+enum {
+    RBZ_METRICS_OPERATIONS,
+    RBZ_METRICS_RECORDS,
+    RBZ_METRICS_BYTES,
+    RBZ_METRICS_ERRORS,
+    RBZ_METRICS_LATENCY,
+    RBZ_METRICS_LAST
+};
+
+static const char *rbz_metrics_headers [RBZ_METRICS_LAST] = {
+    "# HELP zoom_operations_total Operations sent to the target.\n"
+    "# TYPE zoom_operations_total counter\n",
+    "# HELP zoom_records_total Records retrieved from the target.\n"
+    "# TYPE zoom_records_total counter\n",
+    "# HELP zoom_bytes_total Bytes of record data retrieved from the target.\n"
+    "# TYPE zoom_bytes_total counter\n",
+    "# HELP zoom_errors_total Failed operations, by ZOOM error code.\n"
+    "# TYPE zoom_errors_total counter\n",
+    "# HELP zoom_operation_duration_seconds Operation latency.\n"
+    "# TYPE zoom_operation_duration_seconds histogram\n"
+};
+
+static int
+rbz_metrics_error_to_text (st_data_t key, st_data_t value, st_data_t arg)
+{
+    struct rbz_metrics_text *text;
+
+    text = (struct rbz_metrics_text *) arg;
+    rb_str_cat2 (text->str, "zoom_errors_total{");
+    rbz_metrics_cat_target (text->str, text->target);
+    rb_str_catf (text->str, ",code=\"%d\"} %lu\n", (int) key,
+                 (unsigned long) value);
+
+    return ST_CONTINUE;
+}
+
+static int
+rbz_metrics_target_to_text (st_data_t key, st_data_t value, st_data_t arg)
+{
+    struct rbz_metrics_text *text;
+    struct rbz_target_metrics *metrics;
+    struct rbz_histogram *histogram;
+    unsigned long cumulative;
+    size_t i;
+    int op;
+
+    text = (struct rbz_metrics_text *) arg;
+    text->target = (const char *) key;
+    metrics = (struct rbz_target_metrics *) value;
+
+    switch (text->section) {
+        case RBZ_METRICS_OPERATIONS:
+            for (op = 0; op < RBZ_OP_LAST; op++) {
+                rb_str_cat2 (text->str, "zoom_operations_total{");
+                rbz_metrics_cat_target (text->str, text->target);
+                rb_str_catf (text->str, ",operation=\"%s\"} %lu\n",
+                             rbz_operation_names [op],
+                             metrics->operations [op]);
+            }
+            break;
+
+        case RBZ_METRICS_RECORDS:
+        case RBZ_METRICS_BYTES:
+            rb_str_cat2 (text->str, text->section == RBZ_METRICS_RECORDS
+                                    ? "zoom_records_total{"
+                                    : "zoom_bytes_total{");
+            rbz_metrics_cat_target (text->str, text->target);
+            rb_str_catf (text->str, "} %lu\n",
+                         text->section == RBZ_METRICS_RECORDS
+                         ? metrics->records : metrics->bytes);
+            break;
+
+        case RBZ_METRICS_ERRORS:
+            st_foreach (metrics->errors, rbz_metrics_error_to_text, arg);
+            break;
+
+        case RBZ_METRICS_LATENCY:
+            for (op = 0; op < RBZ_OP_LAST; op++) {
+                histogram = &metrics->latency [op];
+                cumulative = 0;
+                for (i = 0; i <= RBZ_METRICS_BOUNDS; i++) {
+                    cumulative += histogram->buckets [i];
+                    rb_str_cat2 (text->str,
+                                 "zoom_operation_duration_seconds_bucket{");
+                    rbz_metrics_cat_target (text->str, text->target);
+                    if (i < RBZ_METRICS_BOUNDS)
+                        rb_str_catf (text->str,
+                                     ",operation=\"%s\",le=\"%g\"} %lu\n",
+                                     rbz_operation_names [op],
+                                     rbz_metrics_bounds [i], cumulative);
+                    else
+                        rb_str_catf (text->str,
+                                     ",operation=\"%s\",le=\"+Inf\"} %lu\n",
+                                     rbz_operation_names [op], cumulative);
+                }
+                rb_str_cat2 (text->str, "zoom_operation_duration_seconds_sum{");
+                rbz_metrics_cat_target (text->str, text->target);
+                rb_str_catf (text->str, ",operation=\"%s\"} %.9g\n",
+                             rbz_operation_names [op], histogram->sum);
+                rb_str_cat2 (text->str,
+                             "zoom_operation_duration_seconds_count{");
+                rbz_metrics_cat_target (text->str, text->target);
+                rb_str_catf (text->str, ",operation=\"%s\"} %lu\n",
+                             rbz_operation_names [op], histogram->count);
+            }
+            break;
+    }
+
+    return ST_CONTINUE;
+}
+
+/*
+ * Returns: the metrics collected since ZOOM.metrics_enabled was set, in the
+ * Prometheus text exposition format, ready to be served on a /metrics
+ * endpoint.
+ */
+static VALUE
+rbz_metrics_text (VALUE self)
+{
+    struct rbz_metrics_text text;
+
+    text.str = rb_str_new (NULL, 0);
+    if (rbz_metrics_targets->num_entries == 0)
+        return text.str;
+
+    for (text.section = 0; text.section < RBZ_METRICS_LAST; text.section++) {
+        rb_str_cat2 (text.str, rbz_metrics_headers [text.section]);
+        st_foreach (rbz_metrics_targets, rbz_metrics_target_to_text,
+                    (st_data_t) &text);
+    }
+
+    return text.str;
+}
+
+/*
+ * Forgets all the metrics collected so far.
+ *
+ * Returns: nil.
+ */
+static VALUE
+rbz_metrics_reset (VALUE self)
+{
+    st_foreach (rbz_metrics_targets, rbz_metrics_free_target, 0);
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ * 	metrics_enabled = flag
+ *
+ * flag: whether to collect metrics, as a boolean.
+ *
+ * Starts or stops collecting the metrics returned by ZOOM.metrics and
+ * ZOOM.metrics_text.  Collection is off by default.
+ *
+ * Returns: flag.
+ */
+static VALUE
+rbz_metrics_set_enabled (VALUE self, VALUE flag)
+{
+    if (RVAL2CBOOL (flag))
+        rbz_instrumenting |= RBZ_INSTRUMENT_METRICS;
+    else
+        rbz_instrumenting &= ~RBZ_INSTRUMENT_METRICS;
+
+    return flag;
+}
+
+/*
+ * Returns: whether metrics are being collected.
+ */
+static VALUE
+rbz_metrics_enabled (VALUE self)
+{
+    return CBOOL2RVAL (rbz_instrumenting & RBZ_INSTRUMENT_METRICS);
+}
+
+void
+Init_zoom_metrics (VALUE mZoom)
+{
+    rbz_metrics_targets = st_init_strtable ();
+
+    rb_define_module_function (mZoom, "metrics", rbz_metrics_get, 0);
+    rb_define_module_function (mZoom, "metrics_text", rbz_metrics_text, 0);
+    rb_define_module_function (mZoom, "reset_metrics", rbz_metrics_reset, 0);
+    rb_define_module_function (mZoom, "metrics_enabled=",
+                               rbz_metrics_set_enabled, 1);
+    rb_define_module_function (mZoom, "metrics_enabled?",
+                               rbz_metrics_enabled, 0);
+}
@@ -0,0 +1,445 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sys/socket.h>
+#include "rbzoom.h"
+
+#ifdef MAKING_RDOC_HAPPY
+mZoom = rb_define_module("ZOOM");
+#endif
+
+/* Document-class: ZOOM::Multiplexer
+ *
+ * A multiplexer runs searches on many connections at the same time, in
+ * the ZOOM asynchronous mode, and reports each result set as soon as its
+ * target is done.  The total time spent is the one of the slowest target
+ * instead of the sum of all of them.
+ *
+ * 	mux = ZOOM::Multiplexer.new
+ * 	mux.add(loc, '@attr 1=4 ruby', 10)
+ * 	mux.add(copac, '@attr 1=4 ruby', 10)
+ * 	mux.run do |conn, result|
+ * 	  if result.is_a?(ZOOM::ResultSet)
+ * 	    puts "#{conn.host}: #{result.size}"
+ * 	  else
+ * 	    puts "#{conn.host} failed: #{result.message}"
+ * 	  end
+ * 	end
+ *
+ * When only the number of hits of each target is needed,
+ * ZOOM::Multiplexer#count runs the same searches without retrieving any
+ * record.
+ */
+static VALUE cZoomMultiplexer;
+
+struct rbz_multiplexer {
+    VALUE targets;  /* Array of [connection, query, timeout] */
+};
+
+static void
+rbz_multiplexer_mark (struct rbz_multiplexer *mux)
+{
+    rb_gc_mark (mux->targets);
+}
+
+static size_t
+rbz_multiplexer_memsize (const void *data)
+{
+    return sizeof (struct rbz_multiplexer);
+}
+
+static const rb_data_type_t rbz_multiplexer_data_type = {
+    .wrap_struct_name = "ZOOM::Multiplexer",
+    .function = {
+        .dmark = (RUBY_DATA_FUNC) rbz_multiplexer_mark,
+        .dfree = RUBY_TYPED_DEFAULT_FREE,
+        .dsize = rbz_multiplexer_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+rbz_multiplexer_alloc (VALUE klass)
+{
+    struct rbz_multiplexer *mux;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct (klass,
+                                 struct rbz_multiplexer,
+                                 &rbz_multiplexer_data_type,
+                                 mux);
+    mux->targets = rb_ary_new ();
+
+    return obj;
+}
+
+static struct rbz_multiplexer *
+rbz_multiplexer_get (VALUE obj)
+{
+    struct rbz_multiplexer *mux;
+
+    TypedData_Get_Struct (obj, struct rbz_multiplexer,
+                          &rbz_multiplexer_data_type, mux);
+    assert (mux != NULL);
+
+    return mux;
+}
+
+/*
+ * call-seq:
+ * 	add(connection, criterion, timeout=nil)
+ *
+ * connection: a ZOOM::Connection object.
+ *
+ * criterion: the search criterion, either as a ZOOM::Query object or as a
+ * string, representing a PQF query.
+ *
+ * timeout: the number of seconds after which the target is given up
+ * (optional).  This sets the timeout option of the connection.
+ *
+ * Adds a search to be run on the given connection.  The connection may
+ * not be connected yet, as long as its host option is set, in which case
+ * it will be connected at the same time as the other targets.  A
+ * connection can only be added once, ArgumentError is raised otherwise.
+ *
+ * Returns: self.
+ */
+static VALUE
+rbz_multiplexer_add (int argc, VALUE *argv, VALUE self)
+{
+    VALUE connection;
+    VALUE criterion;
+    VALUE timeout;
+    VALUE targets;
+    long i;
+
+    rb_scan_args (argc, argv, "21", &connection, &criterion, &timeout);
+
+    rbz_connection_get (connection);
+    if (TYPE (criterion) != T_STRING)
+        rbz_query_get (criterion);
+
+    /* A connection runs one search at a time, and ends it with one event */
+    targets = rbz_multiplexer_get (self)->targets;
+    for (i = 0; i < RARRAY_LEN (targets); i++)
+        if (RARRAY_PTR (RARRAY_PTR (targets) [i]) [0] == connection)
+            rb_raise (rb_eArgError, "connection already added");
+
+    rb_ary_push (targets, rb_ary_new3 (3, connection, criterion, timeout));
+
+    return self;
+}
+
+/*
+ * Returns: the number of searches added to the multiplexer.
+ */
+static VALUE
+rbz_multiplexer_size (VALUE self)
+{
+    return LONG2NUM (RARRAY_LEN (rbz_multiplexer_get (self)->targets));
+}
+
+struct rbz_multiplexer_run {
+    VALUE self;
+    VALUE running;      /* Array of [connection, result set,
+                           saved count options] */
+    VALUE results;
+    ZOOM_connection *connections;
+    ZOOM_resultset *resultsets;     /* only owned for counts */
+    double *started;                /* for RBZ_INSTRUMENT_FINISH */
+    int counting;
+    int count;
+    int event;
+};
+
+static void *
+rbz_multiplexer_event_blocking (void *data)
+{
+    struct rbz_multiplexer_run *run;
+
+    run = (struct rbz_multiplexer_run *) data;
+    run->event = ZOOM_event (run->count, run->connections);
+
+    return NULL;
+}
+
+static void
+rbz_multiplexer_unblock (void *data)
+{
+    struct rbz_multiplexer_run *run;
+    int fd;
+    int i;
+
+    run = (struct rbz_multiplexer_run *) data;
+    for (i = 0; i < run->count; i++) {
+        fd = ZOOM_connection_get_socket (run->connections [i]);
+        if (fd >= 0)
+            shutdown (fd, SHUT_RDWR);
+    }
+}
+
+static void
+rbz_multiplexer_restore (ZOOM_connection connection, VALUE entry)
+{
+    if (!NIL_P (RARRAY_PTR (entry) [2]))
+        rbz_connection_restore_options (connection, RARRAY_PTR (entry) [2]);
+}
+
+/*
+ * Sends the searches of all targets.  Connections are connected in
+ * asynchronous mode, see ZOOM::Connection, so the searches are only queued,
+ * and the targets that are not connected yet are connected the same way.
+ */
+static void
+rbz_multiplexer_start (struct rbz_multiplexer_run *run)
+{
+    VALUE targets;
+    VALUE target;
+    VALUE rb_connection;
+    VALUE criterion;
+    VALUE timeout;
+    VALUE query;
+    VALUE host;
+    VALUE saved;
+    VALUE rb_resultset;
+    ZOOM_connection connection;
+    ZOOM_resultset resultset;
+    long i;
+
+    targets = rbz_multiplexer_get (run->self)->targets;
+    for (i = 0; i < RARRAY_LEN (targets); i++) {
+        target = RARRAY_PTR (targets) [i];
+        rb_connection = RARRAY_PTR (target) [0];
+        criterion = RARRAY_PTR (target) [1];
+        timeout = RARRAY_PTR (target) [2];
+
+        /* Malformed PQF raises here, before the connection is changed */
+        query = TYPE (criterion) == T_STRING
+            ? rbz_query_prefix (criterion)
+            : criterion;
+
+        connection = rbz_connection_get (rb_connection);
+        host = CSTR2RVAL (ZOOM_connection_option_get (connection, "host"));
+        if (ZOOM_connection_get_socket (connection) < 0 && !NIL_P (host))
+            rbz_connection_queue_connect (rb_connection, host, Qnil);
+
+        if (!NIL_P (timeout))
+            ZOOM_connection_option_set (connection, "timeout",
+                                        RVAL2CSTR (rb_obj_as_string (timeout)));
+
+        saved = run->counting
+            ? rbz_connection_count_options_set (connection)
+            : Qnil;
+
+        run->started [run->count] = RBZ_INSTRUMENT_START ();
+        resultset = ZOOM_connection_search (connection, rbz_query_get (query));
+
+        /* Counts never get a ZOOM::ResultSet, only their size is reported. */
+        rb_resultset = Qnil;
+        if (!run->counting)
+            rb_resultset = rbz_resultset_make (resultset, rb_connection,
+                                               criterion);
+        run->resultsets [run->count] = resultset;
+
+        rb_ary_push (run->running,
+                     rb_ary_new3 (3, rb_connection, rb_resultset, saved));
+        run->connections [run->count++] = connection;
+
+        /* ZOOM_event uses the connection until it is done */
+        rbz_connection_busy (rb_connection, 1);
+    }
+}
+
+/*
+ * Takes target i out of the running set and yields its result.  Targets
+ * left behind when YAZ has no more events, stalled, get an error.
+ */
+static void
+rbz_multiplexer_finish (struct rbz_multiplexer_run *run, int i, int stalled)
+{
+    ZOOM_connection connection;
+    ZOOM_resultset resultset;
+    VALUE entry;
+    VALUE rb_connection;
+    VALUE result;
+    double started;
+    size_t size;
+
+    entry = rb_ary_delete_at (run->running, i);
+    connection = run->connections [i];
+    resultset = run->resultsets [i];
+    started = run->started [i];
+    memmove (run->connections + i, run->connections + i + 1,
+             (run->count - i - 1) * sizeof (ZOOM_connection));
+    memmove (run->resultsets + i, run->resultsets + i + 1,
+             (run->count - i - 1) * sizeof (ZOOM_resultset));
+    memmove (run->started + i, run->started + i + 1,
+             (run->count - i - 1) * sizeof (double));
+    run->count--;
+
+    rb_connection = RARRAY_PTR (entry) [0];
+    rbz_connection_busy (rb_connection, -1);
+    rbz_multiplexer_restore (connection, entry);
+    result = rbz_connection_error (connection);
+    if (NIL_P (result) && stalled)
+        result = rb_exc_new2 (rb_eRuntimeError, "the target did not complete");
+    size = NIL_P (result) ? ZOOM_resultset_size (resultset) : 0;
+    if (NIL_P (result))
+        result = run->counting ? SIZET2NUM (size) : RARRAY_PTR (entry) [1];
+    if (run->counting)
+        ZOOM_resultset_destroy (resultset);
+
+    /* Each target is reported as a search of its own */
+    RBZ_INSTRUMENT_FINISH (RBZ_OP_SEARCH, connection, started, size, 0);
+
+    rb_hash_aset (run->results, rb_connection, result);
+    if (rb_block_given_p ())
+        rb_yield_values (2, rb_connection, result);
+}
+
+/* Waits for targets to complete and yields them in completion order. */
+static VALUE
+rbz_multiplexer_loop (VALUE data)
+{
+    struct rbz_multiplexer_run *run;
+    ZOOM_connection connection;
+
+    run = (struct rbz_multiplexer_run *) data;
+    rbz_multiplexer_start (run);
+
+    while (run->count > 0) {
+        RBZ_CALL_WITHOUT_GVL (rbz_multiplexer_event_blocking, run,
+                              rbz_multiplexer_unblock, run);
+        if (run->event == 0)
+            break;
+
+        connection = run->connections [run->event - 1];
+        if (ZOOM_connection_last_event (connection) == ZOOM_EVENT_END)
+            rbz_multiplexer_finish (run, run->event - 1, 0);
+    }
+
+    /* No more events: the targets still running will never complete */
+    while (run->count > 0)
+        rbz_multiplexer_finish (run, 0, 1);
+
+    return run->results;
+}
+
+static VALUE
+rbz_multiplexer_cleanup (VALUE data)
+{
+    struct rbz_multiplexer_run *run;
+    int i;
+
+    run = (struct rbz_multiplexer_run *) data;
+    for (i = 0; i < run->count; i++) {
+        rbz_connection_busy (RARRAY_PTR (RARRAY_PTR (run->running) [i]) [0],
+                             -1);
+        rbz_multiplexer_restore (run->connections [i],
+                                 RARRAY_PTR (run->running) [i]);
+        if (run->counting)
+            ZOOM_resultset_destroy (run->resultsets [i]);
+    }
+    xfree (run->connections);
+    xfree (run->resultsets);
+    xfree (run->started);
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ * 	run { |connection, result| ... }
+ *
+ * Runs the searches added to the multiplexer all at once, and calls the
+ * given block for each target as soon as it is done, passing the connection
+ * and either a ZOOM::ResultSet object or, if the target failed or timed out,
+ * the RuntimeError describing the failure.  Failed targets do not prevent
+ * the other ones from completing, so partial results are always reported,
+ * and targets YAZ stops reporting events for get a RuntimeError as well.
+ *
+ * Connections that are not connected yet are connected from their host
+ * option, along with the other targets.  The result sets passed to the
+ * block can be used normally from there.
+ *
+ * Each target is reported to ZOOM.subscribe subscribers and to ZOOM.metrics
+ * as a search of its own, timed from when it was sent until it was done.
+ *
+ * Returns: a Hash mapping each connection to its result.
+ */
+static VALUE
+rbz_multiplexer_start_run (VALUE self, int counting)
+{
+    struct rbz_multiplexer_run run;
+    long n;
+
+    n = RARRAY_LEN (rbz_multiplexer_get (self)->targets) + 1;
+    run.self = self;
+    run.running = rb_ary_new ();
+    run.results = rb_hash_new ();
+    run.counting = counting;
+    run.count = 0;
+    run.event = 0;
+    run.connections = ALLOC_N (ZOOM_connection, n);
+    run.resultsets = ALLOC_N (ZOOM_resultset, n);
+    run.started = ALLOC_N (double, n);
+
+    return rb_ensure (rbz_multiplexer_loop, (VALUE) &run,
+                      rbz_multiplexer_cleanup, (VALUE) &run);
+}
+
+static VALUE
+rbz_multiplexer_run (VALUE self)
+{
+    return rbz_multiplexer_start_run (self, 0);
+}
+
+/*
+ * call-seq:
+ * 	count { |connection, result| ... }
+ *
+ * Runs the searches added to the multiplexer all at once for their number
+ * of hits only, like ZOOM::Connection#count does for a single target: no
+ * record is sent with the search responses, and no ZOOM::ResultSet object
+ * is created.  The given block is called for each target as soon as it is
+ * done, passing the connection and either the number of hits or, if the
+ * target failed or timed out, the RuntimeError describing the failure.
+ *
+ * The piggyback options of the connections are set back before the
+ * connections are passed to the block.
+ *
+ * Returns: a Hash mapping each connection to its result.
+ */
+static VALUE
+rbz_multiplexer_count (VALUE self)
+{
+    return rbz_multiplexer_start_run (self, 1);
+}
+
+void
+Init_zoom_multiplexer (VALUE mZoom)
+{
+    VALUE c;
+
+    c = rb_define_class_under (mZoom, "Multiplexer", rb_cObject);
+    rb_define_alloc_func (c, rbz_multiplexer_alloc);
+    rb_define_method (c, "add", rbz_multiplexer_add, -1);
+    rb_define_method (c, "size", rbz_multiplexer_size, 0);
+    rb_define_method (c, "run", rbz_multiplexer_run, 0);
+    rb_define_method (c, "count", rbz_multiplexer_count, 0);
+
+    cZoomMultiplexer = c;
+}
@@ -19,48 +19,72 @@
 #include <ctype.h>
 #include "rbzoom.h"
 
+/* ID of an accessor => name of its option */
+static st_table *rbz_option_names;
+
+/* class => struct rbz_option_ops */
+static st_table *rbz_option_classes;
+
+/*
+ * Returns the string to give to ZOOM for value: booleans are 1 or 0, other
+ * objects are converted with #to_s, keeping the string in str.
+ */
+const char *
+rbz_option_value (VALUE value, VALUE *str)
+{
+    switch (TYPE (value)) {
+        case T_TRUE:
+            return "1";
+        case T_FALSE:
+            return "0";
+        case T_STRING:
+            *str = value;
+            break;
+        default:
+            *str = rb_obj_as_string (value);
+    }
+
+    return RVAL2CSTR (*str);
+}
+
+/*
+ * Returns the name of the option for key: a symbol naming an accessor, such
+ * as :database_name, gives the option of this accessor, and anything else
+ * is taken as the name of the option itself.
+ */
+const char *
+rbz_option_key (VALUE key, VALUE *str)
+{
+    st_data_t option;
+
+    if (SYMBOL_P (key) 
+        && st_lookup (rbz_option_names, (st_data_t) SYM2ID (key), &option))
+        return (const char *) option;
+
+    return rbz_option_value (key, str);
+}
+
+static int
+rbz_option_set_pair (VALUE key, VALUE value, VALUE options)
+{
+    VALUE key_str;
+    VALUE value_str;
+
+    ZOOM_options_set ((ZOOM_options) options,
+                      rbz_option_key (key, &key_str),
+                      rbz_option_value (value, &value_str));
+
+    return ST_CONTINUE;
+}
+
 ZOOM_options
 ruby_hash_to_zoom_options (VALUE hash)
 {
     ZOOM_options options;
-    VALUE ary;
-    VALUE pair;
-    VALUE key;
-    VALUE value;
-    int i;
 
+    Check_Type (hash, T_HASH);
     options = ZOOM_options_create ();
-    
-    ary = rb_funcall (hash, rb_intern ("to_a"), 0);
-    for (i = 0; i < RARRAY_LEN(ary); i++) {
-        pair = RARRAY_PTR(ary)[i];
-        key = RARRAY_PTR(pair)[0];
-        value = RARRAY_PTR(pair)[1];
-        
-        switch (TYPE (value)) {
-            case T_TRUE:
-            case T_FALSE:
-                ZOOM_options_set_int (options, 
-                                      RVAL2CSTR (key),
-                                      RVAL2CBOOL (value) ? 1 : 0);
-                break;
-
-            case T_FIXNUM:
-                ZOOM_options_set_int (options, 
-                                      RVAL2CSTR (key),
-                                      FIX2INT (value));
-                break;
-                
-            case T_STRING:
-                ZOOM_options_set (options, 
-                                  RVAL2CSTR (key), 
-                                  RVAL2CSTR (value));
-                break;
-
-            default:
-                rb_raise (rb_eArgError, "Unrecognized type");        
-        }
-    }        
+    rb_hash_foreach (hash, rbz_option_set_pair, (VALUE) options);
 
     return options;
 }
@@ -68,54 +92,167 @@ ruby_hash_to_zoom_options (VALUE hash)
 VALUE
 zoom_option_value_to_ruby_value (const char *value)
 {
-    unsigned int i;
+    const char *p;
 
     if (value == NULL)
         return Qnil; 
 
-    for (i = 0; i < strlen (value); i++)
-        if (!isdigit (value [i]))
+    for (p = value; *p != '\0'; p++)
+        if (!isdigit ((unsigned char) *p))
             return CSTR2RVAL (value);
 
     return INT2FIX (atoi (value));
 }
 
+/* Returns the option functions of the class of obj. */
+static const struct rbz_option_ops *
+rbz_option_ops (VALUE obj)
+{
+    st_data_t ops;
+    VALUE klass;
+
+    for (klass = rb_obj_class (obj); 
+         !NIL_P (klass); 
+         klass = rb_class_superclass (klass))
+        if (st_lookup (rbz_option_classes, (st_data_t) klass, &ops))
+            return (const struct rbz_option_ops *) ops;
+
+    rb_raise (rb_eTypeError, "%s has no ZOOM options", 
+              rb_obj_classname (obj));
+}
+
+/*
+ * Sets an option of obj, which is either the name of the option or the
+ * symbol of one of its accessors.
+ */
+void
+rbz_option_set (VALUE obj, VALUE key, VALUE value)
+{
+    VALUE key_str;
+    VALUE value_str;
+
+    rbz_option_ops (obj)->set (obj, 
+                               rbz_option_key (key, &key_str),
+                               rbz_option_value (value, &value_str));
+}
+
+/* Returns the option of the accessor being called. */
+static const char *
+rbz_option_called (void)
+{
+    st_data_t option;
+
+    if (!st_lookup (rbz_option_names, (st_data_t) rb_frame_this_func (), 
+                    &option))
+        rb_bug ("no ZOOM option for %s", rb_id2name (rb_frame_this_func ()));
+
+    return (const char *) option;
+}
+
+/* The reader of all options. */
+static VALUE
+rbz_option_reader (VALUE self)
+{
+    return zoom_option_value_to_ruby_value (
+        rbz_option_ops (self)->get (self, rbz_option_called ()));
+}
+
+/* The writer of all options, as option= and set_option. */
+static VALUE
+rbz_option_writer (VALUE self, VALUE value)
+{
+    VALUE str;
+
+    rbz_option_ops (self)->set (self, rbz_option_called (), 
+                                rbz_option_value (value, &str));
+
+    return self;
+}
+
+static int
+rbz_option_set_each (VALUE key, VALUE value, VALUE obj)
+{
+    rbz_option_set (obj, key, value);
+    return ST_CONTINUE;
+}
+
+/*
+ * call-seq:
+ * 	set_options(options)
+ *
+ * options: a Hash of options, keyed by their names, or by the symbols of 
+ * their accessors, such as :database_name.
+ *
+ * Sets many options at once.
+ *
+ * Returns: self.
+ */
+static VALUE
+rbz_option_set_options (VALUE self, VALUE options)
+{
+    Check_Type (options, T_HASH);
+    rb_hash_foreach (options, rbz_option_set_each, self);
+
+    return self;
+}
+
+/*
+ * Makes klass use ops for the accessors defined with define_zoom_option,
+ * and defines its set_options method.
+ */
+void
+rbz_define_options (VALUE klass, const struct rbz_option_ops *ops)
+{
+    if (rbz_option_names == NULL) {
+        rbz_option_names = st_init_numtable ();
+        rbz_option_classes = st_init_numtable ();
+    }
+    st_insert (rbz_option_classes, (st_data_t) klass, (st_data_t) ops);
+    rb_define_method (klass, "set_options", rbz_option_set_options, 1);
+}
+
+/*
+ * Defines the accessors of an option, named after it in snake case:
+ * database_name, database_name= and set_database_name for databaseName.
+ * They all share the same native implementation, which finds the option
+ * from the name of the method called.
+ */
 void
 define_zoom_option (VALUE klass, const char *option)
 {
-    char code [1024];
     char rubyname [128];
+    char name [sizeof rubyname + 4];
+    const char *p;
     char c;
-    unsigned int i;
-    unsigned int j;
+    size_t j;
    
+    assert (rbz_option_names != NULL);
+
     /* rubyfy the option name */
-    for (i = 0, j = 0; i < strlen (option) && j < sizeof rubyname; i++, j++) {
-        c = option [i];
-        if (isupper (c)) {
+    for (p = option, j = 0; *p != '\0' && j < sizeof rubyname - 2; p++, j++) {
+        c = *p;
+        if (isupper ((unsigned char) c)) {
             rubyname [j++] = '_';
-            c = tolower (c);
+            c = tolower ((unsigned char) c);
         }
-		else if (c == '-')
-		{
-			c = '_';
-		}
-		else if (c == '.')
-		{
-			c = '_';
-		}
+        else if (c == '-' || c == '.')
+            c = '_';
 		
         rubyname [j] = c;
     }
     rubyname [j] = '\0';
 
-    snprintf (code, sizeof code, 
-              "def %s; get_option(\"%s\"); end\n"
-              "def %s=(val); set_option(\"%s\", val); val; end\n"
-              "def set_%s(val); set_option(\"%s\", val); end\n",
-              rubyname, option,
-              rubyname, option,
-              rubyname, option);
-             
-    rb_funcall (klass, rb_intern ("module_eval"), 1, CSTR2RVAL (code));
+    st_insert (rbz_option_names, (st_data_t) rb_intern (rubyname), 
+               (st_data_t) option);
+    rb_define_method (klass, rubyname, rbz_option_reader, 0);
+
+    snprintf (name, sizeof name, "%s=", rubyname);
+    st_insert (rbz_option_names, (st_data_t) rb_intern (name), 
+               (st_data_t) option);
+    rb_define_method (klass, name, rbz_option_writer, 1);
+
+    snprintf (name, sizeof name, "set_%s", rubyname);
+    st_insert (rbz_option_names, (st_data_t) rb_intern (name), 
+               (st_data_t) option);
+    rb_define_method (klass, name, rbz_option_writer, 1);
 }
@@ -30,19 +30,69 @@ mZoom = rb_define_module("ZOOM");
  */
 static VALUE cZoomPackage;
 
+struct rbz_package {
+    ZOOM_package package;
+    VALUE connection;
+};
 
-static ZOOM_package
-rbz_package_get (VALUE obj)
+static void
+rbz_package_mark (struct rbz_package *pkg)
 {
-    ZOOM_package package;
+    rb_gc_mark (pkg->connection);
+}
+
+static void
+rbz_package_free (struct rbz_package *pkg)
+{
+    if (pkg->package != NULL)
+        ZOOM_package_destroy (pkg->package);
+    xfree (pkg);
+}
+
+/* The record to send is most of what a package holds. */
+static size_t
+rbz_package_memsize (const void *data)
+{
+    const struct rbz_package *pkg;
+    const char *record;
+
+    pkg = (const struct rbz_package *) data;
+    record = pkg->package != NULL
+        ? ZOOM_package_option_get (pkg->package, "record")
+        : NULL;
+
+    return sizeof (struct rbz_package)
+        + (record != NULL ? strlen (record) : 0);
+}
 
-	if (cZoomPackage == Qnil)
-		rb_raise(rb_eRuntimeError, "cZoomPackage is nil: has destroy() already been called on this Package?");
-        
-    Data_Get_Struct (obj, struct ZOOM_package_p, package);
-    assert (package != NULL);
+static const rb_data_type_t rbz_package_data_type = {
+    .wrap_struct_name = "ZOOM::Package",
+    .function = {
+        .dmark = (RUBY_DATA_FUNC) rbz_package_mark,
+        .dfree = (RUBY_DATA_FUNC) rbz_package_free,
+        .dsize = rbz_package_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
 
-    return package;
+static struct rbz_package *
+rbz_package_data (VALUE obj)
+{
+    struct rbz_package *pkg;
+
+    TypedData_Get_Struct (obj, struct rbz_package, &rbz_package_data_type,
+                          pkg);
+    assert (pkg != NULL);
+    if (pkg->package == NULL)
+        rb_raise (rb_eIOError, "destroyed package");
+
+    return pkg;
+}
+
+static ZOOM_package
+rbz_package_get (VALUE obj)
+{
+    return rbz_package_data (obj)->package;
 }
 
 
@@ -50,29 +100,50 @@ rbz_package_get (VALUE obj)
  * call-seq: 
  * 	make(connection, options)
 *
-*  Creates a ZOOM::Package from the connection and options specified.
+*  Creates a ZOOM::Package from the connection and options specified.  The
+*  package keeps the connection alive.
 *
 *  Returns: the created ZOOM::Package or Qnil.
 */
 VALUE
-rbz_package_make (ZOOM_connection connection, ZOOM_options options)
+rbz_package_make (VALUE connection, ZOOM_options options)
 {
 
   ZOOM_package package;
+  struct rbz_package *pkg;
+  VALUE obj;
+
+  package =  ZOOM_connection_package(rbz_connection_get (connection), options);
 
-  package =  ZOOM_connection_package(connection, options);
+  if (package == NULL)
+      return Qnil;
 
-  if (cZoomPackage == Qnil)
-	rb_raise(rb_eRuntimeError, "cZoomPackage is nil: has destroy() already been called on this Package?");
+  obj = TypedData_Make_Struct (cZoomPackage,
+                               struct rbz_package,
+                               &rbz_package_data_type,
+                               pkg);
+  pkg->package = package;
+  pkg->connection = connection;
 
-  return package != NULL
-      ? Data_Wrap_Struct (cZoomPackage,
-                          NULL,
-                          ZOOM_package_destroy,
-                          package)
-      : Qnil;
+  return obj;
 }
 
+static const char *
+rbz_package_option_get (VALUE obj, const char *key)
+{
+    return ZOOM_package_option_get (rbz_package_get (obj), key);
+}
+
+static void
+rbz_package_option_set (VALUE obj, const char *key, const char *value)
+{
+    ZOOM_package_option_set (rbz_package_get (obj), key, value);
+}
+
+static const struct rbz_option_ops rbz_package_options = {
+    rbz_package_option_get,
+    rbz_package_option_set
+};
 
 /*
  * call-seq:
@@ -89,13 +160,7 @@ rbz_package_make (ZOOM_connection connection, ZOOM_options options)
 static VALUE
 rbz_package_set_option (VALUE self, VALUE key, VALUE val)
 {   
-
-	ZOOM_package package;
-    
-    package = rbz_package_get (self);
-    ZOOM_package_option_set (package,
-                                RVAL2CSTR (key),
-                                RVAL2CSTR (rb_obj_as_string (val)));
+    rbz_option_set (self, key, val);
    
     return self;
 }
@@ -114,15 +179,8 @@ rbz_package_set_option (VALUE self, VALUE key, VALUE val)
 static VALUE
 rbz_package_get_option (VALUE self, VALUE key)
 {
-	ZOOM_package package;
-    const char *value;
- 
-    package = rbz_package_get (self);
- 
-    value = ZOOM_package_option_get (package,
-                                        RVAL2CSTR (key));
-
-    return zoom_option_value_to_ruby_value (value);
+    return zoom_option_value_to_ruby_value (
+        rbz_package_option_get (self, RVAL2CSTR (key)));
 }
 
 /*
@@ -131,24 +189,73 @@ rbz_package_get_option (VALUE self, VALUE key)
  *
  * type:  the actual extended service package type to be sent, as a string.
  *
- * Sends the package.
+ * Sends the package.  Raises IOError if its connection was closed.
  * 
  * Returns: self.
  */
 static VALUE
 rbz_package_send(VALUE self, VALUE type)
 {
-    ZOOM_package package;
+    struct rbz_package *pkg;
 	const char *typeChar;
+    double started;
+
+    pkg = rbz_package_data (self);
 
-    package = rbz_package_get (self);
+    /* The package points to the connection: raises if it was closed */
+    rbz_connection_get (pkg->connection);
 
     typeChar = StringValuePtr(type);
-    ZOOM_package_send(package, typeChar);
+    started = RBZ_INSTRUMENT_START ();
+    ZOOM_package_send(pkg->package, typeChar);
+    rbz_connection_wait (pkg->connection);
+    RBZ_INSTRUMENT_FINISH (RBZ_OP_PACKAGE, rbz_connection_get (pkg->connection),
+                           started, 0, 0);
   
     return self;
 }
 
+/*
+ * call-seq:
+ * 	destroy
+ *
+ * Destroys the package, freeing the memory held by YAZ now rather than when
+ * the object is garbage collected.  Any later use of the package raises an
+ * IOError.  Destroying a package that is destroyed already does nothing.
+ *
+ * Returns: nil.
+ */
+static VALUE
+rbz_package_destroy (VALUE self)
+{
+    struct rbz_package *pkg;
+
+    TypedData_Get_Struct (self, struct rbz_package, &rbz_package_data_type,
+                          pkg);
+    if (pkg->package != NULL) {
+        ZOOM_package_destroy (pkg->package);
+        pkg->package = NULL;
+        pkg->connection = Qnil;
+    }
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ * 	destroyed?
+ *
+ * Returns: whether the package is destroyed.
+ */
+static VALUE
+rbz_package_destroyed_p (VALUE self)
+{
+    struct rbz_package *pkg;
+
+    TypedData_Get_Struct (self, struct rbz_package, &rbz_package_data_type,
+                          pkg);
+    return CBOOL2RVAL (pkg->package == NULL);
+}
 
 
 /* Interface to a subset of the Z39.50 extended services.
@@ -161,12 +268,16 @@ Init_zoom_package (VALUE mZoom)
     c = rb_define_class_under (mZoom, "Package", rb_cObject); 
 
 	/* Remove the default constructor to force initialization through Connection#package. */
+    rb_undef_alloc_func (c);
     rb_undef_method (CLASS_OF (c), "new");
 
 	/* Instance methods */
     rb_define_method (c, "set_option", rbz_package_set_option, 2);
     rb_define_method (c, "get_option", rbz_package_get_option, 1);
+    rbz_define_options (c, &rbz_package_options);
     rb_define_method (c, "send", rbz_package_send, 1);
+    rb_define_method (c, "destroy", rbz_package_destroy, 0);
+    rb_define_method (c, "destroyed?", rbz_package_destroyed_p, 0);
 
 	// Common Options
     define_zoom_option (c, "package-name");
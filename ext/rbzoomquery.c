@@ -24,29 +24,252 @@ mZoom = rb_define_module("ZOOM");
 
 /* Class: ZOOM::Query
  * Search queries.
+ *
+ * Queries are parsed once: ZOOM::Query.new_prefix and ZOOM::Query.new_cql,
+ * as well as searches given as PQF strings, take the queries they already
+ * made for the same notation from a cache, which keeps the last 
+ * ZOOM::Query.cache_size ones.  Queries are never modified once made, and 
+ * can be shared by many connections and threads.
  */
 static VALUE cZoomQuery;
 
+/* Class: ZOOM::Query::Template
+ * Queries with placeholders, see ZOOM::Query.template.
+ */
+static VALUE cZoomQueryTemplate;
+
+/* Hash: key => ZOOM::Query, the least recently used first */
+static VALUE rbz_query_cache;
+static long rbz_query_cache_size = 256;
+static size_t rbz_query_cache_hits;
+static size_t rbz_query_cache_misses;
+
+struct rbz_query {
+    ZOOM_query query;
+    VALUE key;      /* notation the query was made from, or nil */
+};
+
+static void
+rbz_query_mark (struct rbz_query *q)
+{
+    rb_gc_mark (q->key);
+}
+
+static void
+rbz_query_free (struct rbz_query *q)
+{
+    ZOOM_query_destroy (q->query);
+    xfree (q);
+}
+
+/* A parsed query takes about as much memory as its notation. */
+static size_t
+rbz_query_memsize (const void *data)
+{
+    const struct rbz_query *q;
+
+    q = (const struct rbz_query *) data;
+    return sizeof (struct rbz_query)
+        + (!NIL_P (q->key) ? RSTRING_LEN (q->key) : 0);
+}
+
+static const rb_data_type_t rbz_query_data_type = {
+    .wrap_struct_name = "ZOOM::Query",
+    .function = {
+        .dmark = (RUBY_DATA_FUNC) rbz_query_mark,
+        .dfree = (RUBY_DATA_FUNC) rbz_query_free,
+        .dsize = rbz_query_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * Returns the key of a query, which identifies it for the query cache and
+ * the result cache: the kind of notation, a colon, then the notation.
+ */
+static VALUE
+rbz_query_make_key (const char *kind, VALUE notation)
+{
+    VALUE key;
+
+    key = rb_str_new2 (kind);
+    rb_str_cat2 (key, ":");
+    rb_str_append (key, notation);
+
+    return rb_obj_freeze (key);
+}
+
+/* Wraps query, identified by key (nil if it cannot be cached). */
 static VALUE
-rbz_query_make (ZOOM_query query)
+rbz_query_make (ZOOM_query query, VALUE key)
 {
-    return query != NULL
-        ? Data_Wrap_Struct (cZoomQuery,
-                            NULL,
-                            ZOOM_query_destroy,
-                            query)
-        : Qnil;
+    struct rbz_query *q;
+    VALUE obj;
+
+    if (query == NULL)
+        return Qnil;
+
+    obj = TypedData_Make_Struct (cZoomQuery,
+                                 struct rbz_query,
+                                 &rbz_query_data_type,
+                                 q);
+    q->query = query;
+    q->key = key;
+
+    return obj;
+}
+
+/* Returns the query cached for key, or nil. */
+static VALUE
+rbz_query_cache_lookup (VALUE key)
+{
+    VALUE query;
+
+    if (rbz_query_cache_size == 0)
+        return Qnil;
+
+    query = rb_hash_delete (rbz_query_cache, key);
+    if (NIL_P (query)) {
+        rbz_query_cache_misses++;
+        return Qnil;
+    }
+
+    /* Move it to the end, as the most recently used */
+    rb_hash_aset (rbz_query_cache, key, query);
+    rbz_query_cache_hits++;
+
+    return query;
+}
+
+static VALUE
+rbz_query_cache_store (VALUE query)
+{
+    if (rbz_query_cache_size == 0)
+        return query;
+
+    rb_hash_aset (rbz_query_cache, rbz_query_key (query), query);
+    while (RHASH_SIZE (rbz_query_cache) > (size_t) rbz_query_cache_size)
+        rb_funcall (rbz_query_cache, rb_intern ("shift"), 0);
+
+    return query;
+}
+
+static struct rbz_query *
+rbz_query_data (VALUE obj)
+{
+    struct rbz_query *q;
+
+    TypedData_Get_Struct (obj, struct rbz_query, &rbz_query_data_type, q);
+    assert (q != NULL && q->query != NULL);
+
+    return q;
 }
 
 ZOOM_query
 rbz_query_get (VALUE obj)
+{
+    return rbz_query_data (obj)->query;
+}
+
+/*
+ * Returns the notation the query was made from, prefixed with its kind, or
+ * nil for queries that cannot be told apart that way.
+ */
+VALUE
+rbz_query_key (VALUE obj)
+{
+    return rbz_query_data (obj)->key;
+}
+
+/*
+ * Returns the query for the given PQF notation, from the cache if it was
+ * already made.
+ */
+VALUE
+rbz_query_prefix (VALUE prefix)
 {
     ZOOM_query query;
-        
-    Data_Get_Struct (obj, struct ZOOM_query_p, query);
-    assert (query != NULL);
+    VALUE key;
+    VALUE obj;
 
-    return query;
+    StringValue (prefix);
+    key = rbz_query_make_key ("pqf", prefix);
+    obj = rbz_query_cache_lookup (key);
+    if (!NIL_P (obj))
+        return obj;
+
+    query = ZOOM_query_create ();
+    if (ZOOM_query_prefix (query, RVAL2CSTR (prefix)) != 0) {
+        ZOOM_query_destroy (query);
+        rb_raise (rb_eArgError, "invalid PQF query %s", RVAL2CSTR (prefix));
+    }
+
+    return rbz_query_cache_store (rbz_query_make (query, key));
+}
+
+/*
+ * Appends term to notation, quoted with backslash escapes as both PQF and
+ * CQL expect.
+ */
+void
+rbz_query_quote (VALUE notation, VALUE term)
+{
+    const char *p;
+    long i;
+
+    p = RSTRING_PTR (term);
+    rb_str_cat (notation, "\"", 1);
+    for (i = 0; i < RSTRING_LEN (term); i++) {
+        if (p [i] == '"' || p [i] == '\\')
+            rb_str_cat (notation, "\\", 1);
+        rb_str_cat (notation, p + i, 1);
+    }
+    rb_str_cat (notation, "\"", 1);
+}
+
+/*
+ * Returns the query for the given CQL notation, from the cache if it was
+ * already made.  If connection is not nil and has the cqlfile option set,
+ * the query is translated to RPN with this file.
+ */
+static VALUE
+rbz_query_cql (VALUE cql, VALUE connection)
+{
+    ZOOM_query query;
+    const char *cqlfile;
+    VALUE key;
+    VALUE obj;
+
+    StringValue (cql);
+    cqlfile = NIL_P (connection)
+        ? NULL
+        : ZOOM_connection_option_get (rbz_connection_get (connection), 
+                                      "cqlfile");
+    if (cqlfile != NULL) {
+        key = rb_str_new2 (cqlfile);
+        rb_str_cat2 (key, "\037");
+        rb_str_append (key, cql);
+        key = rbz_query_make_key ("cql2rpn", key);
+    }
+    else
+        key = rbz_query_make_key ("cql", cql);
+
+    obj = rbz_query_cache_lookup (key);
+    if (!NIL_P (obj))
+        return obj;
+
+    query = ZOOM_query_create ();
+    if (cqlfile == NULL)
+        ZOOM_query_cql (query, RVAL2CSTR (cql)); 
+    else if (ZOOM_query_cql2rpn (query, RVAL2CSTR (cql), 
+                                 rbz_connection_get (connection)) != 0) {
+        ZOOM_query_destroy (query);
+        rbz_connection_check (connection);
+        rb_raise (rb_eRuntimeError, "cannot translate CQL query %s", 
+                  RVAL2CSTR (cql));
+    }
+
+    return rbz_query_cache_store (rbz_query_make (query, key));
 }
 
 /*
@@ -54,59 +277,401 @@ rbz_query_get (VALUE obj)
  *
  * prefix: PQF notation.
  *
- * Creates a RPN query using the given PQF notation.
+ * Creates a RPN query using the given PQF notation.  This method raises an
+ * ArgumentError if the notation cannot be parsed.
  *
- * Returns: a newly created ZOOM::Query object.
+ * Returns: a ZOOM::Query object, which may be the one returned by a 
+ * previous call for the same notation.
  */
 static VALUE
 rbz_query_new_prefix (VALUE self, VALUE prefix)
 {
-    ZOOM_query query;
-
-    query = ZOOM_query_create ();
-    ZOOM_query_prefix (query, RVAL2CSTR (prefix)); 
-    
-    return rbz_query_make (query);
+    return rbz_query_prefix (prefix);
 }
 
 /* call-seq:
- * 	 new_cql(prefix)
+ * 	 new_cql(prefix, connection=nil)
  *
  * prefix: CQL notation.
  *
- * Creates a CQL query using the given CQL notation.
+ * connection: a ZOOM::Connection with the cqlfile option set, to translate
+ * the query to RPN on the client side (optional).
  *
- * Returns: a newly created ZOOM::Query object.
+ * Creates a CQL query using the given CQL notation.  If connection is given
+ * and has a CQL transform file, the query is translated to RPN with it, 
+ * only once for a given notation and file as long as the query is in the 
+ * cache (see ZOOM::Query.clear_cache).
+ *
+ * Returns: a ZOOM::Query object, which may be the one returned by a 
+ * previous call for the same notation.
+ */
+static VALUE
+rbz_query_new_cql (int argc, VALUE *argv, VALUE self)
+{
+    VALUE cql;
+    VALUE connection;
+
+    rb_scan_args (argc, argv, "11", &cql, &connection);
+
+    return rbz_query_cql (cql, connection);
+}
+
+/*
+ * Makes a copy of query, which is cached, with the given sort criteria:
+ * queries of the cache are shared and must not change.  The copy is made
+ * again from the notation the query was made from.
  */
 static VALUE
-rbz_query_new_cql (VALUE self, VALUE cql)
+rbz_query_sorted (VALUE obj, VALUE criteria)
 {
+    ZOOM_options options;
+    ZOOM_connection connection;
     ZOOM_query query;
+    VALUE base;
+    VALUE key;
+    VALUE sorted;
+    const char *p;
+    const char *notation;
+    const char *sep;
+    int error;
+
+    StringValue (criteria);
+    base = rbz_query_key (obj);
+    if (NIL_P (base))
+        rb_raise (rb_eArgError, "this query cannot be sorted");
 
+    /* Without the criteria of a query sorted already */
+    p = RSTRING_PTR (base);
+    sep = strstr (p, "\037sortby:");
+    if (sep != NULL)
+        base = rb_str_new (p, sep - p);
+    key = rb_str_dup (base);
+    rb_str_cat2 (key, "\037sortby:");
+    rb_str_append (key, criteria);
+    rb_obj_freeze (key);
+
+    sorted = rbz_query_cache_lookup (key);
+    if (!NIL_P (sorted))
+        return sorted;
+
+    p = StringValueCStr (base);
+    notation = strchr (p, ':') + 1;
     query = ZOOM_query_create ();
-    ZOOM_query_cql (query, RVAL2CSTR (cql)); 
-    
-    return rbz_query_make (query);
+    if (strncmp (p, "pqf:", 4) == 0)
+        error = ZOOM_query_prefix (query, notation);
+    else if (strncmp (p, "cql:", 4) == 0)
+        error = ZOOM_query_cql (query, notation);
+    else {
+        /* "cql2rpn:", the CQL transform file then the notation */
+        sep = strchr (notation, '\037');
+        options = ZOOM_options_create ();
+        ZOOM_options_set_len (options, "cqlfile", notation, sep - notation);
+        connection = ZOOM_connection_create (options);
+        error = ZOOM_query_cql2rpn (query, sep + 1, connection);
+        ZOOM_connection_destroy (connection);
+        ZOOM_options_destroy (options);
+    }
+    if (error == 0)
+        error = ZOOM_query_sortby (query, RVAL2CSTR (criteria));
+    if (error != 0) {
+        ZOOM_query_destroy (query);
+        rb_raise (rb_eArgError, "invalid sort criteria %s", 
+                  RVAL2CSTR (criteria));
+    }
+    RB_GC_GUARD (base);
+
+    return rbz_query_cache_store (rbz_query_make (query, key));
 }
 
 /*
- * call-seq: new_sort_by(criteria)
+ * call-seq: new_sort_by(criteria, query=nil)
  *
- * criteria: a sort criteria.
+ * criteria: a sort criteria, in the YAZ sorting notation (for example
+ * '1=4 <' to sort by title in ascending order).
  *
- * Creates a sort query from the YAZ sorting notation.
+ * query: the query to sort, as a ZOOM::Query object or a PQF string.
+ *
+ * Creates a query that makes the target sort its results with the given 
+ * criteria, as with ZOOM::Query#sort_by.  Without a query, the new query
+ * only has the criteria, and cannot be searched.
  *
  * Returns: a newly created ZOOM::Query object.
  */
 static VALUE
-rbz_query_new_sort_by (VALUE self, VALUE criteria)
+rbz_query_new_sort_by (int argc, VALUE *argv, VALUE self)
 {
     ZOOM_query query;
+    VALUE criteria;
+    VALUE rb_query;
+
+    rb_scan_args (argc, argv, "11", &criteria, &rb_query);
+    if (!NIL_P (rb_query))
+        return rbz_query_sorted (TYPE (rb_query) == T_STRING 
+                                 ? rbz_query_prefix (rb_query)
+                                 : rb_query,
+                                 criteria);
 
     query = ZOOM_query_create ();
-    ZOOM_query_sortby (rbz_query_get (self), RVAL2CSTR (criteria)); 
+    if (ZOOM_query_sortby (query, StringValueCStr (criteria)) != 0) {
+        ZOOM_query_destroy (query);
+        rb_raise (rb_eArgError, "invalid sort criteria %s", 
+                  RVAL2CSTR (criteria));
+    }
     
-    return rbz_query_make (query);
+    return rbz_query_make (query, Qnil);
+}
+
+/*
+ * call-seq: sort_by(criteria)
+ *
+ * criteria: a sort criteria, in the YAZ sorting notation (for example
+ * '1=4 <' to sort by title in ascending order, or '1=31 >' by date in 
+ * descending order).
+ *
+ * Makes the target sort the results of a search of this query, so that
+ * only the first records of the sorted result set need to be retrieved.
+ * The query itself is left as is.
+ *
+ * 	rset = conn.search(ZOOM::Query.new_prefix('@attr 1=4 ruby').sort_by('1=31 >'))
+ * 	newest = rset[0, 10]
+ *
+ * Returns: a ZOOM::Query object with the given criteria, which may be the
+ * one returned by a previous call for the same query and criteria.
+ */
+static VALUE
+rbz_query_sort_by (VALUE self, VALUE criteria)
+{
+    return rbz_query_sorted (self, criteria);
+}
+
+/*
+ * Returns: the maximum number of queries kept in the cache, 256 by default.
+ */
+static VALUE
+rbz_query_get_cache_size (VALUE self)
+{
+    return LONG2NUM (rbz_query_cache_size);
+}
+
+/*
+ * call-seq:
+ * 	cache_size = size
+ *
+ * size: the maximum number of queries kept in the cache, 0 to disable it.
+ *
+ * Returns: size.
+ */
+static VALUE
+rbz_query_set_cache_size (VALUE self, VALUE size)
+{
+    long n;
+
+    n = NUM2LONG (size);
+    if (n < 0)
+        rb_raise (rb_eArgError, "negative cache size");
+    rbz_query_cache_size = n;
+    while (RHASH_SIZE (rbz_query_cache) > (size_t) n)
+        rb_funcall (rbz_query_cache, rb_intern ("shift"), 0);
+
+    return size;
+}
+
+/*
+ * Empties the cache of queries, for instance after changing a CQL 
+ * transform file.
+ *
+ * Returns: nil.
+ */
+static VALUE
+rbz_query_clear_cache (VALUE self)
+{
+    rb_hash_clear (rbz_query_cache);
+    return Qnil;
+}
+
+/*
+ * Returns: a Hash with the following keys: :hits and :misses, the number of
+ * queries found and not found in the cache, and :entries, the number of
+ * queries in the cache.
+ */
+static VALUE
+rbz_query_cache_stats (VALUE self)
+{
+    VALUE stats;
+
+    stats = rb_hash_new ();
+    rb_hash_aset (stats, ID2SYM (rb_intern ("hits")),
+                  SIZET2NUM (rbz_query_cache_hits));
+    rb_hash_aset (stats, ID2SYM (rb_intern ("misses")),
+                  SIZET2NUM (rbz_query_cache_misses));
+    rb_hash_aset (stats, ID2SYM (rb_intern ("entries")),
+                  SIZET2NUM (RHASH_SIZE (rbz_query_cache)));
+
+    return stats;
+}
+
+struct rbz_template {
+    VALUE parts;        /* text around the placeholders */
+    VALUE connection;   /* to translate CQL, or nil */
+    int cql;
+};
+
+static void
+rbz_template_mark (struct rbz_template *t)
+{
+    rb_gc_mark (t->parts);
+    rb_gc_mark (t->connection);
+}
+
+static size_t
+rbz_template_memsize (const void *data)
+{
+    return sizeof (struct rbz_template);
+}
+
+static const rb_data_type_t rbz_template_data_type = {
+    .wrap_struct_name = "ZOOM::Query::Template",
+    .function = {
+        .dmark = (RUBY_DATA_FUNC) rbz_template_mark,
+        .dfree = RUBY_TYPED_DEFAULT_FREE,
+        .dsize = rbz_template_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct rbz_template *
+rbz_template_data (VALUE obj)
+{
+    struct rbz_template *t;
+
+    TypedData_Get_Struct (obj, struct rbz_template, &rbz_template_data_type,
+                          t);
+    assert (t != NULL);
+
+    return t;
+}
+
+/*
+ * call-seq:
+ * 	template(text, options={})
+ *
+ * text: the notation of the query, with %s where values go, and %% for a 
+ * percent sign.
+ *
+ * options: a Hash, with the following keys (optional): :syntax, either
+ * :pqf (the default) or :cql, and :connection, a ZOOM::Connection to 
+ * translate CQL to RPN with, as in ZOOM::Query.new_cql.
+ *
+ * Makes a query template, which is parsed once, and then gives queries
+ * for values: each value is quoted and replaces a placeholder.  As queries
+ * are cached, repeated values do not parse the query again.
+ *
+ * 	title = ZOOM::Query.template('@attr 1=4 %s')
+ * 	conn.search(title.query('ruby'))
+ *
+ * Returns: a newly created ZOOM::Query::Template object.
+ */
+static VALUE
+rbz_query_template (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_template *t;
+    const char *p;
+    const char *end;
+    const char *start;
+    VALUE text;
+    VALUE options;
+    VALUE syntax;
+    VALUE part;
+    VALUE obj;
+
+    rb_scan_args (argc, argv, "11", &text, &options);
+    StringValue (text);
+
+    obj = TypedData_Make_Struct (cZoomQueryTemplate,
+                                 struct rbz_template,
+                                 &rbz_template_data_type,
+                                 t);
+    t->parts = rb_ary_new ();
+    t->connection = Qnil;
+    if (!NIL_P (options)) {
+        Check_Type (options, T_HASH);
+        syntax = rb_hash_aref (options, ID2SYM (rb_intern ("syntax")));
+        if (syntax == ID2SYM (rb_intern ("cql")))
+            t->cql = 1;
+        else if (!NIL_P (syntax) && syntax != ID2SYM (rb_intern ("pqf")))
+            rb_raise (rb_eArgError, "unknown query syntax");
+        t->connection = rb_hash_aref (options, 
+                                      ID2SYM (rb_intern ("connection")));
+    }
+
+    part = rb_str_new (NULL, 0);
+    p = start = RSTRING_PTR (text);
+    end = p + RSTRING_LEN (text);
+    while ((p = memchr (p, '%', end - p)) != NULL) {
+        rb_str_cat (part, start, p - start);
+        if (p + 1 < end && p [1] == '%')
+            rb_str_cat (part, "%", 1);
+        else if (p + 1 < end && p [1] == 's') {
+            rb_ary_push (t->parts, rb_obj_freeze (part));
+            part = rb_str_new (NULL, 0);
+        }
+        else
+            rb_raise (rb_eArgError, "invalid placeholder in query template");
+        p = start = p + 2;
+    }
+    rb_str_cat (part, start, end - start);
+    rb_ary_push (t->parts, rb_obj_freeze (part));
+
+    return obj;
+}
+
+/*
+ * call-seq:
+ * 	notation(*values)
+ *
+ * Returns: the notation of the query for the given values, which must be
+ * as many as the placeholders.
+ */
+static VALUE
+rbz_template_notation (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_template *t;
+    VALUE notation;
+    long i;
+
+    t = rbz_template_data (self);
+    if (argc != RARRAY_LEN (t->parts) - 1)
+        rb_raise (rb_eArgError, "wrong number of values (%d for %ld)",
+                  argc, RARRAY_LEN (t->parts) - 1);
+
+    notation = rb_str_dup (RARRAY_PTR (t->parts) [0]);
+    for (i = 0; i < argc; i++) {
+        rbz_query_quote (notation, rb_obj_as_string (argv [i]));
+        rb_str_append (notation, RARRAY_PTR (t->parts) [i + 1]);
+    }
+
+    return notation;
+}
+
+/*
+ * call-seq:
+ * 	query(*values)
+ *
+ * Returns: the ZOOM::Query for the given values, which must be as many as
+ * the placeholders.
+ */
+static VALUE
+rbz_template_query (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_template *t;
+    VALUE notation;
+
+    t = rbz_template_data (self);
+    notation = rbz_template_notation (argc, argv, self);
+
+    return t->cql
+        ? rbz_query_cql (notation, t->connection)
+        : rbz_query_prefix (notation);
 }
 
 void
@@ -115,9 +680,27 @@ Init_zoom_query (VALUE mZoom)
     VALUE c;
 
     c = rb_define_class_under (mZoom, "Query", rb_cObject); 
+    rb_undef_alloc_func (c);
     rb_define_singleton_method (c, "new_prefix", rbz_query_new_prefix, 1);
-    rb_define_singleton_method (c, "new_cql", rbz_query_new_cql, 1);
-    rb_define_singleton_method (c, "new_sort_by", rbz_query_new_sort_by, 1);
+    rb_define_singleton_method (c, "new_cql", rbz_query_new_cql, -1);
+    rb_define_singleton_method (c, "new_sort_by", rbz_query_new_sort_by, -1);
+    rb_define_singleton_method (c, "template", rbz_query_template, -1);
+    rb_define_singleton_method (c, "cache_size", rbz_query_get_cache_size, 0);
+    rb_define_singleton_method (c, "cache_size=", rbz_query_set_cache_size, 1);
+    rb_define_singleton_method (c, "clear_cache", rbz_query_clear_cache, 0);
+    rb_define_singleton_method (c, "cache_stats", rbz_query_cache_stats, 0);
+    rb_define_method (c, "sort_by", rbz_query_sort_by, 1);
             
     cZoomQuery = c;
+
+    c = rb_define_class_under (cZoomQuery, "Template", rb_cObject);
+    rb_undef_alloc_func (c);
+    rb_define_method (c, "notation", rbz_template_notation, -1);
+    rb_define_method (c, "query", rbz_template_query, -1);
+    rb_define_alias (c, "[]", "query");
+
+    cZoomQueryTemplate = c;
+
+    rbz_query_cache = rb_hash_new ();
+    rb_gc_register_address (&rbz_query_cache);
 }
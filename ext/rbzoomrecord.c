@@ -16,7 +16,9 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <ruby/encoding.h>
 #include "rbzoom.h"
+#include <yaz/marcdisp.h>
 
 #ifdef MAKING_RDOC_HAPPY
 mZoom = rb_define_module("ZOOM");
@@ -29,51 +31,491 @@ mZoom = rb_define_module("ZOOM");
  */
 static VALUE cZoomRecord;
 
+/*
+ * A record either owns its ZOOM_record, or borrows it from the cache of the
+ * result set it was retrieved from, in which case it keeps the result set 
+ * alive and is linked into the list of records borrowed from it.
+ *
+ * Records read back from a ZOOM::RecordStore have no ZOOM_record, only
+ * their raw data, syntax and database.
+ */
+struct rbz_record {
+    ZOOM_record record;
+    VALUE resultset;
+    VALUE shared;       /* Hash: form => frozen String, see #get */
+    struct rbz_record *next;
+    struct rbz_record **link;
+
+    VALUE raw;
+    VALUE syntax;
+    VALUE database;
+    VALUE rendered;     /* last form rendered from raw */
+
+    size_t bytes;       /* size of the record data, when it is owned */
+};
+
+static void
+rbz_record_mark (struct rbz_record *rec)
+{
+    rb_gc_mark (rec->resultset);
+    rb_gc_mark (rec->shared);
+    rb_gc_mark (rec->raw);
+    rb_gc_mark (rec->syntax);
+    rb_gc_mark (rec->database);
+    rb_gc_mark (rec->rendered);
+}
+
+static void
+rbz_record_unlink (struct rbz_record *rec)
+{
+    if (rec->link == NULL)
+        return;
+
+    *rec->link = rec->next;
+    if (rec->next != NULL)
+        rec->next->link = rec->link;
+    rec->next = NULL;
+    rec->link = NULL;
+}
+
+static void
+rbz_record_free (struct rbz_record *rec)
+{
+    if (!NIL_P (rec->resultset))
+        rbz_record_unlink (rec);
+    else if (rec->record != NULL) {
+        ZOOM_record_destroy (rec->record);
+        RBZ_ADJUST_MEMORY (-(ssize_t) rec->bytes);
+    }
+    xfree (rec);
+}
+
+static size_t
+rbz_record_memsize (const void *data)
+{
+    const struct rbz_record *rec;
+
+    rec = (const struct rbz_record *) data;
+    return sizeof (struct rbz_record) + rec->bytes;
+}
+
+static const rb_data_type_t rbz_record_data_type = {
+    .wrap_struct_name = "ZOOM::Record",
+    .function = {
+        .dmark = (RUBY_DATA_FUNC) rbz_record_mark,
+        .dfree = (RUBY_DATA_FUNC) rbz_record_free,
+        .dsize = rbz_record_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* Accounts for the record data, now owned by rec, to the GC. */
+static void
+rbz_record_own (struct rbz_record *rec)
+{
+    int len;
+
+    rec->bytes = 0;
+    if (ZOOM_record_get (rec->record, "raw", &len) != NULL && len > 0)
+        rec->bytes = len;
+    RBZ_ADJUST_MEMORY ((ssize_t) rec->bytes);
+}
+
+static VALUE
+rbz_record_wrap (ZOOM_record record, struct rbz_record **rec)
+{
+    VALUE obj;
+
+    obj = TypedData_Make_Struct (cZoomRecord,
+                                 struct rbz_record,
+                                 &rbz_record_data_type,
+                                 *rec);
+    (*rec)->record = record;
+    (*rec)->resultset = Qnil;
+    (*rec)->shared = Qnil;
+    (*rec)->raw = Qnil;
+    (*rec)->syntax = Qnil;
+    (*rec)->database = Qnil;
+    (*rec)->rendered = Qnil;
+
+    return obj;
+}
+
 VALUE
 rbz_record_make (ZOOM_record record)
 {
-    return record != NULL
-        ? Data_Wrap_Struct (cZoomRecord,
-                            NULL,
-                            ZOOM_record_destroy,
-                            record)
-        : Qnil;
+    struct rbz_record *rec;
+    VALUE obj;
+
+    if (record == NULL)
+        return Qnil;
+
+    obj = rbz_record_wrap (record, &rec);
+    rbz_record_own (rec);
+
+    return obj;
 }
 
-static ZOOM_record
-rbz_record_get (VALUE obj)
+/*
+ * Makes a record from data read back from a ZOOM::RecordStore.
+ */
+VALUE
+rbz_record_make_stored (VALUE raw, VALUE syntax, VALUE database)
 {
-    ZOOM_record record;
-        
-    Data_Get_Struct (obj, struct ZOOM_record_p, record);
-    assert (record != NULL);
+    struct rbz_record *rec;
+    VALUE obj;
+
+    obj = rbz_record_wrap (NULL, &rec);
+    rec->raw = raw;
+    rec->syntax = syntax;
+    rec->database = database;
 
-    return record;
+    return obj;
 }
 
-static char _type [128];
+/*
+ * Wraps a record owned by the given result set, without copying it.  The
+ * record is added to the borrowed list of the result set.
+ */
+VALUE
+rbz_record_borrow (ZOOM_record record, VALUE resultset, 
+                   struct rbz_record **borrowed)
+{
+    struct rbz_record *rec;
+    VALUE obj;
+
+    if (record == NULL)
+        return Qnil;
 
+    obj = rbz_record_wrap (record, &rec);
+    rec->resultset = resultset;
+    rec->next = *borrowed;
+    rec->link = borrowed;
+    if (rec->next != NULL)
+        rec->next->link = &rec->next;
+    *borrowed = rec;
+
+    return obj;
+}
+
+static void
+rbz_record_detach_data (struct rbz_record *rec)
+{
+    if (NIL_P (rec->resultset))
+        return;
+
+    rec->record = ZOOM_record_clone (rec->record);
+    rec->resultset = Qnil;
+    rbz_record_unlink (rec);
+    rbz_record_own (rec);
+}
+
+/*
+ * Called when the result set is about to go away, with all the records 
+ * still borrowed from it.  If detach is set, the records get their own 
+ * copy and remain usable.  Otherwise they are unreachable themselves, being
+ * swept in the same garbage collection, and are simply forgotten.
+ */
+void
+rbz_record_release_all (struct rbz_record **borrowed, int detach)
+{
+    struct rbz_record *rec;
+
+    while ((rec = *borrowed) != NULL) {
+        if (detach) {
+            rbz_record_detach_data (rec);
+        }
+        else {
+            rbz_record_unlink (rec);
+            rec->record = NULL;
+            rec->resultset = Qnil;
+        }
+    }
+}
+
+static struct rbz_record *
+rbz_record_data (VALUE obj)
+{
+    struct rbz_record *rec;
+
+    TypedData_Get_Struct (obj, struct rbz_record, &rbz_record_data_type, rec);
+    assert (rec != NULL);
+
+    return rec;
+}
+
+/* 
+ * Renders a stored ISO2709 record with YAZ, in the given YAZ_MARC_* mode
+ * and with the charset conversion of a "; charset=from[,to]" parameter.
+ */
 static const char *
-rbz_record_type (const char *form, int argc, VALUE *argv)
+rbz_record_render_stored (struct rbz_record *rec, int mode, const char *type,
+                          int *len)
+{
+    struct rbz_converter *conv;
+    const char *charset;
+    const char *result;
+    size_t rsize;
+    char from [64];
+    char to [64];
+    int n;
+
+    n = 0;
+    charset = strstr (type, "charset=");
+    if (charset != NULL) {
+        to [0] = '\0';
+        n = sscanf (charset + strlen ("charset="), "%63[^,; ],%63[^,; ]", 
+                    from, to);
+    }
+
+    conv = rbz_converter_acquire (n >= 1 ? from : NULL, n == 2 ? to : NULL);
+    rec->rendered = Qnil;
+    if (rbz_converter_run (conv, mode, RSTRING_PTR (rec->raw), 
+                           RSTRING_LEN (rec->raw), &result, &rsize))
+        rec->rendered = rb_str_new (result, rsize);
+    rbz_converter_release (conv);
+
+    if (NIL_P (rec->rendered))
+        return NULL;
+    *len = RSTRING_LEN (rec->rendered);
+    return RSTRING_PTR (rec->rendered);
+}
+
+/* Serves a form of a record read back from a ZOOM::RecordStore. */
+static const char *
+rbz_record_get_stored (struct rbz_record *rec, const char *type, int *len)
+{
+    VALUE str;
+    size_t n;
+    int marc;
+
+    n = strcspn (type, "; ");
+    str = Qnil;
+    if (n == 3 && strncmp (type, "raw", n) == 0)
+        str = rec->raw;
+    else if (n == 6 && strncmp (type, "syntax", n) == 0)
+        str = rec->syntax;
+    else if (n == 8 && strncmp (type, "database", n) == 0)
+        str = rec->database;
+    if (!NIL_P (str)) {
+        *len = RSTRING_LEN (str);
+        return RSTRING_PTR (str);
+    }
+
+    marc = rbz_iso2709_p (RSTRING_PTR (rec->raw), RSTRING_LEN (rec->raw));
+    if (n == 3 && strncmp (type, "xml", n) == 0) {
+        if (marc)
+            return rbz_record_render_stored (rec, YAZ_MARC_MARCXML, type, len);
+        *len = RSTRING_LEN (rec->raw);
+        return RSTRING_PTR (rec->raw);
+    }
+    if (marc && n == 6 && strncmp (type, "render", n) == 0)
+        return rbz_record_render_stored (rec, YAZ_MARC_LINE, type, len);
+    if (marc && n == 4 && strncmp (type, "txml", n) == 0)
+        return rbz_record_render_stored (rec, YAZ_MARC_TURBOMARC, type, len);
+    if (marc && n == 4 && strncmp (type, "json", n) == 0)
+        return rbz_record_render_stored (rec, YAZ_MARC_JSON, type, len);
+
+    return NULL;
+}
+
+/*
+ * Returns the record in the given form, like ZOOM_record_get.
+ */
+static const char *
+rbz_record_bytes (VALUE obj, const char *type, int *len)
+{
+    struct rbz_record *rec;
+
+    rec = rbz_record_data (obj);
+    if (rec->record != NULL)
+        return ZOOM_record_get (rec->record, type, len);
+
+    assert (!NIL_P (rec->raw));
+    return rbz_record_get_stored (rec, type, len);
+}
+
+/*
+ * Returns the raw data of the record, which remains valid as long as the
+ * record is reachable and not detached.
+ */
+const char *
+rbz_record_raw_data (VALUE obj, int *len)
+{
+    *len = 0;
+    return rbz_record_bytes (obj, "raw", len);
+}
+
+/*
+ * Makes the record independent of the result set it was retrieved from, by
+ * copying it, if it was borrowed (see ZOOM::ResultSet#borrow_records=).
+ *
+ * Returns: self.
+ */
+static VALUE
+rbz_record_detach (VALUE self)
+{
+    rbz_record_detach_data (rbz_record_data (self));
+    return self;
+}
+
+/*
+ * Returns: whether the record is borrowed from the cache of its result set.
+ */
+static VALUE
+rbz_record_borrowed_p (VALUE self)
+{
+    return CBOOL2RVAL (!NIL_P (rbz_record_data (self)->resultset));
+}
+
+/* Class: ZOOM::RecordFormat
+ * A form to get records in, with an optional charset conversion, built
+ * once and passed to ZOOM::Record#get:
+ *
+ * 	MARCXML = ZOOM::RecordFormat.new('xml', 'marc8', 'utf-8')
+ * 	rset.each_record { |record| index(record.get(MARCXML)) }
+ *
+ * Record formats are frozen, and can be shared by threads.
+ */
+static VALUE cZoomRecordFormat;
+
+#define RBZ_TYPE_MAX 128
+
+/*
+ * Writes the type of ZOOM_record_get for form, with the charsets given in
+ * argv, if any, to buf, which holds RBZ_TYPE_MAX bytes.
+ *
+ * Returns: the type.
+ */
+static const char *
+rbz_record_type (const char *form, int argc, VALUE *argv, char *buf)
 {
     VALUE charset_from;
     VALUE charset_to;
+    int n;
 
-    if (argc == 0)
+    rb_scan_args (argc, argv, "02", &charset_from, &charset_to);
+    if (NIL_P (charset_from))
         return form;
-
-    rb_scan_args (argc, argv, "11", &charset_from, &charset_to);
    
-    memset (_type, 0, sizeof _type);
-    
     if (NIL_P (charset_to))
-        snprintf (_type, sizeof _type, "%s; charset=%s", form, 
-                  RVAL2CSTR (charset_from));
+        n = snprintf (buf, RBZ_TYPE_MAX, "%s; charset=%s", form, 
+                      RVAL2CSTR (charset_from));
     else
-        snprintf (_type, sizeof _type, "%s; charset=%s,%s", form, 
-                  RVAL2CSTR (charset_from), RVAL2CSTR (charset_to));
+        n = snprintf (buf, RBZ_TYPE_MAX, "%s; charset=%s,%s", form, 
+                      RVAL2CSTR (charset_from), RVAL2CSTR (charset_to));
+    if (n >= RBZ_TYPE_MAX)
+        rb_raise (rb_eArgError, "charset names too long");
+
+    return buf;
+}
+
+/*
+ * call-seq:
+ * 	new(form, charset_from=nil, charset_to=nil)
+ *
+ * form: the form to get records in, as accepted by ZOOM::Record#get (for 
+ * example "xml" or "raw").
+ *
+ * charset_from: the name of the charset to convert from (optional).
+ *
+ * charset_to: the name of the charset to convert to (optional).
+ *
+ * Returns: a newly created, frozen ZOOM::RecordFormat object.
+ */
+static VALUE
+rbz_record_format_initialize (int argc, VALUE *argv, VALUE self)
+{
+    char buf [RBZ_TYPE_MAX];
+    const char *type;
+    VALUE form;
+    VALUE charsets [2];
+
+    rb_scan_args (argc, argv, "12", &form, &charsets [0], &charsets [1]);
+    type = rbz_record_type (StringValueCStr (form), 2, charsets, buf);
+    rb_ivar_set (self, rb_intern ("@type"), rb_obj_freeze (rb_str_new2 (type)));
+
+    return rb_obj_freeze (self);
+}
+
+/*
+ * Returns: the type given to ZOOM_record_get, such as 
+ * "xml; charset=marc8,utf-8", as a frozen string.
+ */
+static VALUE
+rbz_record_format_to_s (VALUE self)
+{
+    return rb_ivar_get (self, rb_intern ("@type"));
+}
+
+/*
+ * Returns the record in the given form as a binary string, using the 
+ * length reported by YAZ, so that ISO2709 records containing NUL bytes 
+ * are not truncated.
+ */
+VALUE
+rbz_record_string (VALUE self, const char *type)
+{
+    const char *buf;
+    int len;
+
+    len = 0;
+    buf = rbz_record_bytes (self, type, &len);
+
+    return buf != NULL && len >= 0
+        ? rb_str_new (buf, len)
+        : Qnil;
+}
 
-    return _type;
+/*
+ * call-seq: 
+ * 	get(type, shared=false)
+ *
+ * type: the form to return the record in, as accepted by ZOOM_record_get 
+ * (for example "raw", "xml" or "render; charset=marc8,utf-8"), or a
+ * ZOOM::RecordFormat.
+ *
+ * shared: whether to return a frozen string, shared by all callers.
+ *
+ * Gets the record in the given form as a binary (ASCII-8BIT) string, with
+ * the exact length of the data returned by YAZ.
+ *
+ * By default, a new string is returned on every call.  In shared mode, the
+ * string is built only once per record and form, frozen and kept by the 
+ * record, and the same string is returned to all callers from then on.
+ * The string owns its bytes, so a borrowed record (see
+ * ZOOM::ResultSet#borrow_records=) stays borrowed.
+ *
+ * Returns: the record in the given form, or nil if not available.
+ */
+static VALUE
+rbz_record_get_form (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_record *rec;
+    VALUE type;
+    VALUE shared;
+    VALUE str;
+
+    rb_scan_args (argc, argv, "11", &type, &shared);
+    if (rb_obj_is_kind_of (type, cZoomRecordFormat))
+        type = rbz_record_format_to_s (type);
+    StringValue (type);
+    if (!RVAL2CBOOL (shared))
+        return rbz_record_string (self, RVAL2CSTR (type));
+
+    rec = rbz_record_data (self);
+    if (NIL_P (rec->shared))
+        rec->shared = rb_hash_new ();
+
+    str = rb_hash_aref (rec->shared, type);
+    if (NIL_P (str)) {
+        str = rbz_record_string (self, RVAL2CSTR (type));
+        if (NIL_P (str))
+            return Qnil;
+        rb_hash_aset (rec->shared, type, rb_obj_freeze (str));
+    }
+
+    return str;
 }
 
 /*
@@ -89,9 +531,10 @@ rbz_record_type (const char *form, int argc, VALUE *argv)
 static VALUE
 rbz_record_database (int argc, VALUE *argv, VALUE self)
 {
-    return CSTR2RVAL (ZOOM_record_get (rbz_record_get (self),
-                                       rbz_record_type ("database", argc, argv),
-                                       NULL));    
+    char type [RBZ_TYPE_MAX];
+
+    return rbz_record_string (self, 
+                              rbz_record_type ("database", argc, argv, type));
 }
 
 /*
@@ -107,9 +550,10 @@ rbz_record_database (int argc, VALUE *argv, VALUE self)
 static VALUE
 rbz_record_syntax (int argc, VALUE *argv, VALUE self)
 {
-    return CSTR2RVAL (ZOOM_record_get (rbz_record_get (self),
-                                       rbz_record_type ("syntax", argc, argv),
-                                       NULL));    
+    char type [RBZ_TYPE_MAX];
+
+    return rbz_record_string (self, 
+                              rbz_record_type ("syntax", argc, argv, type));
 }
 
 /*
@@ -125,9 +569,10 @@ rbz_record_syntax (int argc, VALUE *argv, VALUE self)
 static VALUE
 rbz_record_render (int argc, VALUE *argv, VALUE self)
 {
-    return CSTR2RVAL (ZOOM_record_get (rbz_record_get (self),
-                                       rbz_record_type ("render", argc, argv),
-                                       NULL));    
+    char type [RBZ_TYPE_MAX];
+
+    return rbz_record_string (self, 
+                              rbz_record_type ("render", argc, argv, type));
 }
 
 /*
@@ -148,16 +593,22 @@ rbz_record_render (int argc, VALUE *argv, VALUE self)
 static VALUE
 rbz_record_xml (int argc, VALUE *argv, VALUE self)
 {
-    return CSTR2RVAL (ZOOM_record_get (rbz_record_get (self),
-                                       rbz_record_type ("xml", argc, argv),
-                                       NULL));    
+    char type [RBZ_TYPE_MAX];
+
+    return rbz_record_string (self, 
+                              rbz_record_type ("xml", argc, argv, type));
 }
 
 /*
  * call-seq: 
- * 	raw
+ * 	raw(charset_from=nil, charset_to=nil)
+ *
+ * charset_from: the name of the charset to convert from (optional).
+ *
+ * charset_to: the name of the charset to convert to (optional).
  *
- * MARC records are returned in ISO2709.
+ * MARC records are returned in ISO2709, as a binary string that may contain
+ * NUL bytes.
  * GRS-1 and OPAC records are not supported for this form. 
  * 
  * Returns: an ISO2709 record.
@@ -166,9 +617,385 @@ rbz_record_xml (int argc, VALUE *argv, VALUE self)
 static VALUE
 rbz_record_raw (int argc, VALUE *argv, VALUE self)
 {
-    return CSTR2RVAL (ZOOM_record_get (rbz_record_get (self),
-                                       rbz_record_type ("raw", argc, argv),
-                                       NULL));    
+    char type [RBZ_TYPE_MAX];
+
+    return rbz_record_string (self, 
+                              rbz_record_type ("raw", argc, argv, type));
+}
+
+/*
+ * ISO2709 parsing.  The record is walked in place: the leader and the 
+ * directory are decoded as needed, and strings are only built for the 
+ * fields that are asked for.
+ */
+
+#define ISO2709_RS  0x1d    /* record terminator */
+#define ISO2709_FS  0x1e    /* field terminator */
+#define ISO2709_IDFS 0x1f   /* subfield delimiter */
+
+struct rbz_marc {
+    const char *buf;
+    long len;
+    long base;              /* base address of data */
+    int indicator_count;
+    int identifier_length;  /* subfield delimiter plus code */
+    int length_length;      /* length of field length in directory */
+    int start_length;       /* length of starting position in directory */
+    int utf8;
+};
+
+static long
+rbz_marc_number (const char *buf, int n)
+{
+    long value;
+    int i;
+
+    value = 0;
+    for (i = 0; i < n; i++) {
+        if (buf [i] < '0' || buf [i] > '9')
+            return -1;
+        value = value * 10 + (buf [i] - '0');
+    }
+
+    return value;
+}
+
+static void
+rbz_marc_parse_bytes (const char *buf, long len, struct rbz_marc *marc)
+{
+    if (buf == NULL || len < 24)
+        rb_raise (rb_eRuntimeError, "not an ISO2709 record");
+
+    marc->buf = buf;
+    marc->len = len;
+    marc->base = rbz_marc_number (buf + 12, 5);
+    marc->indicator_count = buf [10] >= '0' && buf [10] <= '9' 
+        ? buf [10] - '0' : 2;
+    marc->identifier_length = buf [11] >= '1' && buf [11] <= '9' 
+        ? buf [11] - '0' : 2;
+    marc->length_length = buf [20] >= '1' && buf [20] <= '9' 
+        ? buf [20] - '0' : 4;
+    marc->start_length = buf [21] >= '1' && buf [21] <= '9' 
+        ? buf [21] - '0' : 5;
+    marc->utf8 = buf [9] == 'a';
+
+    if (marc->base < 24 || marc->base > marc->len)
+        rb_raise (rb_eRuntimeError, "not an ISO2709 record");
+}
+
+static void
+rbz_marc_parse (VALUE self, struct rbz_marc *marc)
+{
+    const char *buf;
+    int len;
+
+    len = 0;
+    buf = rbz_record_bytes (self, "raw", &len);
+    rbz_marc_parse_bytes (buf, len, marc);
+}
+
+/* 
+ * Decodes the directory entry at offset pos (0 being the first entry) into
+ * tag, data and length, the field terminator excluded.  Returns 0 once the
+ * end of the directory is reached.
+ */
+static int
+rbz_marc_entry (struct rbz_marc *marc, long pos, 
+                const char **tag, const char **data, long *length)
+{
+    const char *entry;
+    long entry_length;
+    long start;
+
+    entry_length = 3 + marc->length_length + marc->start_length;
+    entry = marc->buf + 24 + pos * entry_length;
+    if (entry + entry_length > marc->buf + marc->base 
+        || *entry == ISO2709_FS)
+        return 0;
+
+    *length = rbz_marc_number (entry + 3, marc->length_length);
+    start = rbz_marc_number (entry + 3 + marc->length_length, 
+                             marc->start_length);
+    if (*length < 0 || start < 0 
+        || marc->base + start + *length > marc->len)
+        rb_raise (rb_eRuntimeError, "invalid ISO2709 directory entry");
+
+    *tag = entry;
+    *data = marc->buf + marc->base + start;
+    if (*length > 0 && (*data) [*length - 1] == ISO2709_FS)
+        (*length)--;
+
+    return 1;
+}
+
+static VALUE
+rbz_marc_string (struct rbz_marc *marc, const char *buf, long len)
+{
+    return marc->utf8 ? rb_utf8_str_new (buf, len) : rb_str_new (buf, len);
+}
+
+static int
+rbz_marc_control_tag (const char *tag)
+{
+    return tag [0] == '0' && tag [1] == '0';
+}
+
+static int
+rbz_marc_tag_wanted (const char *tag, int argc, VALUE *argv)
+{
+    int i;
+
+    if (argc == 0)
+        return 1;
+    for (i = 0; i < argc; i++)
+        if (RSTRING_LEN (argv [i]) == 3 
+            && memcmp (RSTRING_PTR (argv [i]), tag, 3) == 0)
+            return 1;
+
+    return 0;
+}
+
+/* 
+ * Calls func for each subfield of a data field, with the subfield code and 
+ * value.  Stops and returns 1 as soon as func returns non-zero.
+ */
+static int
+rbz_marc_each_subfield (struct rbz_marc *marc, const char *data, long length,
+                        int (*func) (struct rbz_marc *, char, const char *, 
+                                     long, void *),
+                        void *arg)
+{
+    const char *p;
+    const char *end;
+    const char *value;
+    char code;
+
+    p = data + MIN (marc->indicator_count, length);
+    end = data + length;
+    while (p < end) {
+        if (*p != ISO2709_IDFS) {
+            p++;
+            continue;
+        }
+        if (p + marc->identifier_length > end)
+            break;
+        code = marc->identifier_length > 1 ? p [1] : ' ';
+        value = p + marc->identifier_length;
+        for (p = value; p < end && *p != ISO2709_IDFS; p++)
+            ;
+        if (func (marc, code, value, p - value, arg))
+            return 1;
+    }
+
+    return 0;
+}
+
+static int
+rbz_marc_push_subfield (struct rbz_marc *marc, char code, 
+                        const char *value, long length, void *arg)
+{
+    rb_ary_push ((VALUE) arg, 
+                 rb_ary_new3 (2, rb_str_new (&code, 1), 
+                              rbz_marc_string (marc, value, length)));
+    return 0;
+}
+
+/*
+ * Builds [tag, value] for a control field, or [tag, indicators, subfields] 
+ * for a data field, subfields being an array of [code, value] pairs.
+ */
+static VALUE
+rbz_marc_field (struct rbz_marc *marc, const char *tag, 
+                const char *data, long length)
+{
+    VALUE subfields;
+
+    if (rbz_marc_control_tag (tag))
+        return rb_ary_new3 (2, rb_str_new (tag, 3),
+                            rbz_marc_string (marc, data, length));
+
+    subfields = rb_ary_new ();
+    rbz_marc_each_subfield (marc, data, length, 
+                            rbz_marc_push_subfield, (void *) subfields);
+
+    return rb_ary_new3 (3, rb_str_new (tag, 3),
+                        rb_str_new (data, MIN (marc->indicator_count, length)),
+                        subfields);
+}
+
+static void
+rbz_marc_check_tags (int argc, VALUE *argv)
+{
+    int i;
+
+    for (i = 0; i < argc; i++)
+        StringValue (argv [i]);
+}
+
+/*
+ * Returns: the 24 characters of the leader of an ISO2709 record.
+ */
+static VALUE
+rbz_record_leader (VALUE self)
+{
+    struct rbz_marc marc;
+
+    rbz_marc_parse (self, &marc);
+    return rb_str_new (marc.buf, 24);
+}
+
+/*
+ * call-seq: 
+ * 	marc_fields(*tags)
+ *
+ * tags: the tags of the fields to return, as 3-character strings (optional).
+ *
+ * Parses the ISO2709 (MARC) record in place and returns its fields, or only
+ * the ones with the given tags, in record order.  Each control field is 
+ * returned as [tag, value], and each data field as [tag, indicators, 
+ * subfields], where subfields is an array of [code, value] pairs.  Values 
+ * are UTF-8 strings when the leader says so, binary strings otherwise.
+ *
+ * 	record.marc_fields('245')
+ * 	# => [["245", "10", [["a", "The complete dinosaur /"], ...]]]
+ *
+ * This method raises an exception if the record is not an ISO2709 record.
+ *
+ * Returns: an array of fields.
+ */
+static VALUE
+rbz_record_marc_fields (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_marc marc;
+    const char *tag;
+    const char *data;
+    long length;
+    long pos;
+    VALUE fields;
+
+    rbz_marc_check_tags (argc, argv);
+    rbz_marc_parse (self, &marc);
+
+    fields = rb_ary_new ();
+    for (pos = 0; rbz_marc_entry (&marc, pos, &tag, &data, &length); pos++)
+        if (rbz_marc_tag_wanted (tag, argc, argv))
+            rb_ary_push (fields, rbz_marc_field (&marc, tag, data, length));
+
+    return fields;
+}
+
+struct rbz_marc_subfield_match {
+    char code;
+    VALUE values;
+};
+
+static int
+rbz_marc_match_subfield (struct rbz_marc *marc, char code, 
+                         const char *value, long length, void *arg)
+{
+    struct rbz_marc_subfield_match *match;
+
+    match = (struct rbz_marc_subfield_match *) arg;
+    if (code == match->code)
+        rb_ary_push (match->values, rbz_marc_string (marc, value, length));
+
+    return 0;
+}
+
+/*
+ * call-seq: 
+ * 	subfields(tag, code)
+ *
+ * tag: the tag of the data fields to look at, as a 3-character string.
+ *
+ * code: the subfield code, as a 1-character string.
+ *
+ * Parses the ISO2709 (MARC) record in place and collects the values of the
+ * given subfield in all the fields with the given tag, only building 
+ * strings for these values.
+ *
+ * 	record.subfields('245', 'a')  # => ["The complete dinosaur /"]
+ *
+ * This method raises an exception if the record is not an ISO2709 record.
+ *
+ * Returns: an array of strings.
+ */
+static VALUE
+rbz_record_subfields (VALUE self, VALUE rb_tag, VALUE rb_code)
+{
+    struct rbz_marc marc;
+    struct rbz_marc_subfield_match match;
+    const char *tag;
+    const char *data;
+    long length;
+    long pos;
+
+    rbz_marc_check_tags (1, &rb_tag);
+    StringValue (rb_code);
+    if (RSTRING_LEN (rb_code) != 1)
+        rb_raise (rb_eArgError, "subfield code must be a single character");
+
+    rbz_marc_parse (self, &marc);
+    match.code = RSTRING_PTR (rb_code) [0];
+    match.values = rb_ary_new ();
+    for (pos = 0; rbz_marc_entry (&marc, pos, &tag, &data, &length); pos++)
+        if (!rbz_marc_control_tag (tag) 
+            && rbz_marc_tag_wanted (tag, 1, &rb_tag))
+            rbz_marc_each_subfield (&marc, data, length,
+                                    rbz_marc_match_subfield, &match);
+
+    return match.values;
+}
+
+/*
+ * call-seq: 
+ * 	each_field(*tags) { |field| ... }
+ *
+ * tags: the tags of the fields to iterate over, as 3-character strings 
+ * (optional).
+ *
+ * Parses the ISO2709 (MARC) record in place and calls the given block for 
+ * each field, or only for the ones with the given tags, passing the field in
+ * the form returned by ZOOM::Record#marc_fields.  Fields are decoded one at
+ * a time, right before being passed to the block.
+ *
+ * A borrowed record is parsed from a copy of its data, so the block may
+ * destroy or sort its result set.
+ *
+ * Returns: self, or an Enumerator if no block is given.
+ */
+static VALUE
+rbz_record_each_field (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_marc marc;
+    const char *tag;
+    const char *data;
+    long length;
+    long pos;
+    VALUE copy;
+
+    RETURN_ENUMERATOR (self, argc, argv);
+    rbz_marc_check_tags (argc, argv);
+
+    /*
+     * The block may destroy or sort the result set a borrowed record comes
+     * from, which releases its data: parse a copy of it.
+     */
+    copy = Qnil;
+    if (RTEST (rbz_record_borrowed_p (self))) {
+        copy = rbz_record_string (self, "raw");
+        rbz_marc_parse_bytes (NIL_P (copy) ? NULL : RSTRING_PTR (copy),
+                              NIL_P (copy) ? 0 : RSTRING_LEN (copy), &marc);
+    }
+    else
+        rbz_marc_parse (self, &marc);
+
+    for (pos = 0; rbz_marc_entry (&marc, pos, &tag, &data, &length); pos++)
+        if (rbz_marc_tag_wanted (tag, argc, argv))
+            rb_yield (rbz_marc_field (&marc, tag, data, length));
+    RB_GC_GUARD (copy);
+
+    return self;
 }
 
 void
@@ -177,6 +1004,7 @@ Init_zoom_record (VALUE mZoom)
     VALUE c;
     
     c = rb_define_class_under (mZoom, "Record", rb_cObject); 
+    rb_undef_alloc_func (c);
     rb_undef_method (CLASS_OF (c), "new");
 
     rb_define_method (c, "database", rbz_record_database, -1);
@@ -185,6 +1013,19 @@ Init_zoom_record (VALUE mZoom)
     rb_define_alias (c, "to_s", "render");
     rb_define_method (c, "xml", rbz_record_xml, -1);
     rb_define_method (c, "raw", rbz_record_raw, -1);
+    rb_define_method (c, "get", rbz_record_get_form, -1);
+    rb_define_method (c, "leader", rbz_record_leader, 0);
+    rb_define_method (c, "marc_fields", rbz_record_marc_fields, -1);
+    rb_define_method (c, "subfields", rbz_record_subfields, 2);
+    rb_define_method (c, "each_field", rbz_record_each_field, -1);
+    rb_define_method (c, "detach", rbz_record_detach, 0);
+    rb_define_method (c, "borrowed?", rbz_record_borrowed_p, 0);
     
     cZoomRecord = c;
+
+    c = rb_define_class_under (mZoom, "RecordFormat", rb_cObject);
+    rb_define_method (c, "initialize", rbz_record_format_initialize, -1);
+    rb_define_method (c, "to_s", rbz_record_format_to_s, 0);
+
+    cZoomRecordFormat = c;
 }
@@ -0,0 +1,628 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "rbzoom.h"
+#include <ruby/util.h>
+
+#ifdef MAKING_RDOC_HAPPY
+mZoom = rb_define_module("ZOOM");
+#endif
+
+/* Document-class: ZOOM::RecordStore
+ *
+ * A persistent cache of raw records, kept in a single append-only file
+ * that is read through a memory mapping.  Give it to a result set with
+ * ZOOM::ResultSet#record_store= and the records retrieved are saved in the
+ * store, then read back from it instead of the target by the next result
+ * sets for the same search, in this process or in the next ones.
+ *
+ * 	ZOOM::RecordStore.open('loc.zrs') do |store|
+ * 	  rset = conn.search('@attr 1=4 ruby')
+ * 	  rset.record_store = store
+ * 	  rset.each_record { |record| index(record.raw) }
+ * 	end
+ *
+ * Each entry carries a CRC-32 of its contents.  When the store is opened,
+ * whatever follows the last valid entry, such as an entry half written
+ * when the process crashed, is cut off.  Entries are written with a single
+ * write(2), and ZOOM::RecordStore#sync flushes them to the disk.
+ *
+ * A store can be used by many threads, but only by one process at a time.
+ */
+static VALUE cZoomRecordStore;
+
+#define RBZ_STORE_MAGIC         "ZOOMRS1\n"
+#define RBZ_STORE_MAGIC_LEN     8
+#define RBZ_STORE_ENTRY_MAGIC   0x5a524543  /* "ZREC" */
+#define RBZ_STORE_ALIGN(n)      (((n) + 7) & ~(size_t) 7)
+
+/*
+ * Every entry is made of this header, then the key with its terminating
+ * NUL, the metadata (syntax and database, NUL separated) and the data,
+ * padded to a multiple of 8 bytes.
+ */
+struct rbz_store_header {
+    uint32_t magic;
+    uint32_t key_len;
+    uint32_t meta_len;
+    uint32_t data_len;
+    uint32_t crc;           /* of key, metadata and data */
+    uint32_t reserved;
+};
+
+struct rbz_store {
+    int fd;
+    VALUE path;
+    int sync;               /* fdatasync after every entry */
+    st_table *index;        /* key => offset of the entry */
+    size_t size;            /* end of the last valid entry */
+    char *map;
+    size_t mapped;
+};
+
+static uint32_t rbz_crc_table [256];
+
+static void
+rbz_crc_init (void)
+{
+    uint32_t c;
+    int i;
+    int k;
+
+    for (i = 0; i < 256; i++) {
+        c = (uint32_t) i;
+        for (k = 0; k < 8; k++)
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        rbz_crc_table [i] = c;
+    }
+}
+
+static uint32_t
+rbz_crc_update (uint32_t crc, const char *buf, size_t len)
+{
+    const unsigned char *p;
+
+    crc = ~crc;
+    for (p = (const unsigned char *) buf; len > 0; p++, len--)
+        crc = rbz_crc_table [(crc ^ *p) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+static int
+rbz_store_free_key (st_data_t key, st_data_t value, st_data_t arg)
+{
+    xfree ((char *) key);
+    return ST_DELETE;
+}
+
+static void
+rbz_store_unmap (struct rbz_store *store)
+{
+    if (store->map != NULL)
+        munmap (store->map, store->mapped);
+    store->map = NULL;
+    store->mapped = 0;
+}
+
+static void
+rbz_store_close_data (struct rbz_store *store)
+{
+    if (store->fd < 0)
+        return;
+
+    rbz_store_unmap (store);
+    st_foreach (store->index, rbz_store_free_key, 0);
+    close (store->fd);
+    store->fd = -1;
+}
+
+static void
+rbz_store_mark (struct rbz_store *store)
+{
+    rb_gc_mark (store->path);
+}
+
+static void
+rbz_store_free (struct rbz_store *store)
+{
+    rbz_store_close_data (store);
+    st_free_table (store->index);
+    xfree (store);
+}
+
+/* The mapping is backed by the file, only the index is on the heap. */
+static size_t
+rbz_store_memsize (const void *data)
+{
+    const struct rbz_store *store;
+
+    store = (const struct rbz_store *) data;
+    return sizeof (struct rbz_store) + st_memsize (store->index);
+}
+
+static const rb_data_type_t rbz_store_data_type = {
+    .wrap_struct_name = "ZOOM::RecordStore",
+    .function = {
+        .dmark = (RUBY_DATA_FUNC) rbz_store_mark,
+        .dfree = (RUBY_DATA_FUNC) rbz_store_free,
+        .dsize = rbz_store_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+rbz_store_alloc (VALUE klass)
+{
+    struct rbz_store *store;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct (klass,
+                                 struct rbz_store,
+                                 &rbz_store_data_type,
+                                 store);
+    store->fd = -1;
+    store->path = Qnil;
+    store->index = st_init_strtable ();
+
+    return obj;
+}
+
+static struct rbz_store *
+rbz_store_get (VALUE obj)
+{
+    struct rbz_store *store;
+
+    TypedData_Get_Struct (obj, struct rbz_store, &rbz_store_data_type, store);
+    assert (store != NULL);
+    if (store->fd < 0)
+        rb_raise (rb_eIOError, "closed record store");
+
+    return store;
+}
+
+/* Maps the file up to store->size, if it is not already. */
+static void
+rbz_store_map (struct rbz_store *store)
+{
+    void *map;
+
+    if (store->mapped >= store->size)
+        return;
+
+    rbz_store_unmap (store);
+    map = mmap (NULL, store->size, PROT_READ, MAP_SHARED, store->fd, 0);
+    if (map == MAP_FAILED)
+        rb_sys_fail_str (store->path);
+    store->map = map;
+    store->mapped = store->size;
+}
+
+/*
+ * Checks the entry at offset, returning the offset of the next one, or 0
+ * if the entry is truncated or corrupted.
+ */
+static size_t
+rbz_store_check_entry (struct rbz_store *store, size_t offset, size_t end)
+{
+    struct rbz_store_header header;
+    const char *body;
+    size_t len;
+
+    if (end - offset < sizeof header)
+        return 0;
+    memcpy (&header, store->map + offset, sizeof header);
+    if (header.magic != RBZ_STORE_ENTRY_MAGIC || header.key_len == 0)
+        return 0;
+
+    len = (size_t) header.key_len + header.meta_len + header.data_len;
+    if (len > end - offset - sizeof header)
+        return 0;
+    body = store->map + offset + sizeof header;
+    if (body [header.key_len - 1] != '\0'
+        || rbz_crc_update (0, body, len) != header.crc)
+        return 0;
+
+    return RBZ_STORE_ALIGN (offset + sizeof header + len);
+}
+
+/*
+ * Builds the index, and cuts off what follows the last valid entry, or
+ * restores its padding if that is what is missing.
+ */
+static void
+rbz_store_load (struct rbz_store *store, size_t end)
+{
+    size_t offset;
+    size_t next;
+
+    store->size = end;
+    rbz_store_map (store);
+    if (memcmp (store->map, RBZ_STORE_MAGIC, RBZ_STORE_MAGIC_LEN) != 0)
+        rb_raise (rb_eRuntimeError, "%s is not a record store",
+                  RVAL2CSTR (store->path));
+
+    for (offset = RBZ_STORE_MAGIC_LEN; offset < end; offset = next) {
+        const char *key;
+
+        next = rbz_store_check_entry (store, offset, end);
+        if (next == 0)
+            break;
+
+        /* Later entries replace earlier ones, under the same copy of the key */
+        key = store->map + offset + sizeof (struct rbz_store_header);
+        if (!st_lookup (store->index, (st_data_t) key, NULL))
+            key = ruby_strdup (key);
+        st_insert (store->index, (st_data_t) key, (st_data_t) offset);
+    }
+
+    if (offset != end) {
+        if (ftruncate (store->fd, offset) < 0)
+            rb_sys_fail_str (store->path);
+        rbz_store_unmap (store);
+        store->size = offset;
+    }
+}
+
+/*
+ * call-seq:
+ * 	new(path, options={})
+ *
+ * path: the file of the store, created if it does not exist.
+ *
+ * options: a Hash, with the following key (optional): :sync, whether to
+ * flush every entry to the disk as soon as it is written, false by default.
+ *
+ * Opens a record store.  This method raises an exception if the file is not
+ * a record store, or if it is already open in another process.
+ *
+ * Returns: a newly created ZOOM::RecordStore object.
+ */
+static VALUE
+rbz_store_initialize (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_store *store;
+    struct stat st;
+    VALUE path;
+    VALUE options;
+
+    rb_scan_args (argc, argv, "11", &path, &options);
+    FilePathValue (path);
+
+    TypedData_Get_Struct (self, struct rbz_store, &rbz_store_data_type, store);
+    if (store->fd >= 0)
+        rb_raise (rb_eRuntimeError, "record store already open");
+    store->path = rb_str_new_frozen (path);
+    store->sync = !NIL_P (options)
+        && RVAL2CBOOL (rb_hash_aref (options, ID2SYM (rb_intern ("sync"))));
+
+    store->fd = open (StringValueCStr (path), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (store->fd < 0)
+        rb_sys_fail_str (path);
+    if (flock (store->fd, LOCK_EX | LOCK_NB) < 0) {
+        int e = errno;
+
+        close (store->fd);
+        store->fd = -1;
+        if (e == EWOULDBLOCK)
+            rb_raise (rb_eRuntimeError, "%s is used by another process",
+                      RVAL2CSTR (path));
+        rb_syserr_fail_str (e, path);
+    }
+    if (fstat (store->fd, &st) < 0)
+        rb_sys_fail_str (path);
+
+    if (st.st_size == 0) {
+        if (write (store->fd, RBZ_STORE_MAGIC, RBZ_STORE_MAGIC_LEN)
+            != RBZ_STORE_MAGIC_LEN)
+            rb_sys_fail_str (path);
+        store->size = RBZ_STORE_MAGIC_LEN;
+    }
+    else if ((size_t) st.st_size < RBZ_STORE_MAGIC_LEN)
+        rb_raise (rb_eRuntimeError, "%s is not a record store",
+                  RVAL2CSTR (path));
+    else
+        rbz_store_load (store, st.st_size);
+
+    return self;
+}
+
+/*
+ * Looks key up, and returns a pointer to the header of its entry, mapped
+ * in memory, or NULL.
+ */
+static const struct rbz_store_header *
+rbz_store_find (struct rbz_store *store, const char *key)
+{
+    st_data_t offset;
+
+    if (!st_lookup (store->index, (st_data_t) key, &offset))
+        return NULL;
+
+    rbz_store_map (store);
+    return (const struct rbz_store_header *) (store->map + offset);
+}
+
+/*
+ * Looks key up.  If it is there, returns 1 and sets data to a copy of the
+ * data, and meta, if not NULL, to a copy of the metadata.
+ */
+int
+rbz_store_read (VALUE obj, const char *key, VALUE *data, VALUE *meta)
+{
+    struct rbz_store *store;
+    const struct rbz_store_header *header;
+    const char *body;
+
+    store = rbz_store_get (obj);
+    header = rbz_store_find (store, key);
+    if (header == NULL)
+        return 0;
+
+    body = (const char *) (header + 1) + header->key_len;
+    if (meta != NULL)
+        *meta = rb_str_new (body, header->meta_len);
+    *data = rb_str_new (body + header->meta_len, header->data_len);
+
+    return 1;
+}
+
+/*
+ * Appends an entry for key, which replaces the previous one, if any.
+ */
+void
+rbz_store_write (VALUE obj, const char *key, const char *meta,
+                 size_t meta_len, const char *data, size_t data_len)
+{
+    struct rbz_store *store;
+    struct rbz_store_header header;
+    struct iovec iov [5];
+    static const char padding [8];
+    size_t len;
+    size_t offset;
+    ssize_t n;
+
+    store = rbz_store_get (obj);
+    if (data_len > UINT32_MAX || meta_len > UINT32_MAX)
+        rb_raise (rb_eArgError, "record too large");
+
+    memset (&header, 0, sizeof header);
+    header.magic = RBZ_STORE_ENTRY_MAGIC;
+    header.key_len = strlen (key) + 1;
+    header.meta_len = meta_len;
+    header.data_len = data_len;
+    header.crc = rbz_crc_update (0, key, header.key_len);
+    header.crc = rbz_crc_update (header.crc, meta, meta_len);
+    header.crc = rbz_crc_update (header.crc, data, data_len);
+
+    len = sizeof header + header.key_len + meta_len + data_len;
+    iov [0].iov_base = &header;
+    iov [0].iov_len = sizeof header;
+    iov [1].iov_base = (void *) key;
+    iov [1].iov_len = header.key_len;
+    iov [2].iov_base = (void *) meta;
+    iov [2].iov_len = meta_len;
+    iov [3].iov_base = (void *) data;
+    iov [3].iov_len = data_len;
+    iov [4].iov_base = (void *) padding;
+    iov [4].iov_len = RBZ_STORE_ALIGN (len) - len;
+
+    offset = store->size;
+    do
+        n = pwritev (store->fd, iov, 5, offset);
+    while (n < 0 && errno == EINTR);
+    if (n != (ssize_t) RBZ_STORE_ALIGN (len)) {
+        int e = n < 0 ? errno : ENOSPC;
+
+        /* Leave nothing half written behind */
+        if (ftruncate (store->fd, offset) < 0)
+            rb_sys_fail_str (store->path);
+        rb_syserr_fail_str (e, store->path);
+    }
+    if (store->sync && fdatasync (store->fd) < 0)
+        rb_sys_fail_str (store->path);
+
+    store->size = offset + n;
+    if (!st_lookup (store->index, (st_data_t) key, NULL))
+        key = ruby_strdup (key);
+    st_insert (store->index, (st_data_t) key, (st_data_t) offset);
+}
+
+static const char *
+rbz_store_key (VALUE key)
+{
+    StringValue (key);
+    if (RSTRING_LEN (key) == 0
+        || memchr (RSTRING_PTR (key), '\0', RSTRING_LEN (key)) != NULL)
+        rb_raise (rb_eArgError, "invalid record store key");
+
+    return StringValueCStr (key);
+}
+
+/*
+ * call-seq:
+ * 	[](key)
+ *
+ * key: a string.
+ *
+ * Returns: the data stored under key, as a frozen binary string, or nil.
+ */
+static VALUE
+rbz_store_aref (VALUE self, VALUE key)
+{
+    VALUE data;
+
+    if (!rbz_store_read (self, rbz_store_key (key), &data, NULL))
+        return Qnil;
+
+    return rb_obj_freeze (data);
+}
+
+/*
+ * call-seq:
+ * 	[]=(key, data)
+ *
+ * key: a string.
+ *
+ * data: a string.
+ *
+ * Stores data under key, replacing what was stored there before.
+ *
+ * Returns: data.
+ */
+static VALUE
+rbz_store_aset (VALUE self, VALUE key, VALUE data)
+{
+    const char *k;
+
+    k = rbz_store_key (key);
+    StringValue (data);
+    rbz_store_write (self, k, NULL, 0, RSTRING_PTR (data), RSTRING_LEN (data));
+    RB_GC_GUARD (key);
+
+    return data;
+}
+
+/*
+ * call-seq:
+ * 	include?(key)
+ *
+ * Returns: whether something is stored under key.
+ */
+static VALUE
+rbz_store_include_p (VALUE self, VALUE key)
+{
+    return CBOOL2RVAL (st_lookup (rbz_store_get (self)->index,
+                                  (st_data_t) rbz_store_key (key), NULL));
+}
+
+/*
+ * Returns: the number of keys in the store.
+ */
+static VALUE
+rbz_store_size (VALUE self)
+{
+    return SIZET2NUM (rbz_store_get (self)->index->num_entries);
+}
+
+/*
+ * Flushes the entries written so far to the disk.
+ *
+ * Returns: self.
+ */
+static VALUE
+rbz_store_sync (VALUE self)
+{
+    struct rbz_store *store;
+
+    store = rbz_store_get (self);
+    if (fdatasync (store->fd) < 0)
+        rb_sys_fail_str (store->path);
+
+    return self;
+}
+
+/*
+ * Closes the store.  Strings and records read from it remain valid.
+ *
+ * Returns: nil.
+ */
+static VALUE
+rbz_store_close (VALUE self)
+{
+    struct rbz_store *store;
+
+    TypedData_Get_Struct (self, struct rbz_store, &rbz_store_data_type, store);
+    rbz_store_close_data (store);
+
+    return Qnil;
+}
+
+/*
+ * Returns: whether the store is closed.
+ */
+static VALUE
+rbz_store_closed_p (VALUE self)
+{
+    struct rbz_store *store;
+
+    TypedData_Get_Struct (self, struct rbz_store, &rbz_store_data_type, store);
+    return CBOOL2RVAL (store->fd < 0);
+}
+
+/*
+ * Returns: the path of the file of the store.
+ */
+static VALUE
+rbz_store_path (VALUE self)
+{
+    struct rbz_store *store;
+
+    TypedData_Get_Struct (self, struct rbz_store, &rbz_store_data_type, store);
+    return store->path;
+}
+
+/*
+ * call-seq:
+ * 	open(path, options={}) { |store| ... }
+ *
+ * Same as ZOOM::RecordStore.new.  If a block is given, the store is passed
+ * to it, and closed at the end of the block.
+ *
+ * Returns: the store, or the value of the block.
+ */
+static VALUE
+rbz_store_open (int argc, VALUE *argv, VALUE self)
+{
+    VALUE store;
+
+    store = rb_class_new_instance (argc, argv, self);
+    if (!rb_block_given_p ())
+        return store;
+
+    return rb_ensure (rb_yield, store, rbz_store_close, store);
+}
+
+void
+Init_zoom_record_store (VALUE mZoom)
+{
+    VALUE c;
+
+    rbz_crc_init ();
+
+    c = rb_define_class_under (mZoom, "RecordStore", rb_cObject);
+    rb_define_alloc_func (c, rbz_store_alloc);
+    rb_define_singleton_method (c, "open", rbz_store_open, -1);
+    rb_define_method (c, "initialize", rbz_store_initialize, -1);
+    rb_define_method (c, "[]", rbz_store_aref, 1);
+    rb_define_method (c, "[]=", rbz_store_aset, 2);
+    rb_define_method (c, "include?", rbz_store_include_p, 1);
+    rb_define_method (c, "size", rbz_store_size, 0);
+    rb_define_method (c, "sync", rbz_store_sync, 0);
+    rb_define_method (c, "close", rbz_store_close, 0);
+    rb_define_method (c, "closed?", rbz_store_closed_p, 0);
+    rb_define_method (c, "path", rbz_store_path, 0);
+
+    cZoomRecordStore = c;
+}
@@ -0,0 +1,509 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <ctype.h>
+#include "rbzoom.h"
+#include <ruby/util.h>
+
+#ifdef MAKING_RDOC_HAPPY
+mZoom = rb_define_module("ZOOM");
+#endif
+
+/* Document-class: ZOOM::ResultCache
+ *
+ * An in-process cache of search results, shared by the connections it is
+ * given to with ZOOM::Connection#result_cache= or the :result_cache option
+ * of ZOOM::ConnectionPool.new.
+ *
+ * Searches are keyed by target, database, query, record syntax and element
+ * set name.  The cache keeps the number of hits and the records of the first
+ * page that was fetched.  A repeated search answers from the cache without
+ * talking to the target, until a record past the first page is asked for,
+ * or an option of the result set is set, at which point the search is sent
+ * for real.
+ *
+ * 	cache = ZOOM::ResultCache.new(:ttl => 300, :max_bytes => 32 << 20)
+ * 	conn.result_cache = cache
+ * 	conn.search('@attr 1=4 ruby')[0, 10]  # sent to the target
+ * 	conn.search('@attr 1=4  ruby')[0, 10] # from the cache
+ * 	cache.stats # => {:hits=>1, :misses=>1, ...}
+ *
+ * The cache only contains plain data, and may be used by many threads.
+ */
+static VALUE cZoomResultCache;
+
+/* Separates the components of a key. */
+#define RBZ_CACHE_SEPARATOR '\037'
+
+struct rbz_cache_entry {
+    char *key;
+    size_t size;                /* number of hits */
+    ZOOM_record *records;       /* first records of the result set */
+    size_t count;
+    size_t bytes;
+    size_t record_bytes;        /* part of bytes allocated by YAZ */
+    double expires;
+    struct rbz_cache_entry *newer;
+    struct rbz_cache_entry *older;
+};
+
+struct rbz_cache {
+    st_table *entries;          /* key => struct rbz_cache_entry */
+    struct rbz_cache_entry *newest;
+    struct rbz_cache_entry *oldest;
+    size_t bytes;
+
+    double ttl;
+    size_t max_bytes;
+    size_t page;
+
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t expirations;
+};
+
+static void
+rbz_cache_entry_free (struct rbz_cache_entry *entry)
+{
+    size_t i;
+
+    for (i = 0; i < entry->count; i++)
+        ZOOM_record_destroy (entry->records [i]);
+    xfree (entry->records);
+    xfree (entry->key);
+    xfree (entry);
+}
+
+static void
+rbz_cache_unlink (struct rbz_cache *cache, struct rbz_cache_entry *entry)
+{
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        cache->newest = entry->older;
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+static void
+rbz_cache_push (struct rbz_cache *cache, struct rbz_cache_entry *entry)
+{
+    entry->older = cache->newest;
+    entry->newer = NULL;
+    if (cache->newest != NULL)
+        cache->newest->newer = entry;
+    else
+        cache->oldest = entry;
+    cache->newest = entry;
+}
+
+static void
+rbz_cache_remove (struct rbz_cache *cache, struct rbz_cache_entry *entry)
+{
+    st_data_t key;
+
+    key = (st_data_t) entry->key;
+    st_delete (cache->entries, &key, NULL);
+    rbz_cache_unlink (cache, entry);
+    cache->bytes -= entry->bytes;
+    RBZ_ADJUST_MEMORY (-(ssize_t) entry->record_bytes);
+    rbz_cache_entry_free (entry);
+}
+
+/* Drops the least recently used entries until the cache fits. */
+static void
+rbz_cache_shrink (struct rbz_cache *cache)
+{
+    while (cache->bytes > cache->max_bytes && cache->oldest != NULL) {
+        rbz_cache_remove (cache, cache->oldest);
+        cache->evictions++;
+    }
+}
+
+static void
+rbz_cache_clear (struct rbz_cache *cache)
+{
+    while (cache->oldest != NULL)
+        rbz_cache_remove (cache, cache->oldest);
+}
+
+static void
+rbz_cache_free (struct rbz_cache *cache)
+{
+    rbz_cache_clear (cache);
+    st_free_table (cache->entries);
+    xfree (cache);
+}
+
+static size_t
+rbz_cache_memsize (const void *data)
+{
+    const struct rbz_cache *cache;
+
+    cache = (const struct rbz_cache *) data;
+    return sizeof (struct rbz_cache) + st_memsize (cache->entries)
+        + cache->bytes;
+}
+
+static const rb_data_type_t rbz_cache_data_type = {
+    .wrap_struct_name = "ZOOM::ResultCache",
+    .function = {
+        .dfree = (RUBY_DATA_FUNC) rbz_cache_free,
+        .dsize = rbz_cache_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static VALUE
+rbz_cache_alloc (VALUE klass)
+{
+    struct rbz_cache *cache;
+    VALUE obj;
+
+    obj = TypedData_Make_Struct (klass,
+                                 struct rbz_cache,
+                                 &rbz_cache_data_type,
+                                 cache);
+    cache->entries = st_init_strtable ();
+    cache->ttl = 300;
+    cache->max_bytes = 16 << 20;
+    cache->page = 10;
+
+    return obj;
+}
+
+static struct rbz_cache *
+rbz_cache_get (VALUE obj)
+{
+    struct rbz_cache *cache;
+
+    TypedData_Get_Struct (obj, struct rbz_cache, &rbz_cache_data_type, cache);
+    assert (cache != NULL);
+
+    return cache;
+}
+
+/*
+ * Looks key up, dropping the entry if it has expired.  With touch set, a
+ * hit or a miss is accounted for, and the entry becomes the most recently
+ * used one.
+ */
+static struct rbz_cache_entry *
+rbz_cache_find (struct rbz_cache *cache, VALUE key, int touch)
+{
+    struct rbz_cache_entry *entry;
+    st_data_t value;
+
+    entry = NULL;
+    if (st_lookup (cache->entries, (st_data_t) RSTRING_PTR (key), &value)) {
+        entry = (struct rbz_cache_entry *) value;
+        if (entry->expires <= rbz_instrument_clock ()) {
+            rbz_cache_remove (cache, entry);
+            cache->expirations++;
+            entry = NULL;
+        }
+    }
+
+    if (touch) {
+        if (entry != NULL) {
+            cache->hits++;
+            rbz_cache_unlink (cache, entry);
+            rbz_cache_push (cache, entry);
+        }
+        else
+            cache->misses++;
+    }
+
+    return entry;
+}
+
+/* Appends str with its runs of blanks outside of quotes squeezed. */
+static void
+rbz_cache_cat_normalized (VALUE key, const char *str)
+{
+    const char *p;
+    const char *start;
+    int quoted;
+
+    while (isspace ((unsigned char) *str))
+        str++;
+
+    quoted = 0;
+    for (p = start = str; *p != '\0'; p++) {
+        if (*p == '"' && (p == str || p [-1] != '\\'))
+            quoted = !quoted;
+        else if (!quoted && isspace ((unsigned char) *p)) {
+            rb_str_cat (key, start, p - start);
+            while (isspace ((unsigned char) p [1]))
+                p++;
+            if (p [1] != '\0')
+                rb_str_cat (key, " ", 1);
+            start = p + 1;
+        }
+    }
+    rb_str_cat (key, start, p - start);
+}
+
+static void
+rbz_cache_cat_option (VALUE key, ZOOM_connection connection,
+                      ZOOM_resultset resultset, const char *name)
+{
+    const char *value;
+    char separator;
+
+    value = resultset != NULL
+        ? ZOOM_resultset_option_get (resultset, name)
+        : ZOOM_connection_option_get (connection, name);
+    if (value != NULL)
+        rb_str_cat2 (key, value);
+    separator = RBZ_CACHE_SEPARATOR;
+    rb_str_cat (key, &separator, 1);
+}
+
+/*
+ * Returns the key of a search of criterion on connection, with the options
+ * of resultset when it is not NULL, or nil if the criterion cannot be
+ * cached.
+ */
+VALUE
+rbz_cache_resultset_key (ZOOM_connection connection, ZOOM_resultset resultset,
+                         VALUE criterion)
+{
+    VALUE key;
+    VALUE notation;
+
+    if (TYPE (criterion) == T_STRING)
+        notation = criterion;
+    else {
+        notation = rbz_query_key (criterion);
+        if (NIL_P (notation))
+            return Qnil;
+    }
+    if (memchr (RSTRING_PTR (notation), '\0', RSTRING_LEN (notation)) != NULL)
+        return Qnil;
+
+    key = rb_str_buf_new (128);
+    rbz_cache_cat_option (key, connection, resultset, "host");
+    rbz_cache_cat_option (key, connection, resultset, "databaseName");
+    rbz_cache_cat_option (key, connection, resultset, "preferredRecordSyntax");
+    rbz_cache_cat_option (key, connection, resultset, "elementSetName");
+    if (TYPE (criterion) == T_STRING)
+        rb_str_cat2 (key, "pqf:");
+    rbz_cache_cat_normalized (key, RSTRING_PTR (notation));
+    RB_GC_GUARD (notation);
+
+    return key;
+}
+
+/*
+ * Returns the key of a search of criterion on connection, or nil if the
+ * criterion cannot be cached.
+ */
+VALUE
+rbz_cache_key (ZOOM_connection connection, VALUE criterion)
+{
+    return rbz_cache_resultset_key (connection, NULL, criterion);
+}
+
+/*
+ * Looks up a search.  On a hit, returns 1, and sets size to the number of
+ * hits and page, unless NULL, to an array of copies of the cached records.
+ */
+int
+rbz_cache_lookup (VALUE obj, VALUE key, size_t *size, VALUE *page)
+{
+    struct rbz_cache *cache;
+    struct rbz_cache_entry *entry;
+    size_t i;
+
+    cache = rbz_cache_get (obj);
+    entry = rbz_cache_find (cache, key, 1);
+    if (entry == NULL)
+        return 0;
+
+    *size = entry->size;
+    if (page == NULL)
+        return 1;
+
+    *page = rb_ary_new2 (entry->count);
+    for (i = 0; i < entry->count; i++)
+        rb_ary_push (*page,
+                     rbz_record_make (ZOOM_record_clone (entry->records [i])));
+
+    return 1;
+}
+
+/* Records the number of hits of a search that was sent to the target. */
+void
+rbz_cache_store (VALUE obj, VALUE key, size_t size)
+{
+    struct rbz_cache *cache;
+    struct rbz_cache_entry *entry;
+
+    cache = rbz_cache_get (obj);
+    entry = rbz_cache_find (cache, key, 0);
+    if (entry != NULL)
+        rbz_cache_remove (cache, entry);
+
+    entry = ALLOC (struct rbz_cache_entry);
+    MEMZERO (entry, struct rbz_cache_entry, 1);
+    entry->key = ruby_strdup (RSTRING_PTR (key));
+    entry->size = size;
+    entry->bytes = sizeof (*entry) + RSTRING_LEN (key) + 1;
+    entry->expires = rbz_instrument_clock () + cache->ttl;
+
+    st_insert (cache->entries, (st_data_t) entry->key, (st_data_t) entry);
+    rbz_cache_push (cache, entry);
+    cache->bytes += entry->bytes;
+    rbz_cache_shrink (cache);
+}
+
+/*
+ * Adds the records retrieved from [begin, begin + count) to the first page
+ * of a cached search, as long as they follow what is already cached.
+ */
+void
+rbz_cache_store_records (VALUE obj, VALUE key, ZOOM_record *records,
+                         size_t begin, size_t count)
+{
+    struct rbz_cache *cache;
+    struct rbz_cache_entry *entry;
+    size_t end;
+    size_t i;
+    int len;
+
+    cache = rbz_cache_get (obj);
+    entry = rbz_cache_find (cache, key, 0);
+    if (entry == NULL || begin > entry->count)
+        return;
+
+    end = MIN (MIN (begin + count, cache->page), entry->size);
+    if (end <= entry->count)
+        return;
+    if (entry->records == NULL)
+        entry->records = ALLOC_N (ZOOM_record, MIN (cache->page, entry->size));
+
+    for (i = entry->count; i < end; i++) {
+        if (records [i - begin] == NULL)
+            break;
+        entry->records [i] = ZOOM_record_clone (records [i - begin]);
+        entry->count++;
+        if (ZOOM_record_get (entry->records [i], "raw", &len) != NULL) {
+            entry->bytes += len;
+            entry->record_bytes += len;
+            cache->bytes += len;
+            RBZ_ADJUST_MEMORY (len);
+        }
+    }
+    rbz_cache_shrink (cache);
+}
+
+/*
+ * call-seq:
+ * 	new(options={})
+ *
+ * options: a Hash, with the following keys (all optional): :ttl, the number
+ * of seconds a search stays in the cache, 300 by default; :max_bytes, the
+ * maximum size of the cached data, 16MB by default, beyond which the least
+ * recently used searches are dropped; :page, the number of records kept
+ * for each search, 10 by default.
+ *
+ * Creates a new, empty, result cache.
+ *
+ * Returns: a newly created ZOOM::ResultCache object.
+ */
+static VALUE
+rbz_cache_initialize (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_cache *cache;
+    VALUE options;
+    VALUE value;
+
+    rb_scan_args (argc, argv, "01", &options);
+    cache = rbz_cache_get (self);
+    if (NIL_P (options))
+        return self;
+
+    value = rb_hash_aref (options, ID2SYM (rb_intern ("ttl")));
+    if (!NIL_P (value))
+        cache->ttl = NUM2DBL (value);
+    value = rb_hash_aref (options, ID2SYM (rb_intern ("max_bytes")));
+    if (!NIL_P (value))
+        cache->max_bytes = NUM2SIZET (value);
+    value = rb_hash_aref (options, ID2SYM (rb_intern ("page")));
+    if (!NIL_P (value))
+        cache->page = NUM2SIZET (value);
+
+    return self;
+}
+
+/*
+ * Returns: a Hash with the number of :hits, :misses, :evictions (searches
+ * dropped to stay under max_bytes) and :expirations (searches dropped
+ * after their ttl), and the current number of :entries and :bytes.
+ */
+static VALUE
+rbz_cache_stats (VALUE self)
+{
+    struct rbz_cache *cache;
+    VALUE hash;
+
+    cache = rbz_cache_get (self);
+    hash = rb_hash_new ();
+    rb_hash_aset (hash, ID2SYM (rb_intern ("hits")), SIZET2NUM (cache->hits));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("misses")),
+                  SIZET2NUM (cache->misses));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("evictions")),
+                  SIZET2NUM (cache->evictions));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("expirations")),
+                  SIZET2NUM (cache->expirations));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("entries")),
+                  SIZET2NUM (cache->entries->num_entries));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("bytes")),
+                  SIZET2NUM (cache->bytes));
+
+    return hash;
+}
+
+/*
+ * Drops every cached search.
+ *
+ * Returns: self.
+ */
+static VALUE
+rbz_cache_clear_m (VALUE self)
+{
+    rbz_cache_clear (rbz_cache_get (self));
+    return self;
+}
+
+void
+Init_zoom_result_cache (VALUE mZoom)
+{
+    VALUE c;
+
+    c = rb_define_class_under (mZoom, "ResultCache", rb_cObject);
+    rb_define_alloc_func (c, rbz_cache_alloc);
+    rb_define_method (c, "initialize", rbz_cache_initialize, -1);
+    rb_define_method (c, "stats", rbz_cache_stats, 0);
+    rb_define_method (c, "clear", rbz_cache_clear_m, 0);
+
+    cZoomResultCache = c;
+}
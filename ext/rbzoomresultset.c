@@ -16,6 +16,9 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
 #include "rbzoom.h"
 
 #ifdef MAKING_RDOC_HAPPY
@@ -27,28 +30,555 @@ mZoom = rb_define_module("ZOOM");
  */
 static VALUE cZoomResultSet;
 
+struct rbz_resultset {
+    ZOOM_resultset resultset;
+    VALUE connection;
+
+    /* records handed out without being copied */
+    int borrow_records;
+    struct rbz_record *borrowed;
+
+    /* read-ahead */
+    size_t prefetch;            /* number of windows to read ahead */
+    size_t prefetch_begin;      /* records requested in the background */
+    size_t prefetch_end;
+    size_t prefetch_hits;
+    size_t prefetch_misses;
+
+    VALUE criterion;            /* what was searched */
+
+    /* result cache, the search is not sent yet when resultset is NULL */
+    VALUE cache;
+    VALUE cache_key;
+    size_t cached_size;
+    VALUE page;                 /* records from the cache */
+
+    /* record store */
+    VALUE store;
+    VALUE store_key;            /* prefix of the keys of the records */
+
+    VALUE sort;                 /* criteria of ZOOM::ResultSet#sort!, or nil */
+
+    /* records kept by YAZ, see rbz_resultset_account */
+    unsigned char *seen;        /* bitmap of the positions retrieved */
+    size_t seen_size;
+    size_t record_bytes;
+
+    int destroyed;              /* set by ZOOM::ResultSet#destroy */
+};
+
+static void
+rbz_resultset_mark (struct rbz_resultset *rset)
+{
+    rb_gc_mark (rset->connection);
+    rb_gc_mark (rset->cache);
+    rb_gc_mark (rset->cache_key);
+    rb_gc_mark (rset->criterion);
+    rb_gc_mark (rset->page);
+    rb_gc_mark (rset->store);
+    rb_gc_mark (rset->store_key);
+    rb_gc_mark (rset->sort);
+}
+
+/* Gives the result set and the records it holds back to YAZ. */
+static void
+rbz_resultset_release (struct rbz_resultset *rset)
+{
+    if (rset->resultset != NULL) {
+        ZOOM_resultset_destroy (rset->resultset);
+        rset->resultset = NULL;
+    }
+    RBZ_ADJUST_MEMORY (-(ssize_t) rset->record_bytes);
+    rset->record_bytes = 0;
+    xfree (rset->seen);
+    rset->seen = NULL;
+    rset->seen_size = 0;
+}
+
+static void
+rbz_resultset_free (struct rbz_resultset *rset)
+{
+    rbz_record_release_all (&rset->borrowed, 0);
+    rbz_resultset_release (rset);
+    xfree (rset);
+}
+
+static size_t
+rbz_resultset_memsize (const void *data)
+{
+    const struct rbz_resultset *rset;
+
+    rset = (const struct rbz_resultset *) data;
+    return sizeof (struct rbz_resultset) + rset->record_bytes
+        + (rset->seen != NULL ? (rset->seen_size + 7) / 8 : 0);
+}
+
+static const rb_data_type_t rbz_resultset_data_type = {
+    .wrap_struct_name = "ZOOM::ResultSet",
+    .function = {
+        .dmark = (RUBY_DATA_FUNC) rbz_resultset_mark,
+        .dfree = (RUBY_DATA_FUNC) rbz_resultset_free,
+        .dsize = rbz_resultset_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct rbz_resultset *
+rbz_resultset_alloc (VALUE connection, VALUE *obj)
+{
+    struct rbz_resultset *rset;
+
+    *obj = TypedData_Make_Struct (cZoomResultSet,
+                                  struct rbz_resultset,
+                                  &rbz_resultset_data_type,
+                                  rset);
+    rset->connection = connection;
+    rset->cache = Qnil;
+    rset->cache_key = Qnil;
+    rset->criterion = Qnil;
+    rset->page = Qnil;
+    rset->store = Qnil;
+    rset->store_key = Qnil;
+    rset->sort = Qnil;
+
+    return rset;
+}
+
+VALUE
+rbz_resultset_make (ZOOM_resultset resultset, VALUE connection, 
+                    VALUE criterion)
+{
+    struct rbz_resultset *rset;
+    VALUE obj;
+
+    if (resultset == NULL)
+        return Qnil;
+
+    rset = rbz_resultset_alloc (connection, &obj);
+    rset->resultset = resultset;
+    rset->criterion = criterion;
+
+    return obj;
+}
+
+/*
+ * Makes a result set answered from a ZOOM::ResultCache: it has size hits,
+ * and its first records are in page.  The search of criterion is only sent
+ * when something else is needed.
+ */
 VALUE
-rbz_resultset_make (ZOOM_resultset resultset)
+rbz_resultset_make_cached (VALUE connection, VALUE criterion, size_t size,
+                           VALUE page)
+{
+    struct rbz_resultset *rset;
+    VALUE obj;
+
+    rset = rbz_resultset_alloc (connection, &obj);
+    rset->criterion = criterion;
+    rset->cached_size = size;
+    rset->page = page;
+
+    return obj;
+}
+
+static struct rbz_resultset *
+rbz_resultset_data (VALUE obj)
+{
+    struct rbz_resultset *rset;
+
+    TypedData_Get_Struct (obj, struct rbz_resultset, &rbz_resultset_data_type,
+                          rset);
+    assert (rset != NULL);
+    if (rset->destroyed)
+        rb_raise (rb_eIOError, "destroyed result set");
+
+    return rset;
+}
+
+/* Makes the result set fill the first page of key in cache. */
+void
+rbz_resultset_set_cache (VALUE obj, VALUE cache, VALUE key)
 {
-    return resultset != NULL
-        ? Data_Wrap_Struct (cZoomResultSet,
-                            NULL,
-                            ZOOM_resultset_destroy,
-                            resultset)
-        : Qnil;
+    struct rbz_resultset *rset;
+
+    rset = rbz_resultset_data (obj);
+    rset->cache = cache;
+    rset->cache_key = key;
 }
 
+/* 
+ * Returns the ZOOM result set, sending the search first if the result set
+ * was made from the cache.
+ */
 static ZOOM_resultset
 rbz_resultset_get (VALUE obj)
 {
+    struct rbz_resultset *rset;
+
+    rset = rbz_resultset_data (obj);
+    if (rset->resultset == NULL) {
+        rset->resultset = rbz_connection_search_resultset (rset->connection,
+                                                           rset->criterion);
+        rset->page = Qnil;
+        rbz_connection_check (rset->connection);
+    }
+
+    return rset->resultset;
+}
+
+/* Returns the number of hits, without sending a search from the cache. */
+static size_t
+rbz_resultset_count (VALUE obj)
+{
+    struct rbz_resultset *rset;
+
+    rset = rbz_resultset_data (obj);
+    return rset->resultset != NULL
+        ? ZOOM_resultset_size (rset->resultset)
+        : rset->cached_size;
+}
+
+/*
+ * Returns the value of an option, without sending a search from the cache:
+ * options of a result set default to the ones of its connection.
+ */
+static const char *
+rbz_resultset_option (VALUE obj, const char *key)
+{
+    struct rbz_resultset *rset;
+
+    rset = rbz_resultset_data (obj);
+    return rset->resultset != NULL
+        ? ZOOM_resultset_option_get (rset->resultset, key)
+        : ZOOM_connection_option_get (rbz_connection_get (rset->connection),
+                                      key);
+}
+
+/*
+ * Returns the records in [begin, begin + count) from the cache, or nil if
+ * they are not all there.
+ */
+static VALUE
+rbz_resultset_cached_window (VALUE obj, size_t begin, size_t count)
+{
+    struct rbz_resultset *rset;
+    size_t end;
+
+    rset = rbz_resultset_data (obj);
+    if (rset->resultset != NULL)
+        return Qnil;
+
+    end = MIN (begin + count, rset->cached_size);
+    if (end > (size_t) RARRAY_LEN (rset->page))
+        return Qnil;
+
+    return begin < end
+        ? rb_ary_subseq (rset->page, begin, end - begin)
+        : rb_ary_new ();
+}
+
+/*
+ * Returns the prefix of the keys of the records of the result set in a
+ * record store, from the options the records are retrieved with, or nil if
+ * they cannot be stored.
+ */
+static VALUE
+rbz_resultset_make_store_key (struct rbz_resultset *rset)
+{
+    VALUE key;
+
+    key = rbz_cache_resultset_key (rbz_connection_get (rset->connection),
+                                   rset->resultset, rset->criterion);
+    if (!NIL_P (key) && !NIL_P (rset->sort))
+        rb_str_append (key, rset->sort);
+
+    return key;
+}
+
+/* Whether a stored record has the syntax asked for, if any. */
+static int
+rbz_resultset_syntax_p (VALUE obj, const char *syntax, long len)
+{
+    const char *wanted;
+
+    wanted = rbz_resultset_option (obj, "preferredRecordSyntax");
+    if (wanted == NULL || *wanted == '\0')
+        return 1;
+
+    return strlen (wanted) == (size_t) len
+        && STRNCASECMP (wanted, syntax, len) == 0;
+}
+
+/* Returns the key of the record at position in the record store. */
+static const char *
+rbz_resultset_store_key (struct rbz_resultset *rset, size_t position,
+                         VALUE *key)
+{
+    *key = rb_str_dup (rset->store_key);
+    rb_str_catf (*key, "\037%lu", (unsigned long) position);
+
+    return StringValueCStr (*key);
+}
+
+/*
+ * Returns the records in [begin, begin + count) from the record store, or
+ * nil if they are not all there.
+ */
+static VALUE
+rbz_resultset_stored_window (VALUE self, size_t begin, size_t count)
+{
+    struct rbz_resultset *rset;
+    VALUE ary;
+    VALUE key;
+    VALUE data;
+    VALUE meta;
+    size_t end;
+    size_t i;
+
+    rset = rbz_resultset_data (self);
+    if (NIL_P (rset->store))
+        return Qnil;
+
+    end = MIN (begin + count, rbz_resultset_count (self));
+    ary = rb_ary_new2 (begin < end ? end - begin : 0);
+    for (i = begin; i < end; i++) {
+        const char *database;
+
+        if (!rbz_store_read (rset->store, 
+                             rbz_resultset_store_key (rset, i, &key), 
+                             &data, &meta))
+            return Qnil;
+
+        /* The metadata is the syntax and the database, NUL separated */
+        database = memchr (RSTRING_PTR (meta), '\0', RSTRING_LEN (meta));
+        if (database == NULL
+            || !rbz_resultset_syntax_p (self, RSTRING_PTR (meta),
+                                        database - RSTRING_PTR (meta)))
+            return Qnil;
+        database++;
+        rb_ary_push (ary, 
+            rbz_record_make_stored (data,
+                rb_str_new (RSTRING_PTR (meta), 
+                            database - RSTRING_PTR (meta) - 1),
+                rb_str_new (database, 
+                            RSTRING_END (meta) - database)));
+    }
+
+    return ary;
+}
+
+/* Saves the records retrieved in the record store of the result set. */
+static void
+rbz_resultset_store_records (struct rbz_resultset *rset, ZOOM_record *records,
+                             size_t begin, size_t count)
+{
+    const char *data;
+    const char *syntax;
+    const char *database;
+    char *meta;
+    VALUE key;
+    VALUE buf;
+    int len;
+    int syntax_len;
+    int database_len;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (records [i] == NULL)
+            continue;
+
+        data = ZOOM_record_get (records [i], "raw", &len);
+        if (data == NULL)
+            continue;
+        syntax = ZOOM_record_get (records [i], "syntax", &syntax_len);
+        database = ZOOM_record_get (records [i], "database", &database_len);
+        if (syntax == NULL)
+            syntax_len = 0;
+        if (database == NULL)
+            database_len = 0;
+
+        meta = ALLOCV_N (char, buf, syntax_len + 1 + database_len);
+        memcpy (meta, syntax, syntax_len);
+        meta [syntax_len] = '\0';
+        memcpy (meta + syntax_len + 1, database, database_len);
+
+        rbz_store_write (rset->store, 
+                         rbz_resultset_store_key (rset, begin + i, &key),
+                         meta, syntax_len + 1 + database_len, data, len);
+        ALLOCV_END (buf);
+    }
+}
+
+struct rbz_fetch_args {
     ZOOM_resultset resultset;
-        
-    Data_Get_Struct (obj, struct ZOOM_resultset_p, resultset);
-    assert (resultset != NULL);
+    ZOOM_record *records;
+    size_t begin;
+    size_t count;
+};
+
+static void *
+rbz_resultset_records_blocking (void *data)
+{
+    struct rbz_fetch_args *args;
+
+    args = (struct rbz_fetch_args *) data;
+    ZOOM_resultset_records (args->resultset, args->records, 
+                            args->begin, args->count);
+
+    return NULL;
+}
+
+static void *
+rbz_resultset_record_blocking (void *data)
+{
+    struct rbz_fetch_args *args;
+
+    args = (struct rbz_fetch_args *) data;
+    args->records [0] = ZOOM_resultset_record (args->resultset, args->begin);
+
+    return NULL;
+}
+
+/*
+ * Accounts for the records YAZ keeps in the cache of the result set, until
+ * it is destroyed or sorted, to the GC.  Each position is counted once.
+ */
+static void
+rbz_resultset_account (struct rbz_resultset *rset, ZOOM_record *records,
+                       size_t begin, size_t count)
+{
+    size_t bytes;
+    size_t pos;
+    size_t i;
+    int len;
+
+    if (rset->seen == NULL) {
+        rset->seen_size = ZOOM_resultset_size (rset->resultset);
+        if (rset->seen_size == 0)
+            return;
+        rset->seen = ZALLOC_N (unsigned char, (rset->seen_size + 7) / 8);
+    }
+
+    bytes = 0;
+    for (i = 0; i < count; i++) {
+        pos = begin + i;
+        if (records [i] == NULL || pos >= rset->seen_size
+            || (rset->seen [pos / 8] & (1 << (pos % 8))) != 0)
+            continue;
+        rset->seen [pos / 8] |= 1 << (pos % 8);
+        if (ZOOM_record_get (records [i], "raw", &len) != NULL && len > 0)
+            bytes += len;
+    }
+    rset->record_bytes += bytes;
+    RBZ_ADJUST_MEMORY ((ssize_t) bytes);
+}
+
+/*
+ * Retrieves count records starting at begin, waiting for the present
+ * round-trip without holding the GVL.  With one_by_one set, the records
+ * are fetched with ZOOM_resultset_record instead of in a single batch.
+ * Either way, subscribers see a single :present event.
+ */
+static void
+rbz_resultset_fetch (VALUE self, ZOOM_record *records, 
+                     size_t begin, size_t count, int one_by_one)
+{
+    struct rbz_resultset *rset;
+    struct rbz_fetch_args args;
+    ZOOM_connection connection;
+    double started;
+    double clock;
+    int tuning;
+    size_t i;
+
+    rset = rbz_resultset_data (self);
+    connection = rbz_connection_get (rset->connection);
+
+    /* Records read ahead, or fetched one by one, would mislead the tuning */
+    tuning = !one_by_one && rset->prefetch == 0 
+        && rbz_tuning_p (rset->connection);
+
+    args.resultset = rbz_resultset_get (self);
+    args.records = records;
+    args.begin = begin;
+    args.count = count;
+
+    started = RBZ_INSTRUMENT_START ();
+    clock = started == 0.0 && tuning ? rbz_instrument_clock () : started;
+
+    /* 
+     * YAZ always waits for records itself.  In a non-blocking fiber, have 
+     * it present them asynchronously first, so that the network is waited
+     * on through the fiber scheduler and the calls below find them cached.
+     */
+    if (RBZ_FIBER_SCHEDULED ()) {
+        ZOOM_resultset_records (args.resultset, NULL, begin, count);
+        rbz_connection_wait (rset->connection);
+    }
+
+    if (!one_by_one)
+        rbz_connection_without_gvl (rset->connection,
+                                    rbz_resultset_records_blocking, &args);
+    else
+        for (i = 0; i < count; i++) {
+            args.records = records + i;
+            args.begin = begin + i;
+            rbz_connection_without_gvl (rset->connection,
+                                        rbz_resultset_record_blocking, &args);
+        }
+
+    if (clock != 0.0) {
+        size_t retrieved = 0;
+        size_t bytes = 0;
+        int len;
+
+        for (i = 0; i < count; i++)
+            if (records [i] != NULL) {
+                retrieved++;
+                if (ZOOM_record_get (records [i], "raw", &len) != NULL)
+                    bytes += len;
+            }
+        if (started != 0.0)
+            rbz_instrument (RBZ_OP_PRESENT, connection, started, retrieved,
+                            bytes);
+        if (tuning)
+            rbz_tuning_record (rset->connection, clock, retrieved, bytes);
+    }
+    rbz_resultset_account (rset, records, begin, count);
+
+    if (!NIL_P (rset->store))
+        rbz_resultset_store_records (rset, records, begin, count);
+}
+
+static void
+rbz_resultset_option_set (VALUE obj, const char *key, const char *value)
+{
+    struct rbz_resultset *rset;
+
+    ZOOM_resultset_option_set (rbz_resultset_get (obj), key, value);
 
-    return resultset;
+    /*
+     * The result cache holds the records of the search in the form given by
+     * the connection options: records in another form must not go there.
+     */
+    if (strcmp (key, "preferredRecordSyntax") == 0
+        || strcmp (key, "elementSetName") == 0
+        || strcmp (key, "databaseName") == 0) {
+        rset = rbz_resultset_data (obj);
+        rset->cache = Qnil;
+        rset->cache_key = Qnil;
+
+        /* Same for the record store, which gets a key for the new form */
+        if (!NIL_P (rset->store))
+            rset->store_key = rbz_resultset_make_store_key (rset);
+    }
 }
 
+static const struct rbz_option_ops rbz_resultset_options = {
+    rbz_resultset_option,
+    rbz_resultset_option_set
+};
+
 /*
  * call-seq: 
  * 	set_option(key, value)
@@ -64,9 +594,7 @@ rbz_resultset_get (VALUE obj)
 static VALUE
 rbz_resultset_set_option (VALUE self, VALUE key, VALUE val)
 {
-    ZOOM_resultset_option_set (rbz_resultset_get (self),
-                               RVAL2CSTR (key),
-                               RVAL2CSTR (rb_obj_as_string (val)));
+    rbz_option_set (self, key, val);
     
     return self;
 }
@@ -86,8 +614,7 @@ rbz_resultset_get_option (VALUE self, VALUE key)
 {
     const char *value;
  
-    value = ZOOM_resultset_option_get (rbz_resultset_get (self),
-                                       RVAL2CSTR (key));
+    value = rbz_resultset_option (self, RVAL2CSTR (key));
 
     return zoom_option_value_to_ruby_value (value);
 }
@@ -98,7 +625,152 @@ rbz_resultset_get_option (VALUE self, VALUE key)
 static VALUE
 rbz_resultset_size (VALUE self)
 {
-    return INT2NUM (ZOOM_resultset_size (rbz_resultset_get (self)));
+    return SIZET2NUM (rbz_resultset_count (self));
+}
+
+/*
+ * Asks for the records between begin and end without waiting for them: the
+ * present request is sent right away in asynchronous mode, and its response
+ * is picked up by the next synchronous operation on the connection.
+ */
+static void
+rbz_resultset_read_ahead (struct rbz_resultset *rset, size_t begin, size_t end)
+{
+    ZOOM_connection connection;
+
+    /*
+     * In synchronous mode YAZ would wait for the records here, with the
+     * GVL held: only read ahead when this just sends the request.
+     */
+    connection = rbz_connection_get (rset->connection);
+    if (!rbz_connection_async_connected_p (rset->connection))
+        return;
+
+    ZOOM_resultset_records (rset->resultset, NULL, begin, end - begin);
+    while (ZOOM_event_nonblock (1, &connection))
+        ;
+
+    if (begin != rset->prefetch_end)
+        rset->prefetch_begin = begin;
+    rset->prefetch_end = end;
+}
+
+/*
+ * Accounts for the window [begin, begin + count) against what was read 
+ * ahead, then reads ahead the windows following it.
+ */
+static void
+rbz_resultset_prefetch (struct rbz_resultset *rset, size_t begin, size_t count)
+{
+    size_t size;
+    size_t from;
+    size_t to;
+
+    if (rset->prefetch == 0 || count == 0)
+        return;
+
+    if (begin >= rset->prefetch_begin && begin + count <= rset->prefetch_end)
+        rset->prefetch_hits++;
+    else
+        rset->prefetch_misses++;
+
+    size = ZOOM_resultset_size (rset->resultset);
+    from = MAX (begin + count, rset->prefetch_end);
+    to = MIN (begin + count * (rset->prefetch + 1), size);
+    if (from < to)
+        rbz_resultset_read_ahead (rset, from, to);
+}
+
+/*
+ * Wraps a record from the cache of the result set, either borrowing it or
+ * making a copy, depending on ZOOM::ResultSet#borrow_records.
+ */
+static VALUE
+rbz_resultset_wrap_record (VALUE self, ZOOM_record record)
+{
+    struct rbz_resultset *rset;
+
+    if (record == NULL)
+        return Qnil;
+
+    rset = rbz_resultset_data (self);
+    return rset->borrow_records
+        ? rbz_record_borrow (record, self, &rset->borrowed)
+        : rbz_record_make (ZOOM_record_clone (record));
+}
+
+/*
+ * Retrieves count records starting at begin, as an array of ZOOM::Record
+ * objects.  Missing records are skipped.
+ */
+static VALUE
+rbz_resultset_window (VALUE self, size_t begin, size_t count)
+{
+    struct rbz_resultset *rset;
+    ZOOM_record *records;
+    VALUE records_buf;
+    VALUE ary;
+    size_t i;
+
+    ary = rbz_resultset_cached_window (self, begin, count);
+    if (NIL_P (ary))
+        ary = rbz_resultset_stored_window (self, begin, count);
+    if (!NIL_P (ary))
+        return ary;
+
+    ary = rb_ary_new ();
+    if (count == 0)
+        return ary;
+
+    /* Allocate array, released by the GC if we raise before the end */
+    records = ALLOCV_N (ZOOM_record, records_buf, count);
+
+    /* Download records in batches */
+    rbz_resultset_fetch (self, records, begin, count, 0);
+
+    /* Ask for the next windows while the caller works on this one */
+    rbz_resultset_prefetch (rbz_resultset_data (self), begin, count);
+
+    /* Test the first record in the set.  If null, then fall back.  If valid, 
+     * generate the ruby array.
+     */
+
+    if (records[0]!=NULL) {
+       for (i = 0; i < count; i++)
+
+         /* We don't want any null records -- if there is on in the resultset, 
+          * ignore it.
+          */
+
+         if (records[i]!=NULL)
+            rb_ary_push (ary, rbz_resultset_wrap_record (self, records [i]));
+    } else {
+      /* This is our fallback function
+       * It exists for those anomalies where the server 
+       * will not respect the batch request and will return just 
+       * a null array (per change request 36 where Laurent Sansonetti notes
+       *    Retrieves the record one by one using ZOOM_resultset_record instead
+       *    of getting them all in once with ZOOM_resultset_records (for a strange
+       *    reason sometimes the resultset was not empty but ZOOM_resultset_records
+       *    used to return empty records).
+       */
+
+      rbz_resultset_fetch (self, records, begin, count, 1);
+      for (i = 0; i < count; i++) {
+        /* Ignore null records */
+        if (records[i] != NULL)
+            rb_ary_push (ary, rbz_resultset_wrap_record (self, records [i]));
+      }
+    }
+
+    /* Keep the first page for the next identical search */
+    rset = rbz_resultset_data (self);
+    if (!NIL_P (rset->cache))
+        rbz_cache_store_records (rset->cache, rset->cache_key, records, 
+                                 begin, count);
+
+    ALLOCV_END (records_buf);
+    return ary;
 }
 
 /*
@@ -122,22 +794,25 @@ rbz_resultset_size (VALUE self)
 static VALUE
 rbz_resultset_index (int argc, VALUE *argv, VALUE self)
 {
-    ZOOM_record *records;
     ZOOM_record record;
-    VALUE ary;
     size_t begin;
     size_t count;
-    size_t i;
     
     if (argc == 1) {
         VALUE arg = argv [0];
 
         if (TYPE (arg) == T_FIXNUM || TYPE (arg) == T_BIGNUM) {
-            record = ZOOM_resultset_record (rbz_resultset_get (self),
-                                            NUM2LONG (arg));
-            return record != NULL
-                ? rbz_record_make (ZOOM_record_clone (record))
-                : Qnil;
+            VALUE cached;
+
+            begin = NUM2LONG (arg);
+            cached = rbz_resultset_cached_window (self, begin, 1);
+            if (NIL_P (cached))
+                cached = rbz_resultset_stored_window (self, begin, 1);
+            if (!NIL_P (cached))
+                return rb_ary_entry (cached, 0);
+
+            rbz_resultset_fetch (self, &record, begin, 1, 1);
+            return rbz_resultset_wrap_record (self, record);
         }
        
         if (CLASS_OF (arg) == rb_cRange) {
@@ -160,66 +835,436 @@ rbz_resultset_index (int argc, VALUE *argv, VALUE self)
         count = NUM2LONG (rb_count);
     }
         
-    ary = rb_ary_new ();
-    if (count == 0)
-        return ary;
-
-    /* Allocate array */
-    records = ALLOC_N (ZOOM_record, count);
+    return rbz_resultset_window (self, begin, count);
+}
 
-    /* Download records in batches */
-    ZOOM_resultset_records (rbz_resultset_get (self), records, begin, count);
+static size_t rbz_resultset_chunk (VALUE self);
 
-    /* Test the first record in the set.  If null, then fall back.  If valid, 
-     * generate the ruby array.
-     */
+/*
+ * call-seq:
+ * 	records(options=nil)
+ *
+ * options: a Hash, with the following keys (all optional):
+ * :format, the form of ZOOM::Record#get in which to return the records, as
+ * a Symbol or a String (default :raw); :charset, the charset of the records
+ * as a String, or an Array with the charsets to convert from and to (for
+ * example %w[marc8 utf-8]).
+ *
+ * Lists the records inside the result set.  All the records are retrieved
+ * and kept in memory at once; see ZOOM::ResultSet#each_record to iterate 
+ * over large result sets.
+ *
+ * With options, the records are rendered and converted in windows of
+ * presentChunk records, without holding the GVL and with converters that
+ * are kept from one call to the next, which makes it the fastest way to
+ * get many records in another charset.
+ *
+ * 	rset.records(:format => :xml, :charset => %w[marc8 utf-8])
+ *
+ * Returns: an array of ZOOM::Record objects, or of strings with options.
+ */
+static VALUE
+rbz_resultset_records (int argc, VALUE *argv, VALUE self)
+{
+    VALUE options;
+    VALUE form;
+    VALUE charset;
+    VALUE from;
+    VALUE to;
+    VALUE ary;
+    VALUE window;
+    size_t size;
+    size_t chunk;
+    size_t begin;
 
-    if (records[0]!=NULL) {
-       for (i = 0; i < count; i++)
+    rb_scan_args (argc, argv, "01", &options);
 
-         /* We don't want any null records -- if there is on in the resultset, 
-          * ignore it.
-          */
+    if (NIL_P (options)) {
+        VALUE args [2];
 
-         if (records[i]!=NULL)
-            rb_ary_push (ary, rbz_record_make (ZOOM_record_clone (records [i])));
-    } else {
-      /* This is our fallback function
-       * It exists for those anomalies where the server 
-       * will not respect the batch request and will return just 
-       * a null array (per change request 36 where Laurent Sansonetti notes
-       *    Retrieves the record one by one using ZOOM_resultset_record instead
-       *    of getting them all in once with ZOOM_resultset_records (for a strange
-       *    reason sometimes the resultset was not empty but ZOOM_resultset_records
-       *    used to return empty records).
-       */
+        args [0] = INT2FIX (0);
+        args [1] = rbz_resultset_size (self);
+    
+        return rbz_resultset_index (2, args, self);
+    }
 
-      for (i = 0; i < count; i++) {
-        record = ZOOM_resultset_record (rbz_resultset_get (self),
-                                        begin + i);
-        /* Ignore null records */
-        if (record != NULL)
-            rb_ary_push (ary, rbz_record_make (ZOOM_record_clone (record)));
-      }
+    Check_Type (options, T_HASH);
+    form = rb_hash_aref (options, ID2SYM (rb_intern ("format")));
+    form = NIL_P (form) ? rb_str_new2 ("raw") : rb_String (form);
+    charset = rb_hash_aref (options, ID2SYM (rb_intern ("charset")));
+    from = to = Qnil;
+    if (TYPE (charset) == T_ARRAY) {
+        if (RARRAY_LEN (charset) < 1 || RARRAY_LEN (charset) > 2)
+            rb_raise (rb_eArgError, "charset must be [from] or [from, to]");
+        from = rb_ary_entry (charset, 0);
+        to = rb_ary_entry (charset, 1);
+    }
+    else
+        from = charset;
+    if (!NIL_P (from))
+        StringValue (from);
+    if (!NIL_P (to))
+        StringValue (to);
+
+    ary = rb_ary_new ();
+    size = rbz_resultset_count (self);
+    for (begin = 0; begin < size; begin += chunk) {
+        chunk = rbz_resultset_chunk (self);
+        window = rbz_resultset_window (self, begin, MIN (chunk, size - begin));
+        rb_ary_concat (ary, rbz_convert_records (window, form, from, to));
+        rb_ary_clear (window);
     }
 
     return ary;
 }
 
+struct rbz_sort_args {
+    ZOOM_resultset resultset;
+    const char *type;
+    const char *criteria;
+    int result;
+};
+
+static void *
+rbz_resultset_sort_blocking (void *data)
+{
+    struct rbz_sort_args *args;
+
+    args = (struct rbz_sort_args *) data;
+    args->result = ZOOM_resultset_sort1 (args->resultset, args->type, 
+                                         args->criteria);
+
+    return NULL;
+}
+
 /*
- * Lists the records inside the result set.
+ * call-seq:
+ * 	sort!(criteria, type='yaz')
+ *
+ * criteria: a sort criteria, in the notation of the given type (for 
+ * example '1=4 <' to sort by title in ascending order in the YAZ 
+ * notation).
+ *
+ * type: the notation of the criteria, 'yaz', 'cql', 'sru11' or 'solr'.
  *
- * Returns: an array of ZOOM::Record objects.
+ * Makes the target sort the result set in place, in one round-trip done
+ * without holding the GVL, so that only the first records of the sorted
+ * result set need to be retrieved.  Records borrowed from the result set
+ * before get their own copy.  To sort a search directly, see 
+ * ZOOM::Query#sort_by.
+ *
+ * This method raises an exception on error.
+ *
+ * Returns: self.
  */
 static VALUE
-rbz_resultset_records (VALUE self)
+rbz_resultset_sort (int argc, VALUE *argv, VALUE self)
 {
-    VALUE argv [2];
+    struct rbz_resultset *rset;
+    struct rbz_sort_args args;
+    ZOOM_connection connection;
+    VALUE criteria;
+    VALUE type;
+    double started;
 
-    argv [0] = INT2FIX (0);
-    argv [1] = rbz_resultset_size (self);
-    
-    return rbz_resultset_index (2, argv, self);
+    rb_scan_args (argc, argv, "11", &criteria, &type);
+    args.criteria = StringValueCStr (criteria);
+    args.type = NIL_P (type) ? "yaz" : StringValueCStr (type);
+    args.resultset = rbz_resultset_get (self);
+
+    /* YAZ drops the records it holds, and positions change */
+    rset = rbz_resultset_data (self);
+    rbz_record_release_all (&rset->borrowed, 1);
+    rset->prefetch_begin = rset->prefetch_end = 0;
+    rset->cache = rset->cache_key = Qnil;
+    if (rset->seen != NULL)
+        memset (rset->seen, 0, (rset->seen_size + 7) / 8);
+    RBZ_ADJUST_MEMORY (-(ssize_t) rset->record_bytes);
+    rset->record_bytes = 0;
+
+    connection = rbz_connection_get (rset->connection);
+    started = RBZ_INSTRUMENT_START ();
+    rbz_connection_without_gvl (rset->connection,
+                                rbz_resultset_sort_blocking, &args);
+    rbz_connection_wait (rset->connection);
+    RBZ_INSTRUMENT_FINISH (RBZ_OP_SORT, connection, started, 0, 0);
+    rbz_connection_check (rset->connection);
+    if (args.result != 0)
+        rb_raise (rb_eArgError, "invalid sort criteria %s", args.criteria);
+
+    /* Records are stored under their position in the sorted result set */
+    rset->sort = rb_sprintf ("\037sort:%s:%s", args.type, args.criteria);
+    if (!NIL_P (rset->store))
+        rset->store_key = rbz_resultset_make_store_key (rset);
+    RB_GC_GUARD (criteria);
+    RB_GC_GUARD (type);
+
+    return self;
+}
+
+/*
+ * call-seq:
+ * 	destroy
+ *
+ * Destroys the result set: the target is told it can drop it with the next
+ * request sent on the connection, and the records held by YAZ are freed
+ * now, rather than when the object is garbage collected.  Records borrowed
+ * from the result set get their own copy first.  Any later use of the 
+ * result set raises an IOError.  See also the block form of 
+ * ZOOM::Connection#search.
+ *
+ * Destroying a result set that is destroyed already does nothing.
+ *
+ * Returns: nil.
+ */
+VALUE
+rbz_resultset_destroy (VALUE self)
+{
+    struct rbz_resultset *rset;
+
+    TypedData_Get_Struct (self, struct rbz_resultset, &rbz_resultset_data_type,
+                          rset);
+    if (rset->destroyed)
+        return Qnil;
+
+    rbz_record_release_all (&rset->borrowed, 1);
+    rbz_resultset_release (rset);
+    rset->destroyed = 1;
+    rset->prefetch_begin = rset->prefetch_end = 0;
+    rset->cache = rset->cache_key = Qnil;
+    rset->page = Qnil;
+
+    return Qnil;
+}
+
+/*
+ * call-seq:
+ * 	destroyed?
+ *
+ * Returns: whether the result set is destroyed.
+ */
+static VALUE
+rbz_resultset_destroyed_p (VALUE self)
+{
+    struct rbz_resultset *rset;
+
+    TypedData_Get_Struct (self, struct rbz_resultset, &rbz_resultset_data_type,
+                          rset);
+    return CBOOL2RVAL (rset->destroyed);
+}
+
+/*
+ * call-seq:
+ * 	borrow_records = enabled
+ *
+ * enabled: true to borrow records, false to copy them (the default).
+ *
+ * By default, each ZOOM::Record object returned by the result set holds its 
+ * own copy of the record.  When borrowing is enabled, the ZOOM::Record 
+ * objects refer directly to the records cached by the result set instead, 
+ * which saves a copy of every record retrieved.  A borrowed record keeps its
+ * result set alive, and is copied only when ZOOM::Record#detach is called.
+ *
+ * Returns: enabled.
+ */
+static VALUE
+rbz_resultset_set_borrow_records (VALUE self, VALUE enabled)
+{
+    rbz_resultset_data (self)->borrow_records = RVAL2CBOOL (enabled);
+    return enabled;
+}
+
+/*
+ * Returns: whether the records returned by the result set are borrowed from
+ * its cache instead of being copied.
+ */
+static VALUE
+rbz_resultset_get_borrow_records (VALUE self)
+{
+    return CBOOL2RVAL (rbz_resultset_data (self)->borrow_records);
+}
+
+/*
+ * call-seq:
+ * 	prefetch = windows
+ *
+ * windows: the number of windows to read ahead, or 0 to disable read-ahead.
+ *
+ * Enables background read-ahead for sequential access.  Once a window of
+ * records has been retrieved with ZOOM::ResultSet#[] (using a range or an
+ * interval) or while iterating, the present request for the given number of
+ * following windows of the same size is sent to the target right away, 
+ * without waiting for the response.  By the time the next window is asked
+ * for, its records are usually already there.
+ *
+ * Since all the windows read ahead are requested at once, the presentChunk
+ * option should be large enough to hold them.
+ *
+ * Returns: windows.
+ */
+static VALUE
+rbz_resultset_set_prefetch (VALUE self, VALUE windows)
+{
+    rbz_resultset_data (self)->prefetch = NUM2ULONG (windows);
+    return windows;
+}
+
+/*
+ * Returns: the number of windows read ahead, 0 if read-ahead is disabled.
+ */
+static VALUE
+rbz_resultset_get_prefetch (VALUE self)
+{
+    return SIZET2NUM (rbz_resultset_data (self)->prefetch);
+}
+
+/*
+ * Reports how well read-ahead works for the way the result set is accessed:
+ * hits counts the windows that had been read ahead, misses the ones that 
+ * had not.  Nothing is counted while read-ahead is disabled.
+ *
+ * Returns: a Hash with the :hits and :misses counters.
+ */
+static VALUE
+rbz_resultset_prefetch_stats (VALUE self)
+{
+    struct rbz_resultset *rset;
+    VALUE stats;
+
+    rset = rbz_resultset_data (self);
+    stats = rb_hash_new ();
+    rb_hash_aset (stats, ID2SYM (rb_intern ("hits")), 
+                  SIZET2NUM (rset->prefetch_hits));
+    rb_hash_aset (stats, ID2SYM (rb_intern ("misses")), 
+                  SIZET2NUM (rset->prefetch_misses));
+
+    return stats;
+}
+
+/*
+ * call-seq:
+ * 	record_store = store
+ *
+ * store: a ZOOM::RecordStore, or nil.
+ *
+ * Makes the result set save the records it retrieves in the given store,
+ * and read them back from there instead of the target when they were 
+ * already saved, by this result set or by another one for the same search.
+ * Records are saved under the search, the host, the database, the 
+ * preferred record syntax and the element set name of the result set,
+ * which follow the ones of the connection unless set on the result set,
+ * and the position of the record.  Records saved with another syntax than
+ * the preferred one are not read back.  Records read back from the store
+ * only have their raw data, and the forms YAZ renders from raw MARC
+ * records.
+ *
+ * Returns: store.
+ */
+static VALUE
+rbz_resultset_set_record_store (VALUE self, VALUE store)
+{
+    struct rbz_resultset *rset;
+    VALUE key;
+
+    rset = rbz_resultset_data (self);
+    if (NIL_P (store)) {
+        rset->store = rset->store_key = Qnil;
+        return store;
+    }
+
+    if (!rb_obj_is_kind_of (store, rb_path2class ("ZOOM::RecordStore")))
+        rb_raise (rb_eArgError, "Invalid argument of type %s (not ZOOM::RecordStore)",
+                  rb_class2name (CLASS_OF (store)));
+    key = rbz_resultset_make_store_key (rset);
+    if (NIL_P (key))
+        rb_raise (rb_eArgError, "the records of this search cannot be stored");
+
+    rset->store = store;
+    rset->store_key = key;
+
+    return store;
+}
+
+/*
+ * Returns: the ZOOM::RecordStore of the result set, or nil.
+ */
+static VALUE
+rbz_resultset_get_record_store (VALUE self)
+{
+    return rbz_resultset_data (self)->store;
+}
+
+/*
+ * Returns: the number of records retrieved at once when iterating over the
+ * result set, which is the presentChunk option, or 20 if not set.
+ */
+static size_t
+rbz_resultset_chunk (VALUE self)
+{
+    const char *value;
+    int chunk;
+
+    value = rbz_resultset_option (self, "presentChunk");
+    chunk = value != NULL ? atoi (value) : 0;
+
+    return chunk > 0 ? (size_t) chunk : 20;
+}
+
+static VALUE
+rbz_resultset_slice_count (VALUE self, VALUE args, VALUE eobj)
+{
+    size_t size;
+    size_t chunk;
+
+    size = rbz_resultset_count (self);
+    chunk = RARRAY_LEN (args) > 0 && !NIL_P (RARRAY_PTR (args) [0])
+        ? NUM2ULONG (RARRAY_PTR (args) [0])
+        : rbz_resultset_chunk (self);
+
+    return SIZET2NUM (chunk > 0 ? (size + chunk - 1) / chunk : 0);
+}
+
+/*
+ * call-seq: 
+ * 	each_slice(size=nil) { |records| ... }
+ *
+ * size: the number of records per slice (optional).  Defaults to the 
+ * presentChunk option of the result set.
+ *
+ * Retrieves the records of the result set one slice at a time, and calls the
+ * given block for each slice, passing an array of ZOOM::Record objects as 
+ * parameter.  Only one slice is held in memory at a time, whatever the size
+ * of the result set.
+ *
+ * Returns: self, or an Enumerator if no block is given.
+ */
+static VALUE
+rbz_resultset_each_slice (int argc, VALUE *argv, VALUE self)
+{
+    VALUE rb_chunk;
+    size_t size;
+    size_t chunk;
+    size_t begin;
+
+    RETURN_SIZED_ENUMERATOR (self, argc, argv, rbz_resultset_slice_count);
+    rb_scan_args (argc, argv, "01", &rb_chunk);
+
+    chunk = NIL_P (rb_chunk) ? rbz_resultset_chunk (self) : NUM2ULONG (rb_chunk);
+    if (chunk == 0)
+        rb_raise (rb_eArgError, "invalid slice size");
+
+    size = rbz_resultset_count (self);
+    for (begin = 0; begin < size; begin += chunk)
+        rb_yield (rbz_resultset_window (self, begin,
+                                        MIN (chunk, size - begin)));
+
+    return self;
+}
+
+static VALUE
+rbz_resultset_record_count (VALUE self, VALUE args, VALUE eobj)
+{
+    return rbz_resultset_size (self);
 }
 
 /*
@@ -229,24 +1274,357 @@ rbz_resultset_records (VALUE self)
  * Parses the records inside the result set and call the given block for each
  * record, passing a reference to a ZOOM::Record object as parameter.
  *
- * Returns: self.
+ * The records are retrieved in windows of presentChunk records, and the
+ * Ruby array of each window is dropped before the next one is retrieved.
+ * YAZ still keeps every record presented in the cache of the result set,
+ * which grows until the result set is destroyed (see
+ * ZOOM::ResultSet#destroy).  The option is read again for each window, so
+ * that ZOOM::Connection#auto_tune applies at once.
+ *
+ * Returns: self, or an Enumerator if no block is given.
  */
 static VALUE
 rbz_resultset_each_record (VALUE self)
 {
-    rb_ary_each (rbz_resultset_records (self));
+    VALUE window;
+    size_t size;
+    size_t chunk;
+    size_t begin;
+    long i;
+
+    RETURN_SIZED_ENUMERATOR (self, 0, 0, rbz_resultset_record_count);
+
+    size = rbz_resultset_count (self);
+    for (begin = 0; begin < size; begin += chunk) {
+        chunk = rbz_resultset_chunk (self);
+        window = rbz_resultset_window (self, begin, MIN (chunk, size - begin));
+        for (i = 0; i < RARRAY_LEN (window); i++)
+            rb_yield (RARRAY_PTR (window) [i]);
+        rb_ary_clear (window);
+    }
+
     return self;
 }
 
+#define HARVEST_BUFFER_SIZE 65536
+/* How long a wait on the descriptor lasts before checking for interrupts */
+#define HARVEST_POLL_TIMEOUT 100
+
+struct rbz_harvest {
+    const char *type;
+    ZOOM_record *records;
+    size_t count;
+    size_t next;        /* next record of the chunk to write */
+    size_t offset;      /* bytes of the next record already buffered */
+    int fd;
+    char *buf;          /* output buffer, when writing to a descriptor */
+    size_t len;
+    VALUE str;          /* output string, when calling IO#write */
+    size_t written;     /* number of records written */
+    int error;
+    int gvl;            /* whether the GVL is held while writing */
+    volatile int cancelled;
+};
+
+/* Unblocks a harvest writing without the GVL, without touching the socket. */
+static void
+rbz_harvest_unblock (void *data)
+{
+    ((struct rbz_harvest *) data)->cancelled = 1;
+}
+
+/*
+ * Waits until the descriptor is writable.  With the GVL,
+ * rb_thread_fd_writable lets other threads run and raises on interrupts.
+ * Without it, poll in short steps until the harvest is cancelled.
+ */
+static int
+rbz_harvest_wait (struct rbz_harvest *harvest)
+{
+    struct pollfd pfd;
+
+    if (harvest->gvl) {
+        rb_thread_fd_writable (harvest->fd);
+        return 0;
+    }
+
+    pfd.fd = harvest->fd;
+    pfd.events = POLLOUT;
+    while (!harvest->cancelled)
+        if (poll (&pfd, 1, HARVEST_POLL_TIMEOUT) != 0)
+            return 0;
+
+    return -1;
+}
+
+/*
+ * Writes the buffer out.  On failure, what was not written is kept at the
+ * start of the buffer, so that the write can be resumed.
+ */
+static int
+rbz_harvest_flush (struct rbz_harvest *harvest)
+{
+    size_t done;
+    ssize_t n;
+
+    for (done = 0; done < harvest->len; ) {
+        n = write (harvest->fd, harvest->buf + done, harvest->len - done);
+        if (n >= 0)
+            done += n;
+        else if (errno == EINTR)
+            continue;
+        else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            /* Ruby sockets are non-blocking, wait until we can write */
+            if (rbz_harvest_wait (harvest) < 0)
+                break;
+        }
+        else {
+            harvest->error = errno;
+            break;
+        }
+    }
+    memmove (harvest->buf, harvest->buf + done, harvest->len - done);
+    harvest->len -= done;
+
+    return harvest->len == 0 ? 0 : -1;
+}
+
+/*
+ * Buffers the data, flushing the buffer each time it is full.  The offset
+ * counts the bytes buffered, to resume after a failed flush.
+ */
+static int
+rbz_harvest_write (struct rbz_harvest *harvest, const char *data, size_t len)
+{
+    size_t n;
+
+    while (len > 0) {
+        if (harvest->len == HARVEST_BUFFER_SIZE
+            && rbz_harvest_flush (harvest) < 0)
+            return -1;
+        n = MIN (len, HARVEST_BUFFER_SIZE - harvest->len);
+        memcpy (harvest->buf + harvest->len, data, n);
+        harvest->len += n;
+        harvest->offset += n;
+        data += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Renders a chunk of records and writes them to the file descriptor, from
+ * where the previous call stopped.
+ */
+static void *
+rbz_harvest_write_blocking (void *data)
+{
+    struct rbz_harvest *harvest;
+    const char *buf;
+    int len;
+
+    harvest = (struct rbz_harvest *) data;
+    for (; harvest->next < harvest->count; harvest->next++) {
+        if (harvest->cancelled)
+            break;
+        if (harvest->records [harvest->next] == NULL)
+            continue;
+        buf = ZOOM_record_get (harvest->records [harvest->next],
+                               harvest->type, &len);
+        if (buf == NULL || len < 0 || (size_t) len < harvest->offset)
+            continue;
+        if (rbz_harvest_write (harvest, buf + harvest->offset,
+                               len - harvest->offset) < 0)
+            break;
+        harvest->offset = 0;
+        harvest->written++;
+    }
+
+    return NULL;
+}
+
+/* Renders a chunk of records into a single string for IO#write. */
+static void
+rbz_harvest_append (struct rbz_harvest *harvest)
+{
+    const char *buf;
+    int len;
+    size_t i;
+
+    for (i = 0; i < harvest->count; i++) {
+        if (harvest->records [i] == NULL)
+            continue;
+        buf = ZOOM_record_get (harvest->records [i], harvest->type, &len);
+        if (buf == NULL || len < 0)
+            continue;
+        rb_str_cat (harvest->str, buf, len);
+        harvest->written++;
+    }
+}
+
+static void
+rbz_harvest_output (VALUE io, struct rbz_harvest *harvest, 
+                    const char *data, size_t len)
+{
+    if (harvest->fd < 0) {
+        rb_io_write (io, rb_str_new (data, len));
+        return;
+    }
+    harvest->gvl = 1;
+    if (rbz_harvest_write (harvest, data, len) < 0)
+        rb_syserr_fail (harvest->error, "harvest");
+}
+
+static VALUE
+rbz_harvest_option (VALUE options, const char *name)
+{
+    return NIL_P (options) 
+        ? Qnil 
+        : rb_hash_aref (options, ID2SYM (rb_intern (name)));
+}
+
+/*
+ * call-seq:
+ * 	harvest(io, options={})
+ *
+ * io: where to write the records, an IO object or any object responding to
+ * write.
+ *
+ * options: a Hash, with the following keys (all optional): :format, either
+ * :raw (the default) to write the records as is, for example ISO2709 MARC
+ * records one after another, :xml to write the XML form of each record, or
+ * :marcxml_collection to write the MARCXML records inside a single 
+ * collection element; and :chunk, the number of records retrieved at once,
+ * which defaults to the presentChunk option.
+ *
+ * Retrieves all the records of the result set and writes them to the given
+ * IO, without creating any Ruby object per record.  When io is a file, a 
+ * pipe or a socket, the records are written directly to its file descriptor,
+ * without holding the GVL, bypassing any encoding conversion set on io.
+ * Waiting for a full pipe or socket can be interrupted, by Thread#raise or
+ * Timeout for example, and leaves the connection usable.
+ * Otherwise, io.write is called once per chunk.
+ *
+ * Returns: the number of records written.
+ */
+static VALUE
+rbz_resultset_harvest (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_harvest harvest;
+    VALUE io;
+    VALUE options;
+    VALUE format;
+    VALUE rb_chunk;
+    VALUE records_buf;
+    VALUE output_buf;
+    size_t size;
+    size_t chunk;
+    size_t begin;
+    int collection;
+
+    rb_scan_args (argc, argv, "11", &io, &options);
+    format = rbz_harvest_option (options, "format");
+    rb_chunk = rbz_harvest_option (options, "chunk");
+
+    collection = 0;
+    if (NIL_P (format) || format == ID2SYM (rb_intern ("raw")))
+        harvest.type = "raw";
+    else if (format == ID2SYM (rb_intern ("xml")))
+        harvest.type = "xml";
+    else if (format == ID2SYM (rb_intern ("marcxml_collection"))) {
+        harvest.type = "xml";
+        collection = 1;
+    }
+    else
+        rb_raise (rb_eArgError, "unknown harvest format %s",
+                  RVAL2CSTR (rb_inspect (format)));
+
+    chunk = NIL_P (rb_chunk) ? rbz_resultset_chunk (self) : NUM2ULONG (rb_chunk);
+    if (chunk == 0)
+        rb_raise (rb_eArgError, "invalid chunk size");
+
+    harvest.fd = -1;
+    harvest.buf = NULL;
+    harvest.len = 0;
+    harvest.str = Qnil;
+    harvest.written = 0;
+    harvest.error = 0;
+    harvest.gvl = 1;
+    harvest.cancelled = 0;
+    if (rb_obj_is_kind_of (io, rb_cIO)) {
+        rb_io_flush (io);
+        harvest.fd = NUM2INT (rb_funcall (io, rb_intern ("fileno"), 0));
+        harvest.buf = ALLOCV_N (char, output_buf, HARVEST_BUFFER_SIZE);
+    }
+
+    if (collection) 
+        rbz_harvest_output (io, &harvest, 
+                            "<collection xmlns=\"http://www.loc.gov/MARC21/slim\">\n",
+                            52);
+
+    rbz_connection_get (rbz_resultset_data (self)->connection);
+    size = rbz_resultset_count (self);
+    harvest.records = ALLOCV_N (ZOOM_record, records_buf, chunk);
+    for (begin = 0; begin < size; begin += chunk) {
+        harvest.count = MIN (chunk, size - begin);
+        rbz_resultset_fetch (self, harvest.records, begin, harvest.count, 0);
+        if (harvest.records [0] == NULL)
+            rbz_resultset_fetch (self, harvest.records, begin, harvest.count, 1);
+        rbz_resultset_prefetch (rbz_resultset_data (self), begin, harvest.count);
+
+        if (harvest.fd >= 0) {
+            /*
+             * The records are in memory, only the descriptor may block:
+             * interrupts stop the wait on it, not the connection.
+             */
+            harvest.next = 0;
+            harvest.offset = 0;
+            while (harvest.next < harvest.count) {
+                harvest.cancelled = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+                harvest.gvl = 0;
+#else
+                harvest.gvl = 1;
+#endif
+                RBZ_CALL_WITHOUT_GVL (rbz_harvest_write_blocking, &harvest,
+                                      rbz_harvest_unblock, &harvest);
+                if (harvest.error != 0)
+                    rb_syserr_fail (harvest.error, "harvest");
+                rb_thread_check_ints ();
+            }
+        }
+        else {
+            harvest.str = rb_str_buf_new (0);
+            rbz_harvest_append (&harvest);
+            rb_io_write (io, harvest.str);
+        }
+    }
+
+    if (collection) 
+        rbz_harvest_output (io, &harvest, "</collection>\n", 14);
+    if (harvest.fd >= 0) {
+        harvest.gvl = 1;
+        if (rbz_harvest_flush (&harvest) < 0)
+            rb_syserr_fail (harvest.error, "harvest");
+        ALLOCV_END (output_buf);
+    }
+    ALLOCV_END (records_buf);
+
+    return SIZET2NUM (harvest.written);
+}
+
 void
 Init_zoom_resultset (VALUE mZoom)
 {
     VALUE c;
     
     c = rb_define_class_under (mZoom, "ResultSet", rb_cObject); 
+    rb_undef_alloc_func (c);
     rb_undef_method (CLASS_OF (c), "new");
     rb_define_method (c, "set_option", rbz_resultset_set_option, 2);
     rb_define_method (c, "get_option", rbz_resultset_get_option, 1);
+    rbz_define_options (c, &rbz_resultset_options);
     
     define_zoom_option (c, "start");
     define_zoom_option (c, "count");
@@ -258,9 +1636,23 @@ Init_zoom_resultset (VALUE mZoom)
     
     rb_define_method (c, "size", rbz_resultset_size, 0);
     rb_define_alias (c, "length", "size");
-    rb_define_method (c, "records", rbz_resultset_records, 0);
+    rb_define_method (c, "records", rbz_resultset_records, -1);
     rb_define_method (c, "each_record", rbz_resultset_each_record, 0);
+    rb_define_method (c, "each_slice", rbz_resultset_each_slice, -1);
+    rb_define_method (c, "harvest", rbz_resultset_harvest, -1);
     rb_define_method (c, "[]", rbz_resultset_index, -1);
+    rb_define_method (c, "sort!", rbz_resultset_sort, -1);
+    rb_define_method (c, "destroy", rbz_resultset_destroy, 0);
+    rb_define_method (c, "destroyed?", rbz_resultset_destroyed_p, 0);
+    rb_define_method (c, "borrow_records=", 
+                      rbz_resultset_set_borrow_records, 1);
+    rb_define_method (c, "borrow_records?", 
+                      rbz_resultset_get_borrow_records, 0);
+    rb_define_method (c, "prefetch=", rbz_resultset_set_prefetch, 1);
+    rb_define_method (c, "prefetch", rbz_resultset_get_prefetch, 0);
+    rb_define_method (c, "prefetch_stats", rbz_resultset_prefetch_stats, 0);
+    rb_define_method (c, "record_store=", rbz_resultset_set_record_store, 1);
+    rb_define_method (c, "record_store", rbz_resultset_get_record_store, 0);
     
     cZoomResultSet = c;
 }
@@ -0,0 +1,653 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "rbzoom.h"
+
+#ifdef MAKING_RDOC_HAPPY
+mZoom = rb_define_module("ZOOM");
+#endif
+
+/* Document-class: ZOOM::ScanSet
+ *
+ * The terms of an index around a given term, as returned by
+ * ZOOM::Connection#scan.  Each scan is one round-trip to the target; the
+ * terms stay in the YAZ scan set and are only turned into Ruby strings when
+ * they are asked for.
+ *
+ * 	terms = conn.scan('@attr 1=4 dinosaur', :number => 10)
+ * 	terms.each { |term, occurrences| puts "#{term} (#{occurrences})" }
+ * 	terms = terms.next      # the 10 terms after the last one
+ */
+static VALUE cZoomScanSet;
+
+struct rbz_scanset {
+    ZOOM_scanset scanset;
+    VALUE connection;
+    VALUE attributes;           /* PQF before the term scanned, or nil */
+    VALUE options;              /* options the scan was sent with */
+    size_t first;               /* terms shown: [first, first + count) */
+    size_t count;
+};
+
+static void
+rbz_scanset_mark (struct rbz_scanset *scan)
+{
+    rb_gc_mark (scan->connection);
+    rb_gc_mark (scan->attributes);
+    rb_gc_mark (scan->options);
+}
+
+static void
+rbz_scanset_free (struct rbz_scanset *scan)
+{
+    if (scan->scanset != NULL)
+        ZOOM_scanset_destroy (scan->scanset);
+    xfree (scan);
+}
+
+/* The terms are most of what a scan set holds. */
+static size_t
+rbz_scanset_memsize (const void *data)
+{
+    const struct rbz_scanset *scan;
+    size_t occurrences;
+    size_t bytes;
+    size_t len;
+    size_t i;
+
+    scan = (const struct rbz_scanset *) data;
+    bytes = sizeof (struct rbz_scanset);
+    for (i = 0; scan->scanset != NULL && i < scan->first + scan->count; i++)
+        if (ZOOM_scanset_term (scan->scanset, i, &occurrences, &len) != NULL)
+            bytes += len;
+
+    return bytes;
+}
+
+static const rb_data_type_t rbz_scanset_data_type = {
+    .wrap_struct_name = "ZOOM::ScanSet",
+    .function = {
+        .dmark = (RUBY_DATA_FUNC) rbz_scanset_mark,
+        .dfree = (RUBY_DATA_FUNC) rbz_scanset_free,
+        .dsize = rbz_scanset_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static struct rbz_scanset *
+rbz_scanset_data (VALUE obj)
+{
+    struct rbz_scanset *scan;
+
+    TypedData_Get_Struct (obj, struct rbz_scanset, &rbz_scanset_data_type,
+                          scan);
+    assert (scan != NULL);
+
+    return scan;
+}
+
+/*
+ * Returns the part of a PQF scan term before the term itself, that is its
+ * attributes, or nil if there is no term at the end.
+ */
+static VALUE
+rbz_scanset_attributes (VALUE pqf)
+{
+    const char *p;
+    const char *end;
+    const char *last;
+
+    p = RSTRING_PTR (pqf);
+    end = p + RSTRING_LEN (pqf);
+    last = NULL;
+    while (p < end) {
+        if (ISSPACE (*p)) {
+            p++;
+            continue;
+        }
+        last = p;
+        if (*p == '"') {
+            for (p++; p < end && *p != '"'; p++)
+                if (*p == '\\' && p + 1 < end)
+                    p++;
+            p++;
+        }
+        else
+            while (p < end && !ISSPACE (*p))
+                p++;
+    }
+
+    if (last == NULL || *last == '@')
+        return Qnil;
+
+    return rb_str_new (RSTRING_PTR (pqf), last - RSTRING_PTR (pqf));
+}
+
+struct rbz_scan_args {
+    VALUE rb_connection;
+    ZOOM_connection connection;
+    ZOOM_query query;
+    ZOOM_query own_query;       /* made from a string, destroyed after */
+    ZOOM_scanset scanset;
+    struct rbz_scanset *scan;
+    VALUE saved;                /* options of the connection to restore */
+};
+
+static VALUE
+rbz_scanset_send (VALUE data)
+{
+    struct rbz_scan_args *args;
+
+    /*
+     * A ZOOM::Query comes from the query cache and may be shared between
+     * threads: YAZ adds a reference to it without a lock, so the scan is
+     * queued holding the GVL.  Connections being asynchronous, this only
+     * queues the request.
+     */
+    args = (struct rbz_scan_args *) data;
+    args->scanset = ZOOM_connection_scan1 (args->connection, args->query);
+    args->scan->scanset = args->scanset;
+
+    /* The options of the scan are read from the connection until it is done */
+    rbz_connection_wait (args->rb_connection);
+
+    return Qnil;
+}
+
+/* Gives the connection its options back, even if the scan was interrupted. */
+static VALUE
+rbz_scanset_restore (VALUE data)
+{
+    struct rbz_scan_args *args;
+
+    args = (struct rbz_scan_args *) data;
+    if (!RTEST (rbz_connection_closed_p (args->rb_connection)))
+        rbz_connection_restore_options (args->connection, args->saved);
+    if (args->own_query != NULL)
+        ZOOM_query_destroy (args->own_query);
+
+    return Qnil;
+}
+
+/*
+ * Scans criterion, a PQF string or a ZOOM::Query, on connection, waiting
+ * for the answer without holding the GVL.  The options (a Hash or nil) are
+ * set on the connection for the time of the scan, and kept on the scan set.
+ *
+ * Returns: a new ZOOM::ScanSet.
+ */
+VALUE
+rbz_scanset_make (VALUE connection, VALUE criterion, VALUE options)
+{
+    struct rbz_scanset *scan;
+    struct rbz_scan_args args;
+    ZOOM_query query;
+    VALUE obj;
+    VALUE keys;
+    VALUE pair;
+    VALUE key;
+    VALUE str;
+    const char *name;
+    double started;
+    long i;
+
+    obj = TypedData_Make_Struct (cZoomScanSet,
+                                 struct rbz_scanset,
+                                 &rbz_scanset_data_type,
+                                 scan);
+    scan->connection = connection;
+    scan->attributes = Qnil;
+    scan->options = rb_ary_new ();
+
+    /* [[name, value], ...], as strings */
+    if (!NIL_P (options)) {
+        Check_Type (options, T_HASH);
+        keys = rb_funcall (options, rb_intern ("keys"), 0);
+        for (i = 0; i < RARRAY_LEN (keys); i++) {
+            key = RARRAY_AREF (keys, i);
+            name = rbz_option_key (key, &str);
+            pair = rb_assoc_new (rb_str_new2 (name), Qnil);
+            RARRAY_ASET (pair, 1,
+                         CSTR2RVAL (rbz_option_value (rb_hash_aref (options, 
+                                                                    key),
+                                                      &str)));
+            rb_ary_push (scan->options, pair);
+        }
+    }
+
+    args.rb_connection = connection;
+    args.connection = rbz_connection_get (connection);
+
+    /*
+     * Strings get a query of their own, destroyed after the scan; queries
+     * are shared, and only referenced while holding the GVL.
+     */
+    query = NULL;
+    if (TYPE (criterion) == T_STRING) {
+        query = ZOOM_query_create ();
+        if (ZOOM_query_prefix (query, StringValueCStr (criterion)) != 0) {
+            ZOOM_query_destroy (query);
+            rb_raise (rb_eArgError, "invalid PQF query %s",
+                      RVAL2CSTR (criterion));
+        }
+        scan->attributes = rbz_scanset_attributes (criterion);
+    }
+
+    args.query = query != NULL ? query : rbz_query_get (criterion);
+    args.own_query = query;
+    args.scanset = NULL;
+    args.scan = scan;
+
+    /* [[name, value], ...] of the connection, for rbz_scanset_restore */
+    args.saved = rb_ary_new ();
+    for (i = 0; i < RARRAY_LEN (scan->options); i++) {
+        pair = RARRAY_AREF (scan->options, i);
+        name = RVAL2CSTR (RARRAY_AREF (pair, 0));
+        rb_ary_push (args.saved,
+                     rb_assoc_new (RARRAY_AREF (pair, 0),
+                                   CSTR2RVAL (ZOOM_connection_option_get (
+                                       args.connection, name))));
+        ZOOM_connection_option_set (args.connection, name,
+                                    RVAL2CSTR (RARRAY_AREF (pair, 1)));
+    }
+
+    started = RBZ_INSTRUMENT_START ();
+    rb_ensure (rbz_scanset_send, (VALUE) &args,
+               rbz_scanset_restore, (VALUE) &args);
+    RB_GC_GUARD (criterion);
+
+    for (i = 0; scan->scanset != NULL && i < RARRAY_LEN (scan->options); i++) {
+        pair = RARRAY_AREF (scan->options, i);
+        ZOOM_scanset_option_set (scan->scanset,
+                                 RVAL2CSTR (RARRAY_AREF (pair, 0)),
+                                 RVAL2CSTR (RARRAY_AREF (pair, 1)));
+    }
+
+    scan->first = 0;
+    scan->count = scan->scanset != NULL
+        ? ZOOM_scanset_size (scan->scanset)
+        : 0;
+    RBZ_INSTRUMENT_FINISH (RBZ_OP_SCAN, args.connection, started,
+                           scan->count, 0);
+    rbz_connection_check (connection);
+
+    return obj;
+}
+
+/*
+ * YAZ gives no scan set when the scan could not be sent: such a scan has no
+ * terms, and no options.
+ */
+static const char *
+rbz_scanset_option (VALUE obj, const char *key)
+{
+    struct rbz_scanset *scan;
+
+    scan = rbz_scanset_data (obj);
+    return scan->scanset != NULL
+        ? ZOOM_scanset_option_get (scan->scanset, key)
+        : NULL;
+}
+
+static void
+rbz_scanset_option_set (VALUE obj, const char *key, const char *value)
+{
+    struct rbz_scanset *scan;
+
+    scan = rbz_scanset_data (obj);
+    if (scan->scanset == NULL)
+        rb_raise (rb_eRuntimeError, "the scan was not sent");
+    ZOOM_scanset_option_set (scan->scanset, key, value);
+}
+
+static const struct rbz_option_ops rbz_scanset_options = {
+    rbz_scanset_option,
+    rbz_scanset_option_set
+};
+
+/*
+ * call-seq: 
+ * 	set_option(key, value)
+ *
+ * key: the name of the option, as a string.
+ *
+ * value: the value of this option (as a string, integer or boolean).
+ *
+ * Sets an option on the scan set.
+ * 
+ * Returns: self.
+ */
+static VALUE
+rbz_scanset_set_option (VALUE self, VALUE key, VALUE val)
+{
+    rbz_option_set (self, key, val);
+    
+    return self;
+}
+
+/*
+ * call-seq: 
+ * 	get_option(key)
+ *
+ * key: the name of the option, as a string.
+ *
+ * Gets the value of a scan set's option.
+ * 
+ * Returns: the value of the given option, as a string, integer or boolean.
+ */
+static VALUE
+rbz_scanset_get_option (VALUE self, VALUE key)
+{
+    const char *value;
+ 
+    value = rbz_scanset_option (self, RVAL2CSTR (key));
+
+    return zoom_option_value_to_ruby_value (value);
+}
+
+/* Returns the position in the YAZ scan set of term index, or -1. */
+static long
+rbz_scanset_position (struct rbz_scanset *scan, VALUE index)
+{
+    long i;
+
+    i = NUM2LONG (index);
+    if (i < 0)
+        i += scan->count;
+    if (i < 0 || (size_t) i >= scan->count)
+        return -1;
+
+    return scan->first + i;
+}
+
+/* Returns the term at pos as a new string, or its display form. */
+static VALUE
+rbz_scanset_term_at (struct rbz_scanset *scan, size_t pos, int display,
+                     size_t *occurrences)
+{
+    const char *term;
+    size_t len;
+
+    if (scan->scanset == NULL)
+        return Qnil;
+    term = display
+        ? ZOOM_scanset_display_term (scan->scanset, pos, occurrences, &len)
+        : ZOOM_scanset_term (scan->scanset, pos, occurrences, &len);
+
+    return term != NULL ? rb_str_new (term, len) : Qnil;
+}
+
+/* 
+ * Returns: the number of terms.
+ */
+static VALUE
+rbz_scanset_size (VALUE self)
+{
+    return SIZET2NUM (rbz_scanset_data (self)->count);
+}
+
+/*
+ * call-seq:
+ * 	term(index)
+ *
+ * Returns: the term at the given index, as a string, or nil.
+ */
+static VALUE
+rbz_scanset_term (VALUE self, VALUE index)
+{
+    struct rbz_scanset *scan;
+    size_t occurrences;
+    long pos;
+
+    scan = rbz_scanset_data (self);
+    pos = rbz_scanset_position (scan, index);
+
+    return pos >= 0 ? rbz_scanset_term_at (scan, pos, 0, &occurrences) : Qnil;
+}
+
+/*
+ * call-seq:
+ * 	display_term(index)
+ *
+ * Returns: the term at the given index in the form the target displays it,
+ * which may differ from the indexed form returned by ZOOM::ScanSet#term, or
+ * nil.
+ */
+static VALUE
+rbz_scanset_display_term (VALUE self, VALUE index)
+{
+    struct rbz_scanset *scan;
+    size_t occurrences;
+    long pos;
+
+    scan = rbz_scanset_data (self);
+    pos = rbz_scanset_position (scan, index);
+
+    return pos >= 0 ? rbz_scanset_term_at (scan, pos, 1, &occurrences) : Qnil;
+}
+
+/*
+ * call-seq:
+ * 	occurrences(index)
+ *
+ * Returns: the number of records in which the term at the given index
+ * occurs, or nil.
+ */
+static VALUE
+rbz_scanset_occurrences (VALUE self, VALUE index)
+{
+    struct rbz_scanset *scan;
+    size_t occurrences;
+    size_t len;
+    long pos;
+
+    scan = rbz_scanset_data (self);
+    pos = rbz_scanset_position (scan, index);
+    if (pos < 0 || scan->scanset == NULL)
+        return Qnil;
+    ZOOM_scanset_term (scan->scanset, pos, &occurrences, &len);
+
+    return SIZET2NUM (occurrences);
+}
+
+/*
+ * call-seq:
+ * 	[](index)
+ *
+ * Returns: the term at the given index and its number of occurrences, as
+ * an array of a string and an integer, or nil.
+ */
+static VALUE
+rbz_scanset_index (VALUE self, VALUE index)
+{
+    struct rbz_scanset *scan;
+    size_t occurrences;
+    VALUE term;
+    long pos;
+
+    scan = rbz_scanset_data (self);
+    pos = rbz_scanset_position (scan, index);
+    if (pos < 0)
+        return Qnil;
+    term = rbz_scanset_term_at (scan, pos, 0, &occurrences);
+
+    return rb_assoc_new (term, SIZET2NUM (occurrences));
+}
+
+static VALUE
+rbz_scanset_enum_size (VALUE self, VALUE args, VALUE eobj)
+{
+    return rbz_scanset_size (self);
+}
+
+/*
+ * call-seq: 
+ * 	each { |term, occurrences| ... }
+ *
+ * Calls the given block for each term, passing the term as a string and
+ * its number of occurrences as parameters.
+ *
+ * Returns: self, or an Enumerator if no block is given.
+ */
+static VALUE
+rbz_scanset_each (VALUE self)
+{
+    struct rbz_scanset *scan;
+    size_t occurrences;
+    VALUE term;
+    size_t i;
+
+    RETURN_SIZED_ENUMERATOR (self, 0, 0, rbz_scanset_enum_size);
+
+    scan = rbz_scanset_data (self);
+    for (i = 0; i < scan->count; i++) {
+        term = rbz_scanset_term_at (scan, scan->first + i, 0, &occurrences);
+        rb_yield_values (2, term, SIZET2NUM (occurrences));
+    }
+
+    return self;
+}
+
+/*
+ * Returns: the terms, as an array of strings.
+ */
+static VALUE
+rbz_scanset_terms (VALUE self)
+{
+    struct rbz_scanset *scan;
+    size_t occurrences;
+    VALUE ary;
+    size_t i;
+
+    scan = rbz_scanset_data (self);
+    ary = rb_ary_new2 (scan->count);
+    for (i = 0; i < scan->count; i++)
+        rb_ary_push (ary, rbz_scanset_term_at (scan, scan->first + i, 0,
+                                               &occurrences));
+
+    return ary;
+}
+
+/*
+ * call-seq:
+ * 	next(number=nil)
+ *
+ * number: the number of terms to get (optional).  Defaults to the number 
+ * option of the scan set, or 20.
+ *
+ * Continues the scan after the last term, with the same attributes and
+ * options, in one round-trip.  Only scans of a PQF string can be continued.
+ *
+ * 	page = conn.scan('@attr 1=4 a', :number => 50)
+ * 	page = page.next while page && page.size == 50
+ *
+ * Returns: a new ZOOM::ScanSet object, or nil if this one is empty.
+ */
+static VALUE
+rbz_scanset_next (int argc, VALUE *argv, VALUE self)
+{
+    struct rbz_scanset *scan;
+    struct rbz_scanset *next;
+    VALUE rb_number;
+    VALUE criterion;
+    VALUE options;
+    VALUE last;
+    VALUE first;
+    VALUE obj;
+    const char *value;
+    char buf [32];
+    size_t occurrences;
+    long number;
+    long i;
+
+    rb_scan_args (argc, argv, "01", &rb_number);
+
+    scan = rbz_scanset_data (self);
+    if (NIL_P (scan->attributes))
+        rb_raise (rb_eRuntimeError, "only scans of a PQF term can be continued");
+    if (scan->count == 0 || scan->scanset == NULL)
+        return Qnil;
+
+    if (NIL_P (rb_number)) {
+        value = ZOOM_scanset_option_get (scan->scanset, "number");
+        number = value != NULL ? atol (value) : 20;
+    }
+    else
+        number = NUM2LONG (rb_number);
+    if (number <= 0)
+        rb_raise (rb_eArgError, "invalid number of terms");
+
+    /*
+     * Scan from the last term, which comes first if the target still has
+     * it, asking for one more term to make up for it.
+     */
+    last = rbz_scanset_term_at (scan, scan->first + scan->count - 1, 0,
+                                &occurrences);
+    criterion = rb_str_dup (scan->attributes);
+    rbz_query_quote (criterion, last);
+    options = rb_hash_new ();
+    for (i = 0; i < RARRAY_LEN (scan->options); i++)
+        rb_hash_aset (options, RARRAY_AREF (RARRAY_AREF (scan->options, i), 0),
+                      RARRAY_AREF (RARRAY_AREF (scan->options, i), 1));
+    rb_hash_aset (options, rb_str_new2 ("number"), LONG2NUM (number + 1));
+    rb_hash_aset (options, rb_str_new2 ("position"), INT2FIX (1));
+
+    obj = rbz_scanset_make (scan->connection, criterion, options);
+    next = rbz_scanset_data (obj);
+    if (next->count > 0) {
+        first = rbz_scanset_term_at (next, 0, 0, &occurrences);
+        if (!NIL_P (first) && rb_str_equal (first, last) == Qtrue) {
+            next->first = 1;
+            next->count--;
+        }
+    }
+    next->count = MIN (next->count, (size_t) number);
+    snprintf (buf, sizeof buf, "%ld", number);
+    if (next->scanset != NULL)
+        ZOOM_scanset_option_set (next->scanset, "number", buf);
+
+    return obj;
+}
+
+void
+Init_zoom_scanset (VALUE mZoom)
+{
+    VALUE c;
+    
+    c = rb_define_class_under (mZoom, "ScanSet", rb_cObject); 
+    rb_undef_alloc_func (c);
+    rb_undef_method (CLASS_OF (c), "new");
+    rb_include_module (c, rb_mEnumerable);
+    rb_define_method (c, "set_option", rbz_scanset_set_option, 2);
+    rb_define_method (c, "get_option", rbz_scanset_get_option, 1);
+    rbz_define_options (c, &rbz_scanset_options);
+
+    define_zoom_option (c, "number");
+    define_zoom_option (c, "position");
+    define_zoom_option (c, "stepSize");
+
+    rb_define_method (c, "size", rbz_scanset_size, 0);
+    rb_define_alias (c, "length", "size");
+    rb_define_method (c, "term", rbz_scanset_term, 1);
+    rb_define_method (c, "display_term", rbz_scanset_display_term, 1);
+    rb_define_method (c, "occurrences", rbz_scanset_occurrences, 1);
+    rb_define_method (c, "[]", rbz_scanset_index, 1);
+    rb_define_method (c, "each", rbz_scanset_each, 0);
+    rb_define_method (c, "terms", rbz_scanset_terms, 0);
+    rb_define_method (c, "next", rbz_scanset_next, -1);
+
+    cZoomScanSet = c;
+}
@@ -0,0 +1,284 @@
+/*
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <math.h>
+#include "rbzoom.h"
+
+#ifdef MAKING_RDOC_HAPPY
+mZoom = rb_define_module("ZOOM");
+#endif
+
+/*
+ * Automatic sizing of the presentChunk option of a connection.  The time of
+ * each present is modelled as a round-trip plus a time per record, both
+ * estimated from the presents of the connection, and the chunk is set to
+ * the number of records that gets within 10% of the best rate the target
+ * can give, which is when the round-trip is a tenth of the time of a
+ * present.  The chunk is bounded by what fits in a response.
+ */
+
+/* Weight of the last present in the estimates. */
+#define RBZ_TUNING_WEIGHT       0.2
+
+/* Round-trips to transfer time ratio aimed at: 1 for 9. */
+#define RBZ_TUNING_RATIO        9.0
+
+#define RBZ_TUNING_MIN_CHUNK    1
+#define RBZ_TUNING_MAX_CHUNK    10000
+
+/* YAZ defaults for preferredMessageSize and maximumRecordSize. */
+#define RBZ_TUNING_MESSAGE_SIZE (1024 * 1024)
+
+struct rbz_tuning {
+    /* weighted moments of the presents: records and seconds */
+    double records;
+    double seconds;
+    double records2;
+    double records_seconds;
+
+    double bytes_per_record;
+    double round_trip;          /* 0 until it can be estimated */
+    double record_time;
+    long chunk;
+    size_t samples;
+};
+
+static const rb_data_type_t rbz_tuning_data_type = {
+    .wrap_struct_name = "ZOOM::Connection tuning",
+    .function = {
+        .dfree = RUBY_TYPED_DEFAULT_FREE,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/* Kept in a hidden instance variable of the connection. */
+static ID id_tuning;
+
+static struct rbz_tuning *
+rbz_tuning_get (VALUE connection)
+{
+    VALUE obj;
+
+    obj = rb_attr_get (connection, id_tuning);
+    return NIL_P (obj)
+        ? NULL
+        : (struct rbz_tuning *) rb_check_typeddata (obj,
+                                                    &rbz_tuning_data_type);
+}
+
+/* Whether the presentChunk of the connection is sized automatically. */
+int
+rbz_tuning_p (VALUE connection)
+{
+    return rbz_tuning_get (connection) != NULL;
+}
+
+static long
+rbz_tuning_option (ZOOM_connection connection, const char *key, long defval)
+{
+    const char *value;
+    long n;
+
+    value = ZOOM_connection_option_get (connection, key);
+    n = value != NULL ? atol (value) : 0;
+
+    return n > 0 ? n : defval;
+}
+
+/* The largest chunk that fits in a response of the target. */
+static long
+rbz_tuning_limit (ZOOM_connection connection, double bytes_per_record)
+{
+    long size;
+
+    size = MIN (rbz_tuning_option (connection, "preferredMessageSize",
+                                   RBZ_TUNING_MESSAGE_SIZE),
+                rbz_tuning_option (connection, "maximumRecordSize",
+                                   RBZ_TUNING_MESSAGE_SIZE));
+    if (bytes_per_record < 1.0)
+        return RBZ_TUNING_MAX_CHUNK;
+
+    return (long) MIN (size / bytes_per_record, RBZ_TUNING_MAX_CHUNK);
+}
+
+/*
+ * Accounts for a present of the given number of records and bytes, which
+ * started at the given clock time, and sizes the next ones.
+ */
+void
+rbz_tuning_record (VALUE obj, double started, size_t records, size_t bytes)
+{
+    struct rbz_tuning *tuning;
+    ZOOM_connection connection;
+    double seconds;
+    double weight;
+    double variance;
+    double slope;
+    double intercept;
+    double chunk;
+    char value [32];
+
+    tuning = rbz_tuning_get (obj);
+    if (tuning == NULL || records == 0)
+        return;
+
+    seconds = rbz_instrument_clock () - started;
+    weight = tuning->samples == 0 ? 1.0 : RBZ_TUNING_WEIGHT;
+    tuning->samples++;
+
+#define RBZ_TUNING_UPDATE(field, sample) \
+    tuning->field += weight * ((sample) - tuning->field)
+    RBZ_TUNING_UPDATE (records, records);
+    RBZ_TUNING_UPDATE (seconds, seconds);
+    RBZ_TUNING_UPDATE (records2, (double) records * records);
+    RBZ_TUNING_UPDATE (records_seconds, records * seconds);
+    RBZ_TUNING_UPDATE (bytes_per_record, (double) bytes / records);
+#undef RBZ_TUNING_UPDATE
+
+    /* Least squares fit of seconds = round_trip + records * record_time */
+    variance = tuning->records2 - tuning->records * tuning->records;
+    slope = intercept = 0.0;
+    if (variance > 1e-6 * tuning->records2) {
+        slope = (tuning->records_seconds
+                 - tuning->records * tuning->seconds) / variance;
+        intercept = tuning->seconds - slope * tuning->records;
+    }
+
+    if (slope > 0.0 && intercept > 0.0) {
+        tuning->round_trip = intercept;
+        tuning->record_time = slope;
+    }
+
+    /*
+     * Until the costs can be told apart, from presents of different sizes,
+     * larger presents can only be better: grow.
+     */
+    chunk = tuning->round_trip > 0.0
+        ? ceil (RBZ_TUNING_RATIO * tuning->round_trip / tuning->record_time)
+        : tuning->chunk * 2.0;
+
+    connection = rbz_connection_get (obj);
+    chunk = MIN (chunk, rbz_tuning_limit (connection,
+                                          tuning->bytes_per_record));
+    tuning->chunk = (long) MAX (chunk, RBZ_TUNING_MIN_CHUNK);
+
+    snprintf (value, sizeof value, "%ld", tuning->chunk);
+    ZOOM_connection_option_set (connection, "presentChunk", value);
+}
+
+/*
+ * call-seq:
+ * 	auto_tune = enabled
+ *
+ * enabled: true to size the presentChunk option automatically.
+ *
+ * With automatic tuning, the time and size of each present of the
+ * connection are measured, and the presentChunk option is adjusted after
+ * each one, to get as many records per second from the target as possible
+ * with as few records per present as needed.  The chunk never goes over
+ * what fits in preferredMessageSize and maximumRecordSize.  Records read
+ * ahead by ZOOM::ResultSet#prefetch are not measured.
+ *
+ * Result sets with a presentChunk option of their own keep it.  Disabling
+ * tuning leaves the presentChunk option as it was last set.
+ *
+ * Returns: enabled.
+ */
+static VALUE
+rbz_tuning_set_enabled (VALUE self, VALUE enabled)
+{
+    struct rbz_tuning *tuning;
+    VALUE obj;
+
+    if (!RVAL2CBOOL (enabled)) {
+        rb_ivar_set (self, id_tuning, Qnil);
+        return enabled;
+    }
+    if (rbz_tuning_p (self))
+        return enabled;
+
+    obj = TypedData_Make_Struct (0, struct rbz_tuning, &rbz_tuning_data_type,
+                                 tuning);
+    tuning->chunk = rbz_tuning_option (rbz_connection_get (self),
+                                       "presentChunk", 20);
+    rb_ivar_set (self, id_tuning, obj);
+
+    return enabled;
+}
+
+/*
+ * Returns: whether the presentChunk option is sized automatically.
+ */
+static VALUE
+rbz_tuning_enabled (VALUE self)
+{
+    return CBOOL2RVAL (rbz_tuning_p (self));
+}
+
+/*
+ * call-seq:
+ * 	tuning
+ *
+ * Returns: nil without ZOOM::Connection#auto_tune, or a Hash with the
+ * values chosen and what they were chosen from: :present_chunk, the
+ * current presentChunk; :samples, the number of presents measured;
+ * :bytes_per_record, the average size of the records; :records_per_second,
+ * the average rate of the presents; :round_trip and :record_time, the
+ * estimated fixed cost of a present and cost of each record in it, in
+ * seconds, or nil until the presents are varied enough to tell.
+ */
+static VALUE
+rbz_tuning_stats (VALUE self)
+{
+    struct rbz_tuning *tuning;
+    VALUE hash;
+
+    tuning = rbz_tuning_get (self);
+    if (tuning == NULL)
+        return Qnil;
+
+    hash = rb_hash_new ();
+    rb_hash_aset (hash, ID2SYM (rb_intern ("present_chunk")),
+                  LONG2NUM (tuning->chunk));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("samples")),
+                  SIZET2NUM (tuning->samples));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("bytes_per_record")),
+                  rb_float_new (tuning->bytes_per_record));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("records_per_second")),
+                  rb_float_new (tuning->seconds > 0.0
+                                ? tuning->records / tuning->seconds : 0.0));
+    rb_hash_aset (hash, ID2SYM (rb_intern ("round_trip")),
+                  tuning->round_trip > 0.0
+                      ? rb_float_new (tuning->round_trip) : Qnil);
+    rb_hash_aset (hash, ID2SYM (rb_intern ("record_time")),
+                  tuning->round_trip > 0.0
+                      ? rb_float_new (tuning->record_time) : Qnil);
+
+    return hash;
+}
+
+void
+Init_zoom_tuning (VALUE mZoom)
+{
+    VALUE c;
+
+    id_tuning = rb_intern ("__tuning__");
+
+    c = rb_const_get (mZoom, rb_intern ("Connection"));
+    rb_define_method (c, "auto_tune=", rbz_tuning_set_enabled, 1);
+    rb_define_method (c, "auto_tune?", rbz_tuning_enabled, 0);
+    rb_define_method (c, "tuning", rbz_tuning_stats, 0);
+}
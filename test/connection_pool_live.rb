@@ -0,0 +1,103 @@
+require File.expand_path('ztest_helper', File.dirname(__FILE__))
+
+class ConnectionPoolLiveTest < Test::Unit::TestCase
+
+  include ZtestServer
+
+  TARGET = 'localhost:9999/Default'
+
+  def setup
+    start_ztest
+  end
+
+  def teardown
+    stop_ztest
+  end
+
+  def test_connections_are_reused
+    pool = ZOOM::ConnectionPool.new
+    first = pool.with(TARGET) { |conn| conn }
+    second = pool.with(TARGET, 'preferredRecordSyntax' => 'USMARC') do |conn|
+      assert_equal 'USMARC', conn.preferred_record_syntax
+      assert_equal 1, conn.search('@attr 1=4 1').size
+      conn
+    end
+
+    assert_same first, second
+    stats = pool.stats
+    assert_equal 2, stats[:checkouts]
+    assert_equal 1, stats[:creates]
+    assert_equal 1, stats[:idle]
+    assert_equal 0, stats[:busy]
+  end
+
+  def test_options_are_reset_on_checkin
+    pool = ZOOM::ConnectionPool.new
+    first = pool.with(TARGET, 'elementSetName' => 'B') do |conn|
+      conn.preferred_record_syntax = 'XML'
+      conn.auto_tune = true
+      conn
+    end
+    second = pool.with(TARGET) do |conn|
+      assert_nil conn.get_option('preferredRecordSyntax')
+      assert_nil conn.get_option('elementSetName')
+      assert !conn.auto_tune?
+      conn
+    end
+    assert_same first, second
+  end
+
+  def test_targets_are_kept_apart
+    pool = ZOOM::ConnectionPool.new
+    default = pool.checkout(TARGET)
+    other = pool.checkout(TARGET, 'user' => 'someone')
+    assert_not_same default, other
+    pool.checkin(default)
+    pool.checkin(other)
+    assert_equal 2, pool.stats[:creates]
+  end
+
+  def test_symbol_credentials_are_kept_apart
+    pool = ZOOM::ConnectionPool.new
+    alice = pool.checkout(TARGET, :user => 'alice', :password => 'a')
+    pool.checkin(alice)
+    bob = pool.checkout(TARGET, :user => 'bob', :password => 'b')
+    assert_not_same alice, bob
+    pool.checkin(bob)
+    assert_same alice, pool.checkout(TARGET, 'user' => 'alice',
+                                     :password => 'a')
+    assert_equal 2, pool.stats[:creates]
+  end
+
+  def test_max_per_target
+    pool = ZOOM::ConnectionPool.new(:max_per_target => 1,
+                                    :checkout_timeout => 0.5)
+    conn = pool.checkout(TARGET)
+    assert_raise(RuntimeError) { pool.checkout(TARGET) }
+
+    waiter = Thread.new { pool.with(TARGET) { |c| c } }
+    sleep 0.1
+    pool.checkin(conn)
+    assert_same conn, waiter.value
+    assert_equal 2, pool.stats[:waits]
+  end
+
+  def test_idle_eviction
+    pool = ZOOM::ConnectionPool.new(:idle_timeout => 0.1)
+    conn = pool.with(TARGET) { |c| c }
+    sleep 0.2
+    assert_equal 1, pool.evict_idle
+    assert_equal 1, pool.stats[:evictions]
+    assert_equal 0, pool.stats[:idle]
+    assert conn.closed?
+  end
+
+  def test_closed_connections_are_dropped
+    pool = ZOOM::ConnectionPool.new
+    first = pool.with(TARGET) { |conn| conn.close; conn }
+    assert_equal 1, pool.stats[:evictions]
+    assert_equal 0, pool.stats[:idle]
+    assert_not_same first, pool.with(TARGET) { |conn| conn }
+  end
+
+end
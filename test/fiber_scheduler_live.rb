@@ -0,0 +1,97 @@
+require File.expand_path('ztest_helper', File.dirname(__FILE__))
+
+class FiberSchedulerLiveTest < Test::Unit::TestCase
+
+  # yaz-ztest answers a numeric search term with that many hits.
+
+  include ZtestServer
+
+  # A minimal fiber scheduler, which only knows how to wait for IO.
+  class Scheduler
+    attr_reader :io_waits
+
+    def initialize
+      @waiting = {}
+      @io_waits = 0
+    end
+
+    def io_wait(io, events, timeout)
+      @io_waits += 1
+      @waiting[Fiber.current] = [io, events]
+      Fiber.yield
+    end
+
+    def fiber(&block)
+      fiber = Fiber.new(:blocking => false, &block)
+      fiber.resume
+      fiber
+    end
+
+    def run
+      until @waiting.empty?
+        readers = @waiting.select { |_, (_, ev)| ev & IO::READABLE != 0 }
+        writers = @waiting.select { |_, (_, ev)| ev & IO::WRITABLE != 0 }
+        readable, writable = IO.select(readers.map { |_, (io, _)| io },
+                                       writers.map { |_, (io, _)| io })
+        @waiting.to_a.each do |fiber, (io, events)|
+          ready = 0
+          ready |= IO::READABLE if readable.include?(io)
+          ready |= IO::WRITABLE if writable.include?(io)
+          ready &= events
+          next if ready == 0
+          @waiting.delete(fiber)
+          fiber.resume(ready)
+        end
+      end
+    end
+
+    def close
+      run
+    end
+
+    def block(blocker, timeout = nil)
+      raise NotImplementedError
+    end
+
+    def unblock(blocker, fiber)
+      raise NotImplementedError
+    end
+
+    def kernel_sleep(duration = nil)
+      raise NotImplementedError
+    end
+  end
+
+  def setup
+    start_ztest
+  end
+
+  def teardown
+    stop_ztest
+  end
+
+  def test_fibers_share_a_thread
+    scheduler = Scheduler.new
+    events = []
+    Thread.new do
+      Fiber.set_scheduler(scheduler)
+      1.upto(3) do |i|
+        Fiber.schedule do
+          events << :connect
+          conn = ZOOM::Connection.new('preferredRecordSyntax' => 'USMARC')
+          conn.connect('localhost:9999/Default')
+          conn.search("@attr 1=4 #{i}") do |rset|
+            events << [rset.size, rset[0].raw.empty?]
+          end
+          conn.close
+        end
+      end
+    end.join
+
+    # The connections were established concurrently, from a single thread.
+    assert_equal [:connect] * 3, events.first(3)
+    assert_equal [[1, false], [2, false], [3, false]], events.drop(3).sort
+    assert(scheduler.io_waits >= 6)
+  end
+
+end
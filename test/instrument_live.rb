@@ -0,0 +1,74 @@
+require File.expand_path('ztest_helper', File.dirname(__FILE__))
+
+class InstrumentLiveTest < Test::Unit::TestCase
+
+  include ZtestServer
+
+  def setup
+    start_ztest
+
+    @events = []
+    @subscriber = ZOOM.subscribe { |event| @events << event }
+  end
+
+  def teardown
+    ZOOM.unsubscribe(@subscriber)
+    stop_ztest
+  end
+
+  def test_operations_are_reported
+    conn = ZOOM::Connection.open('localhost:9999/Default')
+    conn.preferred_record_syntax = 'USMARC'
+    rset = conn.search('@attr 1=4 5')
+    records = rset[0, 3]
+
+    assert_equal [:connect, :search, :present], @events.map { |e| e.name }
+    @events.each do |event|
+      assert_equal 0, event.error
+      assert_kind_of Float, event.duration
+      assert(event.duration >= 0)
+    end
+
+    search = @events[1]
+    assert_equal 5, search.records
+    present = @events[2]
+    assert_equal 3, present.records
+    assert_equal records.map { |record| record.raw.bytesize }.inject(:+),
+                 present.bytes
+  end
+
+  def test_errors_are_reported
+    conn = ZOOM::Connection.open('localhost:9999/Default')
+    assert_raise(RuntimeError) { conn.search('@attr 1=4 @and') }
+    assert_not_equal 0, @events.last.error
+  end
+
+  def test_raising_subscriber
+    conn = ZOOM::Connection.open('localhost:9999/Default')
+    failing = ZOOM.subscribe do |event|
+      raise ArgumentError, 'subscriber' if event.name == :search
+    end
+    assert_raise(ArgumentError) { conn.search('@attr 1=4 5') }
+    ZOOM.unsubscribe(failing)
+    assert_equal 5, conn.search('@attr 1=4 5').size
+  end
+
+  def test_multiplexed_searches_are_reported
+    targets = (1..2).map { ZOOM::Connection.open('localhost:9999/Default') }
+    @events.clear
+    mux = ZOOM::Multiplexer.new
+    targets.each_with_index { |conn, i| mux.add(conn, "@attr 1=4 #{i + 1}") }
+    mux.count
+
+    assert_equal [:search, :search], @events.map { |e| e.name }
+    assert_equal [1, 2], @events.map { |e| e.records }.sort
+  end
+
+  def test_unsubscribe
+    assert_same @subscriber, ZOOM.unsubscribe(@subscriber)
+    assert_nil ZOOM.unsubscribe(@subscriber)
+    ZOOM::Connection.open('localhost:9999/Default').search('@attr 1=4 1')
+    assert @events.empty?
+  end
+
+end
@@ -0,0 +1,59 @@
+require File.expand_path('ztest_helper', File.dirname(__FILE__))
+
+class MetricsLiveTest < Test::Unit::TestCase
+
+  include ZtestServer
+
+  TARGET = 'localhost:9999/Default'
+
+  def setup
+    start_ztest
+
+    ZOOM.reset_metrics
+    ZOOM.metrics_enabled = true
+  end
+
+  def teardown
+    ZOOM.metrics_enabled = false
+    stop_ztest
+  end
+
+  def test_counters_and_histograms
+    conn = ZOOM::Connection.open(TARGET)
+    conn.preferred_record_syntax = 'USMARC'
+    2.times { conn.search('@attr 1=4 5')[0, 3] }
+    assert_raise(RuntimeError) { conn.search('@attr 1=4 @and') }
+
+    assert_equal 1, ZOOM.metrics.size
+    metrics = ZOOM.metrics.values.first
+    assert_equal 1, metrics[:connect]
+    assert_equal 3, metrics[:search]
+    assert_equal 2, metrics[:present]
+    assert_equal 6, metrics[:records]
+    assert(metrics[:bytes] > 0)
+    assert_equal 1, metrics[:errors].values.inject(:+)
+
+    search = metrics[:latency][:search]
+    assert_equal 3, search[:count]
+    assert_equal 3, search[:buckets][Float::INFINITY]
+    assert_equal search[:buckets].values, search[:buckets].values.sort
+  end
+
+  def test_prometheus_text
+    ZOOM::Connection.open(TARGET).search('@attr 1=4 1')
+    text = ZOOM.metrics_text
+    assert_match(/^# TYPE zoom_operation_duration_seconds histogram$/, text)
+    assert_match(/^zoom_operations_total\{target="[^"]*",operation="search"\} 1$/,
+                 text)
+    assert_match(/^zoom_operation_duration_seconds_bucket\{.*operation="search",le="\+Inf"\} 1$/,
+                 text)
+  end
+
+  def test_disabled
+    ZOOM.metrics_enabled = false
+    ZOOM::Connection.open(TARGET).search('@attr 1=4 1')
+    assert ZOOM.metrics.empty?
+    assert_equal '', ZOOM.metrics_text
+  end
+
+end
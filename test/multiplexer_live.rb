@@ -0,0 +1,127 @@
+require File.expand_path('ztest_helper', File.dirname(__FILE__))
+
+class MultiplexerLiveTest < Test::Unit::TestCase
+
+  # Runs federated searches against a local yaz-ztest, where searches in
+  # the "Slow" database take about 3 seconds and searches in "Default"
+  # return at once.
+
+  include ZtestServer
+
+  def setup
+    start_ztest
+  end
+
+  def teardown
+    stop_ztest
+  end
+
+  def connection(database)
+    conn = ZOOM::Connection.new
+    conn.preferred_record_syntax = 'USMARC'
+    conn.connect("localhost:9999/#{database}")
+  end
+
+  def test_targets_run_concurrently
+    mux = ZOOM::Multiplexer.new
+    slow = (1..3).map { connection('Slow') }
+    slow.each { |conn| mux.add(conn, '@attr 1=4 water') }
+
+    started = Time.now
+    results = mux.run
+    elapsed = Time.now - started
+
+    assert_equal 3, results.size
+    results.each_value { |rset| assert_kind_of ZOOM::ResultSet, rset }
+    # One after another, this would take about 9 seconds.
+    assert(elapsed < 6)
+  end
+
+  def test_unconnected_targets_are_connected
+    mux = ZOOM::Multiplexer.new
+    slow = (1..3).map do
+      ZOOM::Connection.new('host' => 'localhost:9999/Slow',
+                           'preferredRecordSyntax' => 'USMARC')
+    end
+    slow.each { |conn| mux.add(conn, '@attr 1=4 water') }
+
+    started = Time.now
+    results = mux.run
+    assert(Time.now - started < 6)
+    results.each_value { |rset| assert_kind_of ZOOM::ResultSet, rset }
+  end
+
+  def test_fast_targets_yield_first
+    mux = ZOOM::Multiplexer.new
+    slow = connection('Slow')
+    fast = connection('Default')
+    mux.add(slow, '@attr 1=4 water')
+    mux.add(fast, '@attr 1=4 water')
+
+    order = []
+    mux.run { |conn, result| order << conn }
+    assert_equal [fast, slow], order
+  end
+
+  def test_timeouts_give_partial_results
+    mux = ZOOM::Multiplexer.new
+    slow = connection('Slow')
+    fast = connection('Default')
+    mux.add(slow, '@attr 1=4 water', 1)
+    mux.add(fast, '@attr 1=4 water', 1)
+
+    results = mux.run
+    assert_kind_of RuntimeError, results[slow]
+    assert_kind_of ZOOM::ResultSet, results[fast]
+    assert(results[fast].size > 0)
+
+    # Back in synchronous mode once the multiplexer is done.
+    assert_not_nil results[fast][0]
+  end
+
+  def test_connections_are_added_once
+    conn = connection('Default')
+    mux = ZOOM::Multiplexer.new
+    mux.add(conn, '@attr 1=4 1')
+    assert_raise(ArgumentError) { mux.add(conn, '@attr 1=4 2') }
+    assert_equal 1, mux.size
+  end
+
+  def test_running_targets_cannot_be_closed
+    targets = [connection('Default'), connection('Slow')]
+    mux = ZOOM::Multiplexer.new
+    targets.each { |conn| mux.add(conn, '@attr 1=4 1') }
+
+    first = true
+    mux.run do |conn, result|
+      other = (targets - [conn]).first
+      assert_raise(IOError) { other.close } if first
+      first = false
+    end
+    targets.each { |conn| conn.close }
+    assert targets.all? { |conn| conn.closed? }
+  end
+
+  def test_count
+    mux = ZOOM::Multiplexer.new
+    targets = (1..3).map { connection('Default') }
+    targets.each { |conn| conn.small_set_upper_bound = 10 }
+    targets.each_with_index { |conn, i| mux.add(conn, "@attr 1=4 #{i + 1}") }
+
+    counts = {}
+    assert_equal counts, mux.count { |conn, result| counts[conn] = result }
+    assert_equal [1, 2, 3], targets.map { |conn| counts[conn] }
+    targets.each { |conn| assert_equal 10, conn.small_set_upper_bound }
+  end
+
+  def test_count_with_invalid_query
+    conn = connection('Default')
+    conn.small_set_upper_bound = 10
+    mux = ZOOM::Multiplexer.new
+    mux.add(conn, '@and ruby')
+
+    assert_raise(ArgumentError) { mux.count }
+    assert_equal 10, conn.small_set_upper_bound
+  end
+
+end
@@ -0,0 +1,63 @@
+class OptionsTest < Test::Unit::TestCase
+
+  def setup
+    @conn = ZOOM::Connection.new
+  end
+
+  def test_accessors
+    @conn.database_name = 'Default'
+    assert_equal 'Default', @conn.database_name
+    assert_equal 'Default', @conn.get_option('databaseName')
+    assert_same @conn, @conn.set_preferred_record_syntax('USMARC')
+    assert_equal 'USMARC', @conn.get_option('preferredRecordSyntax')
+    @conn.present_chunk = 20
+    assert_equal 20, @conn.present_chunk
+    assert_nil @conn.schema
+  end
+
+  def test_booleans
+    @conn.piggyback = false
+    assert_equal 0, @conn.piggyback
+    @conn.set_option('async', true)
+    assert_equal 1, @conn.async
+  end
+
+  def test_auto_tune
+    assert !@conn.auto_tune?
+    assert_nil @conn.tuning
+    @conn.present_chunk = 50
+    @conn.auto_tune = true
+    assert @conn.auto_tune?
+    assert_equal 50, @conn.tuning[:present_chunk]
+    assert_equal 0, @conn.tuning[:samples]
+    assert_nil @conn.tuning[:round_trip]
+    assert_equal [], @conn.instance_variables
+    @conn.auto_tune = false
+    assert_nil @conn.tuning
+  end
+
+  def test_set_options
+    assert_same @conn, @conn.set_options(:database_name => 'Voyager',
+                                         'elementSetName' => 'F',
+                                         :user => 'me',
+                                         :count => 5)
+    assert_equal 'Voyager', @conn.database_name
+    assert_equal 'F', @conn.element_set_name
+    assert_equal 'me', @conn.user
+    assert_equal 5, @conn.count
+  end
+
+  def test_new_with_options
+    conn = ZOOM::Connection.new(:database_name => 'Voyager', 'count' => 3)
+    assert_equal 'Voyager', conn.database_name
+    assert_equal 3, conn.count
+  end
+
+  def test_package_options
+    package = @conn.package
+    package.set_options(:contact_name => 'me', :action => 'update')
+    assert_equal 'me', package.contact_name
+    assert_equal 'update', package.get_option('action')
+  end
+
+end
@@ -38,4 +38,19 @@ class TestPackage < Test::Unit::TestCase
       assert_equal('correlation_info_note value', p.correlation_info_note)
   end
 
+  def test_destroy
+      p = @connection.package
+      assert(!p.destroyed?)
+      assert_nil(p.destroy)
+      assert(p.destroyed?)
+      assert_raise(IOError) { p.action = 'update' }
+      assert_nil(p.destroy)
+  end
+
+  def test_send_on_closed_connection
+      p = @connection.package
+      @connection.close
+      assert_raise(IOError) { p.send('create') }
+  end
+
 end
@@ -0,0 +1,83 @@
+class QueryTest < Test::Unit::TestCase
+
+  def setup
+    ZOOM::Query.clear_cache
+    @cache_size = ZOOM::Query.cache_size
+  end
+
+  def teardown
+    ZOOM::Query.cache_size = @cache_size
+  end
+
+  def test_queries_are_parsed_once
+    query = ZOOM::Query.new_prefix('@attr 1=4 ruby')
+    assert_same query, ZOOM::Query.new_prefix('@attr 1=4 ruby')
+    assert_not_same query, ZOOM::Query.new_cql('@attr 1=4 ruby')
+
+    stats = ZOOM::Query.cache_stats
+    assert_equal 2, stats[:entries]
+    assert(stats[:hits] >= 1)
+  end
+
+  def test_cache_is_bounded
+    ZOOM::Query.cache_size = 2
+    first = ZOOM::Query.new_prefix('@attr 1=4 a')
+    ZOOM::Query.new_prefix('@attr 1=4 b')
+    ZOOM::Query.new_prefix('@attr 1=4 c')
+    assert_equal 2, ZOOM::Query.cache_stats[:entries]
+    assert_not_same first, ZOOM::Query.new_prefix('@attr 1=4 a')
+
+    ZOOM::Query.cache_size = 0
+    assert_not_same ZOOM::Query.new_prefix('@attr 1=4 d'),
+                    ZOOM::Query.new_prefix('@attr 1=4 d')
+  end
+
+  def test_invalid_prefix
+    assert_raise(ArgumentError) { ZOOM::Query.new_prefix('@and ruby') }
+    assert_equal 0, ZOOM::Query.cache_stats[:entries]
+  end
+
+  def test_template
+    template = ZOOM::Query.template('@and @attr 1=4 %s @attr 1=1003 %s')
+    assert_equal '@and @attr 1=4 "ruby" @attr 1=1003 "a \"b\" \\\\ c"',
+                 template.notation('ruby', 'a "b" \\ c')
+    assert_same template.query('ruby', 12), template['ruby', 12]
+    assert_raise(ArgumentError) { template.query('ruby') }
+  end
+
+  def test_cql_template
+    template = ZOOM::Query.template('title=%s and rate>10%%', :syntax => :cql)
+    assert_equal 'title="ruby" and rate>10%', template.notation('ruby')
+    assert_same ZOOM::Query.new_cql('title="ruby" and rate>10%'),
+                template.query('ruby')
+  end
+
+  def test_invalid_template
+    assert_raise(ArgumentError) { ZOOM::Query.template('@attr 1=4 %d') }
+    assert_raise(ArgumentError) do
+      ZOOM::Query.template('%s', :syntax => :sql)
+    end
+  end
+
+  def test_sort_by
+    query = ZOOM::Query.new_prefix('@attr 1=4 ruby')
+    sorted = query.sort_by('1=4 <')
+    assert_kind_of ZOOM::Query, sorted
+    assert_not_same query, sorted
+    assert_same sorted, query.sort_by('1=4 <')
+    assert_same query.sort_by('1=31 >'), sorted.sort_by('1=31 >')
+    assert_same sorted, ZOOM::Query.new_sort_by('1=4 <', '@attr 1=4 ruby')
+    assert_same sorted, ZOOM::Query.new_sort_by('1=4 <', query)
+
+    cql = ZOOM::Query.new_cql('title=ruby').sort_by('1=4 <')
+    assert_not_same cql, sorted
+  end
+
+  def test_new_sort_by
+    assert_kind_of ZOOM::Query, ZOOM::Query.new_sort_by('1=4 <')
+    assert_raise(ArgumentError) do
+      ZOOM::Query.new_sort_by('1=4 <').sort_by('1=4 >')
+    end
+  end
+
+end
@@ -0,0 +1,18 @@
+class RecordFormatTest < Test::Unit::TestCase
+
+  def test_type
+    assert_equal 'xml', ZOOM::RecordFormat.new('xml').to_s
+    assert_equal 'xml; charset=marc8', ZOOM::RecordFormat.new('xml', 'marc8').to_s
+    format = ZOOM::RecordFormat.new('render', 'marc8', 'utf-8')
+    assert_equal 'render; charset=marc8,utf-8', format.to_s
+    assert format.frozen?
+    assert format.to_s.frozen?
+  end
+
+  def test_charset_names_too_long
+    assert_raise(ArgumentError) do
+      ZOOM::RecordFormat.new('xml', 'x' * 200)
+    end
+  end
+
+end
@@ -0,0 +1,71 @@
+require 'fileutils'
+require 'tmpdir'
+require File.expand_path('ztest_helper', File.dirname(__FILE__))
+
+class RecordStoreLiveTest < Test::Unit::TestCase
+
+  include ZtestServer
+
+  def setup
+    start_ztest
+
+    @dir = Dir.mktmpdir
+    @conn = ZOOM::Connection.open('localhost:9999/Default')
+    @conn.preferred_record_syntax = 'USMARC'
+
+    # Counts what is really sent to the target.
+    @sent = Hash.new(0)
+    @subscriber = ZOOM.subscribe { |event| @sent[event.name] += 1 }
+  end
+
+  def teardown
+    ZOOM.unsubscribe(@subscriber)
+    FileUtils.remove_entry(@dir)
+    stop_ztest
+  end
+
+  def test_records_are_read_back
+    path = File.join(@dir, 'records.zrs')
+    raw = ZOOM::RecordStore.open(path) do |store|
+      rset = @conn.search('@attr 1=4 12')
+      rset.record_store = store
+      rset[0, 5].map { |record| record.raw }
+    end
+    assert_equal 1, @sent[:present]
+
+    ZOOM::RecordStore.open(path) do |store|
+      rset = @conn.search('@attr 1=4 12')
+      rset.record_store = store
+      records = rset[0, 5]
+      assert_equal raw, records.map { |record| record.raw }
+      assert_equal raw[3], rset[3].raw
+      assert_equal 'USmarc', records.first.syntax
+      assert_match(/<record/, records.first.xml)
+      assert_equal 1, @sent[:present]
+
+      rset[5, 2]
+      assert_equal 2, @sent[:present]
+    end
+  end
+
+  def test_records_in_another_syntax_are_not_read_back
+    ZOOM::RecordStore.open(File.join(@dir, 'records.zrs')) do |store|
+      rset = @conn.search('@attr 1=4 12')
+      rset.record_store = store
+      rset[0, 5]
+      assert_equal 1, @sent[:present]
+
+      rset = @conn.search('@attr 1=4 12')
+      rset.record_store = store
+      rset.preferred_record_syntax = 'XML'
+      rset[0, 5]
+      assert_equal 2, @sent[:present]
+    end
+  end
+
+  def test_invalid_store
+    rset = @conn.search('@attr 1=4 12')
+    assert_raise(ArgumentError) { rset.record_store = 'records.zrs' }
+  end
+
+end
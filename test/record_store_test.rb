@@ -0,0 +1,80 @@
+require 'fileutils'
+require 'tmpdir'
+
+class RecordStoreTest < Test::Unit::TestCase
+
+  def setup
+    @dir = Dir.mktmpdir
+    @path = File.join(@dir, 'records.zrs')
+  end
+
+  def teardown
+    FileUtils.remove_entry(@dir)
+  end
+
+  def test_read_back_after_reopening
+    ZOOM::RecordStore.open(@path) do |store|
+      store['a'] = "\x00\x01record"
+      store['b'] = 'first'
+      store['b'] = 'second'
+      assert_equal 2, store.size
+    end
+
+    ZOOM::RecordStore.open(@path) do |store|
+      assert_equal 2, store.size
+      assert_equal "\x00\x01record".b, store['a']
+      assert_equal 'second', store['b']
+      assert store['b'].frozen?
+      assert store.include?('a')
+      assert_nil store['c']
+    end
+  end
+
+  def test_torn_entry_is_cut_off
+    ZOOM::RecordStore.open(@path) do |store|
+      store['a'] = 'kept'
+      store['b'] = 'x' * 100
+    end
+    File.truncate(@path, File.size(@path) - 50)
+
+    ZOOM::RecordStore.open(@path) do |store|
+      assert_equal 1, store.size
+      assert_equal 'kept', store['a']
+      store['c'] = 'after'
+    end
+    ZOOM::RecordStore.open(@path) { |store| assert_equal 'after', store['c'] }
+  end
+
+  def test_corrupted_entry_is_cut_off
+    ZOOM::RecordStore.open(@path) do |store|
+      store['a'] = 'kept'
+      store['b'] = 'corrupted'
+    end
+    data = File.binread(@path)
+    File.binwrite(@path, data.sub('corrupted', 'CORRUPTED'))
+
+    ZOOM::RecordStore.open(@path) do |store|
+      assert_equal 'kept', store['a']
+      assert_nil store['b']
+    end
+  end
+
+  def test_not_a_store
+    File.write(@path, 'something else')
+    assert_raise(RuntimeError) { ZOOM::RecordStore.new(@path) }
+  end
+
+  def test_closed
+    store = ZOOM::RecordStore.new(@path)
+    store.close
+    assert store.closed?
+    assert_raise(IOError) { store['a'] }
+  end
+
+  def test_invalid_key
+    ZOOM::RecordStore.open(@path) do |store|
+      assert_raise(ArgumentError) { store["a\0b"] = 'data' }
+    end
+  end
+
+end
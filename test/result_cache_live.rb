@@ -0,0 +1,101 @@
+require File.expand_path('ztest_helper', File.dirname(__FILE__))
+
+class ResultCacheLiveTest < Test::Unit::TestCase
+
+  include ZtestServer
+
+  def setup
+    start_ztest
+
+    @conn = ZOOM::Connection.open('localhost:9999/Default')
+    @conn.preferred_record_syntax = 'USMARC'
+
+    # Counts what is really sent to the target.
+    @sent = Hash.new(0)
+    @subscriber = ZOOM.subscribe { |event| @sent[event.name] += 1 }
+  end
+
+  def teardown
+    ZOOM.unsubscribe(@subscriber)
+    stop_ztest
+  end
+
+  def test_repeated_search
+    @conn.result_cache = ZOOM::ResultCache.new(:page => 5)
+    raw = @conn.search('@attr 1=4 12')[0, 5].map { |record| record.raw }
+
+    rset = @conn.search('  @attr 1=4   12 ')
+    assert_equal 12, rset.size
+    assert_equal raw, rset[0, 5].map { |record| record.raw }
+    assert_equal raw[2], rset[2].raw
+    assert_equal 1, @sent[:search]
+    assert_equal 1, @sent[:present]
+
+    stats = @conn.result_cache.stats
+    assert_equal 1, stats[:hits]
+    assert_equal 1, stats[:misses]
+    assert_equal 1, stats[:entries]
+  end
+
+  def test_count
+    @conn.result_cache = ZOOM::ResultCache.new
+    assert_equal 12, @conn.count('@attr 1=4 12')
+    assert_equal 12, @conn.count('@attr 1=4 12')
+    assert_equal 12, @conn.search('@attr 1=4 12').size
+    assert_equal 1, @sent[:search]
+    assert_equal 0, @sent[:present]
+  end
+
+  def test_asynchronous_searches_are_not_cached
+    @conn.result_cache = ZOOM::ResultCache.new
+    @conn.set_option('async', true)
+    @conn.search('@attr 1=4 12')
+    @conn.set_option('async', false)
+    assert_equal 12, @conn.search('@attr 1=4 12').size
+    assert_equal 0, @conn.result_cache.stats[:hits]
+  end
+
+  def test_search_is_sent_past_the_first_page
+    @conn.result_cache = ZOOM::ResultCache.new(:page => 5)
+    @conn.search('@attr 1=4 12')[0, 5]
+    rset = @conn.search('@attr 1=4 12')
+    assert_equal 7, rset[5, 7].length
+    assert_equal 2, @sent[:search]
+  end
+
+  def test_key_includes_record_syntax
+    @conn.result_cache = ZOOM::ResultCache.new
+    @conn.search('@attr 1=4 3')
+    @conn.preferred_record_syntax = 'XML'
+    @conn.search('@attr 1=4 3')
+    assert_equal 2, @sent[:search]
+    assert_equal 2, @conn.result_cache.stats[:entries]
+  end
+
+  def test_records_in_another_syntax_are_not_cached
+    @conn.result_cache = ZOOM::ResultCache.new(:page => 5)
+    rset = @conn.search('@attr 1=4 3')
+    rset.preferred_record_syntax = 'XML'
+    rset[0, 3]
+    @conn.search('@attr 1=4 3')[0, 3]
+    assert_equal 2, @sent[:present]
+  end
+
+  def test_ttl
+    @conn.result_cache = ZOOM::ResultCache.new(:ttl => 0.1)
+    @conn.search('@attr 1=4 3')
+    sleep 0.2
+    @conn.search('@attr 1=4 3')
+    assert_equal 2, @sent[:search]
+    assert_equal 1, @conn.result_cache.stats[:expirations]
+  end
+
+  def test_max_bytes
+    @conn.result_cache = ZOOM::ResultCache.new(:max_bytes => 4096)
+    (1..20).each { |n| @conn.search("@attr 1=4 #{n}")[0, 10] }
+    stats = @conn.result_cache.stats
+    assert(stats[:bytes] <= 4096)
+    assert(stats[:evictions] > 0)
+  end
+
+end
@@ -0,0 +1,250 @@
+require File.expand_path('ztest_helper', File.dirname(__FILE__))
+
+class ResultSetLiveTest < Test::Unit::TestCase
+
+  # yaz-ztest answers a numeric search term with that many hits, and
+  # makes up MARC records for any position in the result set.
+
+  include ZtestServer
+
+  def setup
+    start_ztest
+
+    @conn = ZOOM::Connection.open('localhost:9999/Default')
+    @conn.preferred_record_syntax = 'USMARC'
+  end
+
+  def teardown
+    stop_ztest
+  end
+
+  def test_each_record_in_chunks
+    rset = @conn.search('@attr 1=4 45')
+    rset.present_chunk = 10
+    count = 0
+    assert_equal rset, rset.each_record { |record| count += 1 }
+    assert_equal 45, count
+  end
+
+  def test_each_record_enumerator
+    rset = @conn.search('@attr 1=4 12')
+    enum = rset.each_record
+    assert_kind_of Enumerator, enum
+    assert_equal 12, enum.size
+    assert_equal 3, enum.first(3).length
+  end
+
+  def test_each_slice
+    rset = @conn.search('@attr 1=4 25')
+    sizes = rset.each_slice(10).map { |records| records.length }
+    assert_equal [10, 10, 5], sizes
+  end
+
+  def test_prefetch_sequential_pages
+    rset = @conn.search('@attr 1=4 60')
+    rset.present_chunk = 30
+    rset.prefetch = 2
+    pages = (0...6).map { |page| rset[page * 10, 10] }
+    assert_equal [10] * 6, pages.map { |records| records.length }
+    # Only the first page has to wait, every later one was read ahead.
+    assert_equal({ :hits => 5, :misses => 1 }, rset.prefetch_stats)
+  end
+
+  def test_borrowed_records
+    rset = @conn.search('@attr 1=4 5')
+    rset.borrow_records = true
+    records = rset[0, 5]
+    raw = records.map { |record| record.raw }
+    assert records.all? { |record| record.borrowed? }
+
+    # The records keep their result set alive.
+    rset = nil
+    GC.start
+    assert_equal raw, records.map { |record| record.raw }
+    assert_equal raw.first, records.first.get('raw', true)
+    assert records.first.borrowed?
+
+    record = records.first.detach
+    assert !record.borrowed?
+    assert_equal raw.first, record.raw
+  end
+
+  def test_destroy
+    rset = @conn.search('@attr 1=4 5')
+    rset.borrow_records = true
+    record = rset[0]
+    raw = record.raw
+    assert_nil rset.destroy
+    assert rset.destroyed?
+    assert !record.borrowed?
+    assert_equal raw, record.raw
+    assert_raise(IOError) { rset[1] }
+    assert_raise(IOError) { rset.size }
+    assert_nil rset.destroy
+  end
+
+  def test_each_field_of_borrowed_record
+    rset = @conn.search('@attr 1=4 5')
+    rset.borrow_records = true
+    record = rset[0]
+    expected = record.marc_fields
+    fields = []
+    record.each_field { |field| rset.destroy; fields << field }
+    assert_equal expected, fields
+  end
+
+  def test_search_block
+    rset = nil
+    size = @conn.search('@attr 1=4 7') { |r| rset = r; r.size }
+    assert_equal 7, size
+    assert rset.destroyed?
+  end
+
+  def test_count
+    @conn.piggyback = true
+    @conn.small_set_upper_bound = 10
+    assert_equal 7, @conn.count('@attr 1=4 7')
+    assert_equal 0, @conn.count('@attr 1=4 0')
+    assert_equal 10, @conn.small_set_upper_bound
+    assert_equal 7, @conn.search('@attr 1=4 7').size
+  end
+
+  def test_close
+    rset = @conn.search('@attr 1=4 5')
+    assert !@conn.closed?
+    assert_nil @conn.close
+    assert @conn.closed?
+    assert_raise(IOError) { @conn.search('@attr 1=4 5') }
+    assert_raise(IOError) { rset[0] }
+    assert_nil @conn.close
+
+    conn = nil
+    ZOOM::Connection.open('localhost:9999/Default') { |c| conn = c }
+    assert conn.closed?
+  end
+
+  def test_record_strings
+    record = @conn.search('@attr 1=4 1')[0]
+    raw = record.raw
+    assert_equal Encoding::ASCII_8BIT, raw.encoding
+    # ISO2709: the record length is in the first five bytes of the leader.
+    assert_equal raw[0, 5].to_i, raw.bytesize
+
+    shared = record.get('raw', true)
+    assert_equal raw, shared
+    assert shared.frozen?
+    assert_same shared, record.get('raw', true)
+    assert_not_same shared, record.get('raw')
+  end
+
+  def test_record_format
+    record = @conn.search('@attr 1=4 1')[0]
+    format = ZOOM::RecordFormat.new('render', 'marc8', 'utf-8')
+    expected = record.render('marc8', 'utf-8')
+    assert_equal expected, record.get(format)
+    assert_same record.get(format, true), record.get(format.to_s, true)
+
+    threads = (1..4).map do
+      Thread.new { (1..50).map { record.render('iso-8859-1', 'utf-8') }.uniq }
+    end
+    threads.each { |thread| assert_equal 1, thread.value.size }
+  end
+
+  def test_converted_records
+    rset = @conn.search('@attr 1=4 7')
+    assert_equal rset.records.map { |record| record.raw },
+      rset.records(:format => :raw)
+
+    expected = rset.records.map { |record| record.xml('marc8', 'utf-8') }
+    assert_equal expected,
+      rset.records(:format => :xml, :charset => %w[marc8 utf-8])
+
+    threads = (1..4).map do
+      Thread.new { rset.records(:format => 'render', :charset => 'marc8') }
+    end
+    expected = rset.records.map { |record| record.render('marc8', 'utf-8') }
+    threads.each { |thread| assert_equal expected, thread.value }
+
+    assert_raise(ArgumentError) { rset.records(:charset => []) }
+  end
+
+  def test_sort
+    rset = @conn.search('@attr 1=4 12')
+    rset.borrow_records = true
+    record = rset[0]
+    raw = record.raw
+    assert_same rset, rset.sort!('1=4 <')
+    assert_equal raw, record.raw
+    assert_equal 12, rset.size
+    assert_equal 5, rset[0, 5].size
+    assert_same rset, rset.sort!('title', 'cql')
+  end
+
+  def test_search_sorted
+    query = ZOOM::Query.new_prefix('@attr 1=4 12').sort_by('1=4 >')
+    rset = @conn.search(query)
+    assert_equal 12, rset.size
+    assert_equal 3, rset[0, 3].size
+  end
+
+  def test_harvest
+    rset = @conn.search('@attr 1=4 7')
+    expected = rset.records.map { |record| record.raw }.join
+
+    require 'tempfile'
+    Tempfile.open('harvest') do |file|
+      file.binmode
+      assert_equal 7, rset.harvest(file, :chunk => 3)
+      file.rewind
+      assert_equal expected, file.read
+    end
+
+    require 'stringio'
+    io = StringIO.new
+    assert_equal 7, rset.harvest(io, :format => :marcxml_collection)
+    assert_match(/\A<collection /, io.string)
+    assert_match(%r{</collection>\n\z}, io.string)
+  end
+
+  def test_harvest_into_full_pipe_is_interrupted
+    rset = @conn.search('@attr 1=4 2000')
+    reader, writer = IO.pipe
+
+    # nobody reads the pipe, harvest waits until the timeout
+    require 'timeout'
+    assert_raise(Timeout::Error) do
+      Timeout.timeout(1) { rset.harvest(writer) }
+    end
+    assert_equal 5, @conn.search('@attr 1=4 5').size
+  ensure
+    reader.close
+    writer.close
+  end
+
+  def test_auto_tune
+    @conn.auto_tune = true
+    @conn.preferred_message_size = 100_000
+    rset = @conn.search('@attr 1=4 500')
+    count = 0
+    rset.each_record { count += 1 }
+    assert_equal 500, count
+
+    tuning = @conn.tuning
+    assert(tuning[:samples] > 1)
+    assert(tuning[:bytes_per_record] > 0)
+    assert(tuning[:records_per_second] > 0)
+    assert(tuning[:present_chunk] >= 1)
+    assert(tuning[:present_chunk] <= 100_000 / tuning[:bytes_per_record])
+    assert_equal tuning[:present_chunk], @conn.present_chunk
+  end
+
+  def test_memsize_counts_fetched_records
+    require 'objspace'
+    rset = @conn.search('@attr 1=4 20')
+    before = ObjectSpace.memsize_of(rset)
+    assert(before > 0)
+    rset.records
+    assert(ObjectSpace.memsize_of(rset) > before)
+    assert(ObjectSpace.memsize_of(rset[0]) > 0)
+  end
+end
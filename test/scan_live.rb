@@ -0,0 +1,62 @@
+require File.expand_path('ztest_helper', File.dirname(__FILE__))
+
+class ScanLiveTest < Test::Unit::TestCase
+
+  include ZtestServer
+
+  def setup
+    start_ztest
+
+    @conn = ZOOM::Connection.open('localhost:9999/Default')
+  end
+
+  def teardown
+    stop_ztest
+  end
+
+  def test_scan
+    scan = @conn.scan('@attr 1=4 a', :number => 5)
+    assert_kind_of ZOOM::ScanSet, scan
+    assert_equal 5, scan.size
+    assert_equal 5, scan.number
+
+    terms = []
+    assert_equal scan, scan.each { |term, occurrences|
+      assert_kind_of String, term
+      assert_kind_of Integer, occurrences
+      terms << term
+    }
+    assert_equal terms, scan.terms
+    assert_equal [scan.term(0), scan.occurrences(0)], scan[0]
+    assert_equal scan.term(4), scan.term(-1)
+    assert_nil scan.term(5)
+    assert_nil scan[5]
+    assert_kind_of String, scan.display_term(0)
+    assert_equal 5, scan.each.size
+  end
+
+  def test_options_are_not_kept_on_the_connection
+    @conn.scan('@attr 1=4 a', :number => 3, :step_size => 0)
+    assert_nil @conn.get_option('number')
+    assert_nil @conn.get_option('stepSize')
+  end
+
+  def test_next
+    scan = @conn.scan('@attr 1=4 a', :number => 4)
+    after = scan.next
+    assert_equal 4, after.size
+    assert_not_equal scan.terms.last, after.terms.first
+    assert_operator scan.terms.last, :<, after.terms.first
+    assert_equal 2, after.next(2).size
+  end
+
+  def test_query
+    scan = @conn.scan(ZOOM::Query.new_prefix('@attr 1=4 a'))
+    assert_operator scan.size, :>, 0
+    assert_raise(RuntimeError) { scan.next }
+  end
+
+  def test_errors
+    assert_raise(ArgumentError) { @conn.scan('@attr 1=4 @and') }
+  end
+end
@@ -15,4 +15,18 @@ class SearchTest < Test::Unit::TestCase
       assert_equal File.read('test/record.dat'), result_set[0].raw
     end
   end
+
+  def test_marc_fields
+    ZOOM::Connection.open('z3950.loc.gov', 7090) do |conn|
+      conn.database_name = 'Voyager'
+      conn.preferred_record_syntax = 'USMARC'
+      record = conn.search('@attr 1=7 0253333490')[0]
+      assert_equal File.read('test/record.dat', 24), record.leader
+      assert_equal ['The complete dinosaur /'], record.subfields('245', 'a')
+      tag, indicators, subfields = record.marc_fields('245').first
+      assert_equal ['245', '04'], [tag, indicators]
+      assert_equal ['a', 'c'], subfields.map { |code, value| code }
+      assert_equal record.marc_fields, record.each_field.to_a
+    end
+  end
 end
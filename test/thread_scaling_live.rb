@@ -0,0 +1,57 @@
+require File.expand_path('ztest_helper', File.dirname(__FILE__))
+
+class ThreadScalingLiveTest < Test::Unit::TestCase
+
+  # Searches against the "Slow" database of yaz-ztest take about 3 seconds
+  # each.  Connection#connect, #search and ResultSet#[] release the GVL while
+  # they wait on the network, so N threads talking to the server at once
+  # should take about as long as a single search, not N times as long.
+
+  include ZtestServer
+
+  THREADS = 4
+
+  def setup
+    start_ztest
+  end
+
+  def teardown
+    stop_ztest
+  end
+
+  def search_slow
+    ZOOM::Connection.open('localhost:9999/Slow') do |conn|
+      conn.preferred_record_syntax = 'USMARC'
+      result_set = conn.search('@attr 1=4 water')
+      result_set[0, 2]
+    end
+  end
+
+  def elapsed
+    started = Time.now
+    yield
+    Time.now - started
+  end
+
+  def test_threads_overlap
+    serial = elapsed { search_slow }
+    parallel = elapsed do
+      (1..THREADS).map { Thread.new { search_slow } }.each { |t| t.join }
+    end
+
+    # Serialized by the GVL, this would take THREADS times as long.
+    assert(parallel < serial * THREADS / 2)
+  end
+
+  def test_other_threads_keep_running
+    ticks = 0
+    ticker = Thread.new { loop { ticks += 1; sleep 0.1 } }
+    search_slow
+    ticker.kill
+
+    # The ticker would not get a chance to run while search_slow holds the
+    # GVL for its whole 3 seconds.
+    assert(ticks >= 20)
+  end
+
+end
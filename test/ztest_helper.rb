@@ -0,0 +1,40 @@
+require 'socket'
+
+# Runs a local yaz-ztest for the live tests, which include this module and
+# call start_ztest from setup and stop_ztest from teardown.
+#
+# important: you won't be able to run these tests if port 9999 isn't
+# available, or if yaz-ztest is not installed.
+module ZtestServer
+
+  PORT = 9999
+
+  # Starts yaz-ztest, and waits until it accepts connections.
+  def start_ztest
+    @ztest_pid = fork do
+      STDERR.close
+      exec "yaz-ztest tcp:@:#{PORT}"
+    end
+
+    deadline = Time.now + 10
+    begin
+      TCPSocket.new('localhost', PORT).close
+    rescue SystemCallError
+      if Process.waitpid(@ztest_pid, Process::WNOHANG)
+        @ztest_pid = nil
+        raise 'yaz-ztest exited, is it installed?'
+      end
+      raise "yaz-ztest is not listening on port #{PORT}" if Time.now > deadline
+      sleep 0.05
+      retry
+    end
+  end
+
+  def stop_ztest
+    return if @ztest_pid.nil?
+    Process.kill('TERM', @ztest_pid)
+    Process.wait(@ztest_pid)
+    @ztest_pid = nil
+  end
+
+end